@@ -0,0 +1,94 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// arena.c: functions for per-message memory
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "util.h"
+
+#define ARENA_ALIGN 16
+
+// Strings which do not fit in the buffer of the arena
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    char data[];
+};
+
+void arena_init(struct arena *arena, void *buf, const size_t size)
+{
+    arena->buf = buf;
+    arena->size = size;
+    arena->used = 0;
+    arena->chunks = NULL;
+}
+
+void *arena_alloc(struct arena *arena, const size_t len)
+{
+    const size_t used = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (used <= arena->size && len <= arena->size - used)
+    {
+        arena->used = used + len;
+        return &arena->buf[used];
+    }
+
+    struct arena_chunk *chunk = malloc(sizeof *chunk + len);
+    if (!chunk)
+    {
+        LOG_ERROR("malloc %zu", len);
+        return NULL;
+    }
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    return chunk->data;
+}
+
+char *arena_printf(struct arena *arena, const char *format, ...)
+{
+    va_list args;
+    char *str = &arena->buf[arena->used];
+    const size_t avail = arena->size - arena->used;
+
+    // Try the free space first, most strings are short paths
+    va_start(args, format);
+    const int len = vsnprintf(str, avail, format, args);
+    va_end(args);
+    if (len < 0)
+    {
+        LOG_ERROR("vsnprintf(%s)", format);
+        return NULL;
+    }
+
+    if ((size_t)len < avail)
+    {
+        arena->used += len + 1;
+        return str;
+    }
+
+    str = arena_alloc(arena, len + 1);
+    if (!str)
+        return NULL;
+
+    va_start(args, format);
+    vsnprintf(str, len + 1, format, args);
+    va_end(args);
+    return str;
+}
+
+void arena_reset(struct arena *arena)
+{
+    while (arena->chunks)
+    {
+        struct arena_chunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+
+    arena->used = 0;
+}
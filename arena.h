@@ -0,0 +1,28 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// arena.h: functions for per-message memory
+
+#ifndef INITRD_ARENA_H
+#define INITRD_ARENA_H
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+// Bump allocator, everything is freed at once by arena_reset()
+struct arena
+{
+    char *buf;
+    size_t size;
+    size_t used;
+    struct arena_chunk *chunks;
+};
+
+void arena_init(struct arena *arena, void *buf, const size_t size);
+void *arena_alloc(struct arena *arena, const size_t len);
+char *arena_printf(struct arena *arena, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void arena_reset(struct arena *arena);
+
+#endif // INITRD_ARENA_H
@@ -0,0 +1,357 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// child.c: functions for tracking and reaping child processes
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "child.h"
+#include "config.h"
+#include "event.h"
+#include "fs.h"
+#include "mem.h"
+#include "metrics.h"
+#include "net.h"
+#include "trim.h"
+#include "util.h"
+
+#define CHILD_MAX_MOUNTS 2
+#define CHILD_REAP_BATCH 64
+
+enum child_sync_mode
+{
+    CHILD_SYNC_MOUNTS = 0,
+    CHILD_SYNC_ALL = 1,
+    CHILD_SYNC_OFF = 2
+};
+
+struct child_entry
+{
+    struct child_entry *next;
+    pid_t pid;
+    bool internal;
+    child_callback done;
+    void *ctx;
+    int chanFd;
+    int mountCount;
+    int mountFds[CHILD_MAX_MOUNTS];
+};
+
+// Channel of a cloned child to send its mount fds, only valid in the child
+int g_mountChan = -1;
+
+static struct child_entry *g_children = NULL;
+
+static enum child_sync_mode child_sync_mode(void)
+{
+    const char *mode = config_get("reapsync", "mounts");
+
+    if (!strcmp(mode, "all"))
+        return CHILD_SYNC_ALL;
+    if (!strcmp(mode, "off") || !strcmp(mode, "0"))
+        return CHILD_SYNC_OFF;
+    return CHILD_SYNC_MOUNTS;
+}
+
+static void child_recv_mounts(struct child_entry *entry)
+{
+    while (entry->chanFd >= 0)
+    {
+        char data;
+        char control[CMSG_SPACE(sizeof (int))];
+        struct iovec iov = { .iov_base = &data, .iov_len = sizeof data };
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+
+        const ssize_t ret = TEMP_FAILURE_RETRY(recvmsg(entry->chanFd, &msg,
+            MSG_DONTWAIT | MSG_CMSG_CLOEXEC));
+        if (ret < 0 && errno == EAGAIN)
+            return;
+
+        if (ret <= 0)
+        {
+            if (ret < 0)
+                LOG_ERROR("recvmsg %d", errno);
+            event_del(entry->chanFd);
+            close(entry->chanFd);
+            entry->chanFd = -1;
+            return;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        int mountFd;
+        memcpy(&mountFd, CMSG_DATA(cmsg), sizeof mountFd);
+        if (entry->mountCount < CHILD_MAX_MOUNTS)
+        {
+            trim_add(mountFd);
+            entry->mountFds[entry->mountCount++] = mountFd;
+        }
+        else
+            close(mountFd);
+    }
+}
+
+static int on_channel(const int fd, const unsigned int events, void *ctx)
+{
+    child_recv_mounts(ctx);
+    return 0;
+}
+
+// Forget state which belongs to PID 1 only, called in every forked child
+void child_init(void)
+{
+    log_child();
+    pool_child();
+}
+
+int child_channel(int *parentFd, int *childFd)
+{
+    int fds[2];
+
+    const int ret = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds);
+    if (ret < 0)
+    {
+        LOG_ERROR("socketpair %d", errno);
+        *parentFd = *childFd = -1;
+        return ret;
+    }
+
+    *parentFd = fds[0];
+    *childFd = fds[1];
+    return 0;
+}
+
+// Children of PID 1 itself are reaped without telling Lxss, it never launched them
+int child_track_internal(const pid_t pid, const child_callback done, void *ctx)
+{
+    const int ret = child_track(pid, -1);
+    if (ret >= 0)
+    {
+        g_children->internal = true;
+        g_children->done = done;
+        g_children->ctx = ctx;
+    }
+
+    return ret;
+}
+
+int child_track(const pid_t pid, const int chanFd)
+{
+    int ret;
+
+    struct child_entry *entry = calloc(1, sizeof *entry);
+    if (!entry)
+    {
+        LOG_ERROR("calloc %d", pid);
+        close(chanFd);
+        return -1;
+    }
+
+    entry->pid = pid;
+    entry->chanFd = chanFd;
+    if (chanFd >= 0)
+    {
+        ret = event_add(chanFd, EPOLLIN, on_channel, entry);
+        if (ret < 0)
+        {
+            close(chanFd);
+            entry->chanFd = -1;
+        }
+    }
+
+    entry->next = g_children;
+    g_children = entry;
+    return 0;
+}
+
+int child_send_mount(const char *path)
+{
+    int ret;
+
+    if (g_mountChan < 0)
+        return 0;
+
+    const int mountFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mountFd < 0)
+    {
+        LOG_ERROR("open(%s) %d", path, errno);
+        return mountFd;
+    }
+
+    char data = 0;
+    char control[CMSG_SPACE(sizeof (int))];
+    memset(control, 0, sizeof control);
+    struct iovec iov = { .iov_base = &data, .iov_len = sizeof data };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof mountFd);
+    memcpy(CMSG_DATA(cmsg), &mountFd, sizeof mountFd);
+
+    ret = TEMP_FAILURE_RETRY(sendmsg(g_mountChan, &msg, MSG_NOSIGNAL));
+    if (ret < 0)
+        LOG_ERROR("sendmsg(%s) %d", path, errno);
+
+    close(mountFd);
+    return ret;
+}
+
+static struct child_entry *child_remove(const pid_t pid)
+{
+    for (struct child_entry **entry = &g_children; *entry;
+        entry = &(*entry)->next)
+    {
+        if ((*entry)->pid == pid)
+        {
+            struct child_entry *found = *entry;
+            *entry = found->next;
+            return found;
+        }
+    }
+
+    return NULL;
+}
+
+static void child_flush(const int writeSock, const enum child_sync_mode mode,
+    pid_t *pids, const int pidCount, int *syncFds, const int syncCount)
+{
+    ssize_t ret;
+
+    if (mode == CHILD_SYNC_ALL && pidCount)
+        sync();
+
+    for (int i = 0; i < syncCount; i++)
+    {
+        if (mode == CHILD_SYNC_MOUNTS && syncfs(syncFds[i]) < 0)
+            LOG_ERROR("syncfs %d", errno);
+        close(syncFds[i]);
+    }
+
+    // Notify Lxss only after the file systems of exited distros are flushed
+    size_t len = pidCount * sizeof *pids;
+    char *ptr = (char *)pids;
+    while (len)
+    {
+        ret = TEMP_FAILURE_RETRY(write(writeSock, ptr, len));
+        if (ret < 0)
+        {
+            LOG_ERROR("write(writeSock) %d", errno);
+            break;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+
+    metrics_add(METRIC_EXITS_NOTIFIED,
+        (pidCount * sizeof *pids - len) / sizeof *pids);
+}
+
+int child_reap(const int writeSock)
+{
+    const enum child_sync_mode mode = child_sync_mode();
+    pid_t pids[CHILD_REAP_BATCH];
+    int syncFds[CHILD_REAP_BATCH * CHILD_MAX_MOUNTS];
+    dev_t syncDevs[CHILD_REAP_BATCH * CHILD_MAX_MOUNTS];
+    int pidCount = 0, syncCount = 0;
+
+    while (true)
+    {
+        int wstatus;
+        pid_t child = waitpid(-1, &wstatus, WNOHANG);
+        if (!child)
+            break;
+        if (child <= 0)
+        {
+            if (errno != ECHILD)
+                LOG_ERROR("waitpid %d", errno);
+            break;
+        }
+
+        metrics_add(METRIC_CHILDREN_REAPED, 1);
+
+        struct child_entry *entry = child_remove(child);
+        if (entry && entry->internal)
+        {
+            if (entry->done)
+                entry->done(wstatus, entry->ctx);
+            free(entry);
+            continue;
+        }
+
+        pids[pidCount++] = child;
+        mem_group_remove(0, child);
+        if (entry)
+        {
+            // The child may exit before its mount fds are received
+            child_recv_mounts(entry);
+            if (entry->chanFd >= 0)
+            {
+                event_del(entry->chanFd);
+                close(entry->chanFd);
+            }
+
+            for (int i = 0; i < entry->mountCount; i++)
+            {
+                struct stat st;
+                struct statvfs stv;
+                bool duplicate = fstat(entry->mountFds[i], &st) < 0;
+                if (!duplicate)
+                    trim_remove(st.st_dev);
+                if (!duplicate && !fstatvfs(entry->mountFds[i], &stv))
+                {
+                    LOG_INFO("distro %d used %llu bytes of %u:%u", child,
+                        (unsigned long long)(stv.f_blocks - stv.f_bfree)
+                        * stv.f_frsize, major(st.st_dev), minor(st.st_dev));
+                }
+                for (int j = 0; !duplicate && j < syncCount; j++)
+                    duplicate = syncDevs[j] == st.st_dev;
+
+                if (duplicate)
+                {
+                    close(entry->mountFds[i]);
+                    continue;
+                }
+
+                syncDevs[syncCount] = st.st_dev;
+                syncFds[syncCount++] = entry->mountFds[i];
+            }
+            free(entry);
+        }
+
+        if (pidCount == CHILD_REAP_BATCH)
+        {
+            child_flush(writeSock, mode, pids, pidCount, syncFds, syncCount);
+            pidCount = syncCount = 0;
+        }
+    }
+
+    if (pidCount)
+        child_flush(writeSock, mode, pids, pidCount, syncFds, syncCount);
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// child.h: functions for tracking and reaping child processes
+
+#ifndef INITRD_CHILD_H
+#define INITRD_CHILD_H
+
+#include <sys/types.h>
+
+// Called with the wait status when an internal child is reaped
+typedef void (*child_callback)(const int status, void *ctx);
+
+extern int g_mountChan;
+
+void child_init(void);
+int child_channel(int *parentFd, int *childFd);
+int child_track(const pid_t pid, const int chanFd);
+int child_track_internal(const pid_t pid, const child_callback done,
+    void *ctx);
+int child_send_mount(const char *path);
+int child_reap(const int writeSock);
+
+#endif // INITRD_CHILD_H
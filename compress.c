@@ -0,0 +1,1146 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// compress.c: functions for compressed distribution streams
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "config.h"
+#include "trace.h"
+#include "util.h"
+
+#define COMPRESS_MAX_THREADS 16
+#define COMPRESS_PIPE_SIZE 0x100000
+
+// Blocks of 1 MiB are written, hosts may send up to 4 MiB blocks
+#define LZ4_WRITE_BLOCK_ID 6
+#define LZ4_WRITE_BLOCK_SIZE 0x100000
+#define LZ4_MAGIC 0x184D2204
+#define LZ4_SKIPPABLE_MAGIC 0x184D2A50
+#define LZ4_SKIPPABLE_MASK 0xFFFFFFF0
+#define LZ4_FLG_VERSION 0x40
+#define LZ4_FLG_BLOCK_INDEP 0x20
+#define LZ4_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID 0x01
+#define LZ4_BLOCK_RAW 0x80000000
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_MAX_DISTANCE 65535
+#define ZSTD_MAGIC 0xFD2FB528
+#define ZSTD_BLOCK_RLE 1
+#define ZSTD_BLOCK_RESERVED 3
+#define ZSTD_COPY_SIZE 0x10000
+
+#define XXH_PRIME1 2654435761U
+#define XXH_PRIME2 2246822519U
+#define XXH_PRIME3 3266489917U
+#define XXH_PRIME4 668265263U
+#define XXH_PRIME5 374761393U
+
+// Streaming xxHash32 for lz4 frame checksums
+struct xxh32
+{
+    uint32_t v[4];
+    uint32_t total;
+    bool large;
+    unsigned char mem[16];
+    unsigned int memLen;
+};
+
+enum compress_job_state
+{
+    JOB_FREE,
+    JOB_READY,
+    JOB_DONE
+};
+
+struct compress_job
+{
+    enum compress_job_state state;
+    unsigned char *in;
+    size_t inLen;
+    unsigned char *out;
+    size_t outLen;
+    size_t bufSize;
+    // Stored blocks are passed as they are
+    bool raw;
+    // End of lz4 frame with content checksum to verify
+    bool frameEnd;
+    bool checkContent;
+    uint32_t checksum;
+    int error;
+};
+
+struct compress_filter
+{
+    int sock;
+    int pipeFd;
+    bool encode;
+    int hashBits;
+    int threadCount;
+    pthread_t thread;
+    pthread_t workers[COMPRESS_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+    struct compress_job *jobs;
+    int jobCount;
+    // Sequence numbers of jobs, head is submitted, next is taken by workers
+    unsigned long head;
+    unsigned long next;
+    unsigned long tail;
+    bool stop;
+    int ret;
+    // State of the frame being decoded
+    bool inFrame;
+    bool blockChecksum;
+    bool contentChecksum;
+    size_t blockMax;
+    struct xxh32 hash;
+    unsigned long long inTotal;
+    unsigned long long outTotal;
+};
+
+enum initrd_compression compress_config(int *level)
+{
+    const char *codec = config_get("compress", "none");
+    enum initrd_compression compression = COMPRESSION_NONE;
+
+    if (!strcmp(codec, "lz4"))
+        compression = COMPRESSION_LZ4;
+    else if (!strcmp(codec, "zstd"))
+        compression = COMPRESSION_ZSTD;
+    else if (strcmp(codec, "none"))
+        LOG_ERROR("unknown initrd.compress=%s", codec);
+
+    // zstd default level is 3, lz4 levels only change the match finder
+    *level = config_long("compress.level",
+        compression == COMPRESSION_ZSTD ? 3 : 1);
+    return compression;
+}
+
+int compress_threads(void)
+{
+    long threads = config_long("compress.threads",
+        sysconf(_SC_NPROCESSORS_ONLN));
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > COMPRESS_MAX_THREADS)
+        threads = COMPRESS_MAX_THREADS;
+    return threads;
+}
+
+enum initrd_compression compress_detect(const int sock)
+{
+    uint32_t magic;
+
+    // Peek so that plain streams are passed to tar engine untouched
+    const ssize_t ret = TEMP_FAILURE_RETRY(recv(sock, &magic, sizeof magic,
+        MSG_PEEK | MSG_WAITALL));
+    if (ret != sizeof magic)
+        return COMPRESSION_NONE;
+
+    if (magic == LZ4_MAGIC
+        || (magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC)
+    {
+        return COMPRESSION_LZ4;
+    }
+    if (magic == ZSTD_MAGIC)
+        return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+}
+
+static uint32_t compress_read32(const void *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof value);
+    return value;
+}
+
+static void compress_write32(void *ptr, const uint32_t value)
+{
+    memcpy(ptr, &value, sizeof value);
+}
+
+/*
+ * xxHash32
+ */
+
+static uint32_t xxh32_rotl(const uint32_t value, const int bits)
+{
+    return value << bits | value >> (32 - bits);
+}
+
+static uint32_t xxh32_round(uint32_t acc, const uint32_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = xxh32_rotl(acc, 13);
+    return acc * XXH_PRIME1;
+}
+
+static void xxh32_init(struct xxh32 *state)
+{
+    memset(state, 0, sizeof *state);
+    state->v[0] = XXH_PRIME1 + XXH_PRIME2;
+    state->v[1] = XXH_PRIME2;
+    state->v[2] = 0;
+    state->v[3] = -XXH_PRIME1;
+}
+
+static void xxh32_update(struct xxh32 *state, const unsigned char *data,
+    size_t len)
+{
+    state->total += len;
+    state->large |= len >= 16 || state->total >= 16;
+
+    if (state->memLen + len < 16)
+    {
+        memcpy(&state->mem[state->memLen], data, len);
+        state->memLen += len;
+        return;
+    }
+
+    if (state->memLen)
+    {
+        const size_t fill = 16 - state->memLen;
+        memcpy(&state->mem[state->memLen], data, fill);
+        for (int i = 0; i < 4; i++)
+        {
+            state->v[i] = xxh32_round(state->v[i],
+                compress_read32(&state->mem[i * 4]));
+        }
+        data += fill;
+        len -= fill;
+        state->memLen = 0;
+    }
+
+    for (; len >= 16; data += 16, len -= 16)
+    {
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh32_round(state->v[i], compress_read32(&data[i * 4]));
+    }
+
+    memcpy(state->mem, data, len);
+    state->memLen = len;
+}
+
+static uint32_t xxh32_digest(const struct xxh32 *state)
+{
+    uint32_t hash;
+
+    if (state->large)
+    {
+        hash = xxh32_rotl(state->v[0], 1) + xxh32_rotl(state->v[1], 7)
+            + xxh32_rotl(state->v[2], 12) + xxh32_rotl(state->v[3], 18);
+    }
+    else
+        hash = state->v[2] + XXH_PRIME5;
+
+    hash += state->total;
+
+    unsigned int i = 0;
+    for (; i + 4 <= state->memLen; i += 4)
+    {
+        hash += compress_read32(&state->mem[i]) * XXH_PRIME3;
+        hash = xxh32_rotl(hash, 17) * XXH_PRIME4;
+    }
+    for (; i < state->memLen; i++)
+    {
+        hash += state->mem[i] * XXH_PRIME5;
+        hash = xxh32_rotl(hash, 11) * XXH_PRIME1;
+    }
+
+    hash ^= hash >> 15;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 13;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static uint32_t xxh32(const unsigned char *data, const size_t len)
+{
+    struct xxh32 state;
+
+    xxh32_init(&state);
+    xxh32_update(&state, data, len);
+    return xxh32_digest(&state);
+}
+
+/*
+ * LZ4 block format
+ */
+
+static unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+static unsigned char *lz4_put_literals(unsigned char *op, unsigned char *token,
+    const unsigned char *anchor, const size_t len)
+{
+    if (len >= 15)
+    {
+        *token = 15 << 4;
+        op = lz4_put_length(op, len - 15);
+    }
+    else
+        *token = len << 4;
+
+    memcpy(op, anchor, len);
+    return op + len;
+}
+
+// Greedy single probe match finder, returns 0 if output does not fit
+static size_t lz4_compress(const unsigned char *src, const size_t srcLen,
+    unsigned char *dst, const size_t dstCap, uint32_t *table,
+    const int hashBits)
+{
+    const unsigned char *ip = src, *anchor = src;
+    const unsigned char *const end = src + srcLen;
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + dstCap;
+
+    memset(table, 0, sizeof *table << hashBits);
+
+    if (srcLen > LZ4_MF_LIMIT)
+    {
+        const unsigned char *const mfLimit = end - LZ4_MF_LIMIT;
+        const unsigned char *const matchLimit = end - LZ4_LAST_LITERALS;
+
+        while (ip < mfLimit)
+        {
+            const uint32_t seq = compress_read32(ip);
+            const uint32_t hash = seq * XXH_PRIME1 >> (32 - hashBits);
+            const unsigned char *ref = src + table[hash];
+            table[hash] = ip - src;
+
+            if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE
+                || compress_read32(ref) != seq)
+            {
+                // Step faster over data which does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+
+            const unsigned char *matchEnd = ip + LZ4_MIN_MATCH;
+            const unsigned char *refEnd = ref + LZ4_MIN_MATCH;
+            while (matchEnd < matchLimit && *matchEnd == *refEnd)
+            {
+                matchEnd++;
+                refEnd++;
+            }
+
+            const size_t litLen = ip - anchor;
+            const size_t matchLen = matchEnd - ip - LZ4_MIN_MATCH;
+            if ((size_t)(oend - op) < litLen + litLen / 255 + matchLen / 255 + 5)
+                return 0;
+
+            unsigned char *token = op++;
+            op = lz4_put_literals(op, token, anchor, litLen);
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            if (matchLen >= 15)
+            {
+                *token |= 15;
+                op = lz4_put_length(op, matchLen - 15);
+            }
+            else
+                *token |= matchLen;
+
+            ip = anchor = matchEnd;
+            table[compress_read32(ip - 2) * XXH_PRIME1 >> (32 - hashBits)] =
+                ip - 2 - src;
+        }
+    }
+
+    const size_t litLen = end - anchor;
+    if ((size_t)(oend - op) < litLen + litLen / 255 + 2)
+        return 0;
+
+    unsigned char *token = op++;
+    op = lz4_put_literals(op, token, anchor, litLen);
+    return op - dst;
+}
+
+static ssize_t lz4_decompress(const unsigned char *src, const size_t srcLen,
+    unsigned char *dst, const size_t dstCap)
+{
+    const unsigned char *ip = src;
+    const unsigned char *const iend = src + srcLen;
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + dstCap;
+
+    while (ip < iend)
+    {
+        const unsigned int token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15)
+        {
+            unsigned char byte;
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                byte = *ip++;
+                len += byte;
+            } while (byte == 255);
+        }
+
+        if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        // Last sequence has only literals
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        const size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!offset || offset > (size_t)(op - dst))
+            return -1;
+
+        len = token & 15;
+        if (len == 15)
+        {
+            unsigned char byte;
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                byte = *ip++;
+                len += byte;
+            } while (byte == 255);
+        }
+        len += LZ4_MIN_MATCH;
+
+        if ((size_t)(oend - op) < len)
+            return -1;
+
+        const unsigned char *match = op - offset;
+        if (offset >= len)
+        {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else
+        {
+            while (len--)
+                *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
+
+/*
+ * Filter
+ */
+
+// Returns bytes read which is less than len only at end of stream
+static ssize_t compress_read_full(const int fd, void *buf, const size_t len)
+{
+    size_t done = 0;
+
+    while (done < len)
+    {
+        const ssize_t ret = TEMP_FAILURE_RETRY(read(fd, (char *)buf + done,
+            len - done));
+        if (ret < 0)
+        {
+            LOG_ERROR("read %d", errno);
+            return ret;
+        }
+        if (!ret)
+            break;
+        done += ret;
+    }
+
+    return done;
+}
+
+static int compress_write_full(const int fd, const void *buf, size_t len)
+{
+    const char *ptr = buf;
+
+    while (len)
+    {
+        const ssize_t ret = TEMP_FAILURE_RETRY(write(fd, ptr, len));
+        if (ret < 0)
+        {
+            // Tar engine stopped reading at end of archive
+            if (errno != EPIPE)
+                LOG_ERROR("write %d", errno);
+            return ret;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int compress_job_buffer(struct compress_job *job, const size_t size)
+{
+    if (job->bufSize >= size)
+        return 0;
+
+    unsigned char *in = realloc(job->in, size);
+    if (in)
+        job->in = in;
+    unsigned char *out = realloc(job->out, size);
+    if (out)
+        job->out = out;
+    if (!in || !out)
+    {
+        LOG_ERROR("realloc %zu", size);
+        return -1;
+    }
+
+    job->bufSize = size;
+    return 0;
+}
+
+static void compress_process(struct compress_filter *filter,
+    struct compress_job *job, uint32_t *table)
+{
+    if (job->frameEnd)
+        return;
+
+    // Store blocks as they are if there is no memory for match table
+    if (filter->encode)
+    {
+        job->outLen = !table ? 0 : lz4_compress(job->in, job->inLen, job->out,
+            job->inLen - 1, table, filter->hashBits);
+        job->raw = !job->outLen;
+        return;
+    }
+
+    if (job->raw)
+        return;
+
+    const ssize_t len = lz4_decompress(job->in, job->inLen, job->out,
+        job->bufSize);
+    if (len < 0)
+        job->error = -1;
+    else
+        job->outLen = len;
+}
+
+static void *compress_worker(void *arg)
+{
+    struct compress_filter *filter = arg;
+    uint32_t *table = NULL;
+
+    if (filter->encode)
+    {
+        table = malloc(sizeof *table << filter->hashBits);
+        if (!table)
+            LOG_ERROR("malloc %d", filter->hashBits);
+    }
+
+    pthread_mutex_lock(&filter->lock);
+    while (true)
+    {
+        while (!filter->stop && filter->next == filter->head)
+            pthread_cond_wait(&filter->ready, &filter->lock);
+        if (filter->stop)
+            break;
+
+        struct compress_job *job = &filter->jobs[filter->next++ % filter->jobCount];
+        pthread_mutex_unlock(&filter->lock);
+
+        compress_process(filter, job, table);
+
+        pthread_mutex_lock(&filter->lock);
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&filter->done);
+    }
+    pthread_mutex_unlock(&filter->lock);
+
+    free(table);
+    return NULL;
+}
+
+static void compress_submit(struct compress_filter *filter,
+    struct compress_job *job)
+{
+    pthread_mutex_lock(&filter->lock);
+    job->state = JOB_READY;
+    filter->head++;
+    pthread_cond_signal(&filter->ready);
+    pthread_mutex_unlock(&filter->lock);
+}
+
+static int lz4_write_header(struct compress_filter *filter)
+{
+    unsigned char header[7];
+
+    compress_write32(header, LZ4_MAGIC);
+    header[4] = LZ4_FLG_VERSION | LZ4_FLG_BLOCK_INDEP | LZ4_FLG_CONTENT_CHECKSUM;
+    header[5] = LZ4_WRITE_BLOCK_ID << 4;
+    header[6] = xxh32(&header[4], 2) >> 8 & 0xff;
+
+    filter->outTotal += sizeof header;
+    return compress_write_full(filter->sock, header, sizeof header);
+}
+
+// Returns 0 at end of stream, 1 if a frame starts
+static int lz4_read_header(struct compress_filter *filter)
+{
+    unsigned char header[15];
+
+    while (true)
+    {
+        ssize_t ret = compress_read_full(filter->sock, header, 4);
+        if (ret < 0)
+            return ret;
+        if (!ret)
+            return 0;
+        if (ret != 4)
+        {
+            LOG_ERROR("truncated lz4 frame at %llu", filter->inTotal);
+            return -1;
+        }
+        filter->inTotal += ret;
+
+        const uint32_t magic = compress_read32(header);
+        if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC)
+        {
+            if (compress_read_full(filter->sock, header, 4) != 4)
+                return -1;
+
+            unsigned char skip[4096];
+            for (uint32_t len = compress_read32(header); len; )
+            {
+                const size_t count = len < sizeof skip ? len : sizeof skip;
+                if (compress_read_full(filter->sock, skip, count) != count)
+                    return -1;
+                len -= count;
+            }
+            continue;
+        }
+
+        if (magic != LZ4_MAGIC)
+        {
+            LOG_ERROR("bad lz4 magic %x", magic);
+            return -1;
+        }
+        break;
+    }
+
+    if (compress_read_full(filter->sock, header, 2) != 2)
+        return -1;
+
+    const unsigned char flags = header[0];
+    size_t len = 2 + ((flags & LZ4_FLG_CONTENT_SIZE) ? 8 : 0)
+        + ((flags & LZ4_FLG_DICT_ID) ? 4 : 0);
+    if (compress_read_full(filter->sock, &header[2], len - 2 + 1) != len - 2 + 1)
+        return -1;
+    filter->inTotal += len + 1;
+
+    if ((flags & 0xc0) != LZ4_FLG_VERSION || (xxh32(header, len) >> 8 & 0xff) != header[len])
+    {
+        LOG_ERROR("bad lz4 frame header at %llu", filter->inTotal);
+        return -1;
+    }
+
+    // Linked blocks reference previous block and can not be decoded apart
+    if (!(flags & LZ4_FLG_BLOCK_INDEP))
+    {
+        LOG_ERROR("lz4 linked blocks are not supported %x", flags);
+        return -1;
+    }
+
+    const int blockId = header[1] >> 4 & 0x7;
+    if (blockId < 4)
+    {
+        LOG_ERROR("bad lz4 block size %d", blockId);
+        return -1;
+    }
+
+    filter->blockMax = (size_t)1 << (8 + 2 * blockId);
+    filter->blockChecksum = flags & LZ4_FLG_BLOCK_CHECKSUM;
+    filter->contentChecksum = flags & LZ4_FLG_CONTENT_CHECKSUM;
+    xxh32_init(&filter->hash);
+    return 1;
+}
+
+// Fill job with next input, returns 0 at end of input
+static int compress_read_job(struct compress_filter *filter,
+    struct compress_job *job)
+{
+    job->raw = false;
+    job->frameEnd = false;
+    job->checkContent = false;
+    job->error = 0;
+    job->inLen = 0;
+    job->outLen = 0;
+
+    if (filter->encode)
+    {
+        if (compress_job_buffer(job, LZ4_WRITE_BLOCK_SIZE) < 0)
+            return -1;
+
+        const ssize_t ret = compress_read_full(filter->pipeFd, job->in,
+            LZ4_WRITE_BLOCK_SIZE);
+        if (ret < 0)
+            return ret;
+
+        job->inLen = ret;
+        filter->inTotal += ret;
+        xxh32_update(&filter->hash, job->in, ret);
+        return ret > 0;
+    }
+
+    if (!filter->inFrame)
+    {
+        const int ret = lz4_read_header(filter);
+        if (ret <= 0)
+            return ret;
+        filter->inFrame = true;
+    }
+
+    unsigned char word[4];
+    if (compress_read_full(filter->sock, word, sizeof word) != sizeof word)
+    {
+        LOG_ERROR("truncated lz4 frame at %llu", filter->inTotal);
+        return -1;
+    }
+    filter->inTotal += sizeof word;
+
+    uint32_t size = compress_read32(word);
+    if (!size)
+    {
+        job->frameEnd = true;
+        filter->inFrame = false;
+        if (filter->contentChecksum)
+        {
+            if (compress_read_full(filter->sock, word, sizeof word) != sizeof word)
+                return -1;
+            filter->inTotal += sizeof word;
+            job->checkContent = true;
+            job->checksum = compress_read32(word);
+        }
+        return 1;
+    }
+
+    job->raw = size & LZ4_BLOCK_RAW;
+    size &= ~LZ4_BLOCK_RAW;
+    if (size > filter->blockMax || compress_job_buffer(job, filter->blockMax) < 0)
+    {
+        LOG_ERROR("bad lz4 block size %u", size);
+        return -1;
+    }
+
+    if (compress_read_full(filter->sock, job->in, size) != size
+        || (filter->blockChecksum
+            && compress_read_full(filter->sock, word, sizeof word) != sizeof word))
+    {
+        LOG_ERROR("truncated lz4 block at %llu", filter->inTotal);
+        return -1;
+    }
+
+    job->inLen = size;
+    filter->inTotal += size + (filter->blockChecksum ? sizeof word : 0);
+    return 1;
+}
+
+static int compress_write_job(struct compress_filter *filter,
+    struct compress_job *job)
+{
+    if (job->error)
+    {
+        LOG_ERROR("corrupted lz4 block %zu", job->inLen);
+        return -1;
+    }
+
+    if (filter->encode)
+    {
+        unsigned char word[4];
+        const size_t len = job->raw ? job->inLen : job->outLen;
+        compress_write32(word, len | (job->raw ? LZ4_BLOCK_RAW : 0));
+
+        filter->outTotal += sizeof word + len;
+        if (compress_write_full(filter->sock, word, sizeof word) < 0)
+            return -1;
+        return compress_write_full(filter->sock, job->raw ? job->in : job->out,
+            len);
+    }
+
+    if (job->frameEnd)
+    {
+        if (job->checkContent && xxh32_digest(&filter->hash) != job->checksum)
+        {
+            LOG_ERROR("lz4 content checksum %x mismatch", job->checksum);
+            return -1;
+        }
+        return 0;
+    }
+
+    const unsigned char *data = job->raw ? job->in : job->out;
+    const size_t len = job->raw ? job->inLen : job->outLen;
+    if (filter->contentChecksum)
+        xxh32_update(&filter->hash, data, len);
+
+    filter->outTotal += len;
+    return compress_write_full(filter->pipeFd, data, len);
+}
+
+// Reads blocks in order, workers code them and they are written in order
+static void *compress_thread(void *arg)
+{
+    int ret = 0;
+    bool eof = false;
+    struct compress_filter *filter = arg;
+    const long long start = trace_now();
+
+    if (filter->encode)
+    {
+        xxh32_init(&filter->hash);
+        ret = lz4_write_header(filter);
+    }
+
+    while (ret >= 0 && (!eof || filter->tail < filter->head))
+    {
+        if (!eof && filter->head - filter->tail < filter->jobCount)
+        {
+            struct compress_job *job = &filter->jobs[filter->head % filter->jobCount];
+            ret = compress_read_job(filter, job);
+            if (ret < 0)
+                break;
+
+            if (ret)
+                compress_submit(filter, job);
+            else
+                eof = true;
+        }
+
+        pthread_mutex_lock(&filter->lock);
+        while (filter->tail < filter->head)
+        {
+            struct compress_job *job = &filter->jobs[filter->tail % filter->jobCount];
+            if (job->state != JOB_DONE)
+            {
+                // Keep reading while there are free jobs
+                if (!eof && filter->head - filter->tail < filter->jobCount)
+                    break;
+                pthread_cond_wait(&filter->done, &filter->lock);
+                continue;
+            }
+
+            pthread_mutex_unlock(&filter->lock);
+            ret = compress_write_job(filter, job);
+            pthread_mutex_lock(&filter->lock);
+
+            job->state = JOB_FREE;
+            filter->tail++;
+            if (ret < 0)
+                break;
+        }
+        pthread_mutex_unlock(&filter->lock);
+    }
+
+    if (ret >= 0 && filter->encode)
+    {
+        unsigned char trailer[8];
+        compress_write32(trailer, 0);
+        compress_write32(&trailer[4], xxh32_digest(&filter->hash));
+        filter->outTotal += sizeof trailer;
+        ret = compress_write_full(filter->sock, trailer, sizeof trailer);
+    }
+
+    pthread_mutex_lock(&filter->lock);
+    filter->stop = true;
+    pthread_cond_broadcast(&filter->ready);
+    pthread_mutex_unlock(&filter->lock);
+    for (int i = 0; i < filter->threadCount; i++)
+        pthread_join(filter->workers[i], NULL);
+
+    // Tar engine sees end of stream or broken pipe now
+    close(filter->pipeFd);
+    filter->pipeFd = -1;
+
+    // Leftover padding after end of archive is not an error
+    if (ret < 0 && !filter->encode && errno == EPIPE)
+        ret = 0;
+    filter->ret = ret;
+
+    const long long usec = trace_now() - start;
+    LOG_INFO("lz4 %s %llu to %llu bytes in %lld ms with %d threads",
+        filter->encode ? "encode" : "decode", filter->inTotal,
+        filter->outTotal, usec / 1000, filter->threadCount);
+    trace_event("tar", filter->encode ? "lz4_encode" : "lz4_decode", start,
+        filter->threadCount);
+    return NULL;
+}
+
+static void compress_free(struct compress_filter *filter)
+{
+    for (int i = 0; i < filter->jobCount; i++)
+    {
+        free(filter->jobs[i].in);
+        free(filter->jobs[i].out);
+    }
+    free(filter->jobs);
+    if (filter->pipeFd >= 0)
+        close(filter->pipeFd);
+    pthread_cond_destroy(&filter->done);
+    pthread_cond_destroy(&filter->ready);
+    pthread_mutex_destroy(&filter->lock);
+    free(filter);
+}
+
+struct compress_filter *compress_open(const int sock, const bool encode,
+    const int level, int *pipeFd)
+{
+    int ret;
+    int fds[2];
+
+    struct compress_filter *filter = calloc(1, sizeof *filter);
+    if (!filter)
+    {
+        LOG_ERROR("calloc %zu", sizeof *filter);
+        return NULL;
+    }
+
+    // Higher levels use larger match tables
+    filter->sock = sock;
+    filter->encode = encode;
+    filter->hashBits = 11 + (level < 1 ? 1 : level > 9 ? 9 : level);
+    filter->threadCount = compress_threads();
+    filter->jobCount = filter->threadCount + 2;
+    filter->pipeFd = -1;
+    pthread_mutex_init(&filter->lock, NULL);
+    pthread_cond_init(&filter->ready, NULL);
+    pthread_cond_init(&filter->done, NULL);
+
+    filter->jobs = calloc(filter->jobCount, sizeof *filter->jobs);
+    if (!filter->jobs)
+    {
+        LOG_ERROR("calloc %d", filter->jobCount);
+        goto cleanup;
+    }
+
+    ret = pipe2(fds, O_CLOEXEC);
+    if (ret < 0)
+    {
+        LOG_ERROR("pipe2 %d", errno);
+        goto cleanup;
+    }
+    fcntl(fds[0], F_SETPIPE_SZ, COMPRESS_PIPE_SIZE);
+
+    // Encoder reads what tar engine writes, decoder writes what it reads
+    filter->pipeFd = encode ? fds[0] : fds[1];
+    *pipeFd = encode ? fds[1] : fds[0];
+
+    // Writes to a closed pipe fail with EPIPE instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < filter->threadCount; i++)
+    {
+        ret = pthread_create(&filter->workers[i], NULL, compress_worker, filter);
+        if (ret)
+        {
+            LOG_ERROR("pthread_create %d", ret);
+            filter->threadCount = i;
+            break;
+        }
+    }
+
+    ret = filter->threadCount ? pthread_create(&filter->thread, NULL,
+        compress_thread, filter) : -1;
+    if (ret)
+    {
+        LOG_ERROR("pthread_create %d", ret);
+        pthread_mutex_lock(&filter->lock);
+        filter->stop = true;
+        pthread_cond_broadcast(&filter->ready);
+        pthread_mutex_unlock(&filter->lock);
+        for (int i = 0; i < filter->threadCount; i++)
+            pthread_join(filter->workers[i], NULL);
+        close(*pipeFd);
+        *pipeFd = -1;
+        goto cleanup;
+    }
+
+    return filter;
+
+cleanup:
+    compress_free(filter);
+    return NULL;
+}
+
+int compress_close(struct compress_filter *filter)
+{
+    pthread_join(filter->thread, NULL);
+
+    const int ret = filter->ret;
+    compress_free(filter);
+    return ret;
+}
+
+/*
+ * zstd frames
+ */
+
+// Copies len bytes of a frame or skippable frame
+static int zstd_copy(const int inFd, const int outFd, unsigned char *buf,
+    size_t len)
+{
+    while (len)
+    {
+        const size_t count = len < ZSTD_COPY_SIZE ? len : ZSTD_COPY_SIZE;
+        if (compress_read_full(inFd, buf, count) != count)
+        {
+            LOG_ERROR("truncated zstd frame %zu", len);
+            return -1;
+        }
+        if (compress_write_full(outFd, buf, count) < 0)
+            return -1;
+        len -= count;
+    }
+
+    return 0;
+}
+
+static int zstd_copy_frame(const int inFd, const int outFd, unsigned char *buf)
+{
+    static const size_t dictSize[] = { 0, 1, 2, 4 };
+    static const size_t contentSize[] = { 0, 2, 4, 8 };
+
+    if (zstd_copy(inFd, outFd, buf, 1) < 0)
+        return -1;
+
+    // Window descriptor, dictionary id and content size follow descriptor
+    const unsigned char desc = buf[0];
+    const bool single = desc & 0x20;
+    const size_t len = !single + dictSize[desc & 0x3]
+        + (single && !(desc >> 6) ? 1 : contentSize[desc >> 6]);
+    if (zstd_copy(inFd, outFd, buf, len) < 0)
+        return -1;
+
+    bool last = false;
+    while (!last)
+    {
+        if (zstd_copy(inFd, outFd, buf, 3) < 0)
+            return -1;
+
+        const uint32_t header = buf[0] | buf[1] << 8 | buf[2] << 16;
+        const int type = header >> 1 & 0x3;
+        if (type == ZSTD_BLOCK_RESERVED)
+        {
+            LOG_ERROR("bad zstd block %x", header);
+            return -1;
+        }
+
+        last = header & 0x1;
+        if (zstd_copy(inFd, outFd, buf,
+            type == ZSTD_BLOCK_RLE ? 1 : header >> 3) < 0)
+        {
+            return -1;
+        }
+    }
+
+    // Content checksum
+    return zstd_copy(inFd, outFd, buf, (desc & 0x4) ? 4 : 0);
+}
+
+// Zeros after the last frame are the padding of last block by libarchive
+static int zstd_check_padding(const int inFd, unsigned char *buf, size_t len)
+{
+    ssize_t ret = len;
+
+    while (ret > 0)
+    {
+        for (ssize_t i = 0; i < ret; i++)
+        {
+            if (buf[i])
+            {
+                LOG_ERROR("garbage after zstd frame %x", buf[i]);
+                return -1;
+            }
+        }
+        ret = compress_read_full(inFd, buf, ZSTD_COPY_SIZE);
+    }
+
+    return ret;
+}
+
+int compress_zstd_copy(const int inFd, const int outFd)
+{
+    const long long start = trace_now();
+
+    unsigned char *buf = malloc(ZSTD_COPY_SIZE);
+    if (!buf)
+    {
+        LOG_ERROR("malloc %d", ZSTD_COPY_SIZE);
+        return -1;
+    }
+
+    int ret;
+    while (true)
+    {
+        const ssize_t len = compress_read_full(inFd, buf, 4);
+        if (len <= 0)
+        {
+            ret = len;
+            break;
+        }
+
+        const uint32_t magic = compress_read32(buf);
+        if (len != 4 || (magic != ZSTD_MAGIC
+            && (magic & LZ4_SKIPPABLE_MASK) != LZ4_SKIPPABLE_MAGIC))
+        {
+            ret = zstd_check_padding(inFd, buf, len);
+            break;
+        }
+
+        ret = compress_write_full(outFd, buf, 4);
+        if (ret < 0)
+            break;
+
+        // Skippable frames of zstd are the same as of lz4
+        if (magic != ZSTD_MAGIC)
+        {
+            ret = zstd_copy(inFd, outFd, buf, 4);
+            if (ret < 0)
+                break;
+            ret = zstd_copy(inFd, outFd, buf, compress_read32(buf));
+        }
+        else
+            ret = zstd_copy_frame(inFd, outFd, buf);
+        if (ret < 0)
+            break;
+    }
+
+    free(buf);
+    trace_event("tar", "zstd_copy", start, ret);
+    return ret;
+}
@@ -0,0 +1,32 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// compress.h: functions for compressed distribution streams
+
+#ifndef INITRD_COMPRESS_H
+#define INITRD_COMPRESS_H
+
+#include <stdbool.h>
+
+enum initrd_compression
+{
+    COMPRESSION_NONE = 0,
+    COMPRESSION_LZ4 = 1,
+    COMPRESSION_ZSTD = 2
+};
+
+struct compress_filter;
+
+enum initrd_compression compress_config(int *level);
+int compress_threads(void);
+enum initrd_compression compress_detect(const int sock);
+
+// Returns pipe end for tar engine in pipeFd, close it before compress_close
+struct compress_filter *compress_open(const int sock, const bool encode,
+    const int level, int *pipeFd);
+int compress_close(struct compress_filter *filter);
+
+// Copies zstd frames and drops zero padding after them
+int compress_zstd_copy(const int inFd, const int outFd);
+
+#endif // INITRD_COMPRESS_H
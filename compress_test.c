@@ -0,0 +1,225 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// compress_test.c: round trip of lz4 frames, copy of zstd frames and
+// rejection of broken ones
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compress.h"
+
+// Some blocks of 1 MiB and a short one, text is matched and noise is stored
+#define TEST_SIZE (4 * 0x100000 + 12345)
+#define TEST_NOISE 0x100000
+#define TEST_LEVEL 1
+
+static int g_failed = 0;
+
+// Made by lz4 command line tool from "hello hello hello hello hello hello\n"
+static const unsigned char g_frame[] = {
+    0x04, 0x22, 0x4d, 0x18, 0x64, 0x40, 0xa7, 0x10, 0x00, 0x00, 0x00, 0x6f,
+    0x68, 0x65, 0x6c, 0x6c, 0x6f, 0x20, 0x06, 0x00, 0x06, 0x50, 0x65, 0x6c,
+    0x6c, 0x6f, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x53, 0xce, 0x99, 0x36
+};
+
+// Made by zstd command line tool from the same text
+static const unsigned char g_zstdFrame[] = {
+    0x28, 0xb5, 0x2f, 0xfd, 0x04, 0x58, 0x6d, 0x00, 0x00, 0x38, 0x68, 0x65,
+    0x6c, 0x6c, 0x6f, 0x20, 0x0a, 0x01, 0x00, 0xb9, 0x4b, 0x11, 0x6b, 0x1f,
+    0x08, 0x67
+};
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            g_failed = 1; \
+        } \
+    } while (0)
+
+static void test_data(unsigned char *data, const size_t len)
+{
+    unsigned int seed = 1;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (i >= TEST_NOISE && i < 2 * TEST_NOISE)
+        {
+            seed = seed * 1103515245 + 12345;
+            data[i] = seed >> 16;
+        }
+        else
+            data[i] = "initrd lz4 test\n"[i % 16] + (i / 4096 % 3);
+    }
+}
+
+// Frames go through a file as the filter reads and writes it like a socket
+static int test_file(const unsigned char *data, const size_t len)
+{
+    char path[] = "/tmp/compress_testXXXXXX";
+
+    const int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+
+    if ((data && write(fd, data, len) != len) || lseek(fd, 0, SEEK_SET) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int test_encode(const int fd, const unsigned char *data, const size_t len)
+{
+    int pipeFd;
+
+    struct compress_filter *filter = compress_open(fd, true, TEST_LEVEL, &pipeFd);
+    if (!filter)
+        return -1;
+
+    int ret = 0;
+    for (size_t done = 0; done < len; )
+    {
+        const ssize_t count = write(pipeFd, data + done, len - done);
+        if (count < 0)
+        {
+            ret = -1;
+            break;
+        }
+        done += count;
+    }
+
+    close(pipeFd);
+    if (compress_close(filter) < 0)
+        ret = -1;
+    return ret;
+}
+
+// Returns decoded length or -1 if the filter fails
+static ssize_t test_decode(const int fd, unsigned char *out, const size_t size)
+{
+    int pipeFd;
+    size_t len = 0;
+    ssize_t count;
+
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        return -1;
+
+    struct compress_filter *filter = compress_open(fd, false, 0, &pipeFd);
+    if (!filter)
+        return -1;
+
+    while (len < size && (count = read(pipeFd, out + len, size - len)) > 0)
+        len += count;
+
+    close(pipeFd);
+    return compress_close(filter) < 0 ? -1 : (ssize_t)len;
+}
+
+static void test_reference(void)
+{
+    unsigned char out[64];
+    const char *text = "hello hello hello hello hello hello\n";
+
+    const int fd = test_file(g_frame, sizeof g_frame);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+
+    CHECK(test_decode(fd, out, sizeof out) == strlen(text));
+    CHECK(!memcmp(out, text, strlen(text)));
+    close(fd);
+}
+
+static void test_round_trip(const unsigned char *data, unsigned char *out)
+{
+    unsigned char byte;
+
+    const int fd = test_file(NULL, 0);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+
+    CHECK(test_encode(fd, data, TEST_SIZE) == 0);
+    const off_t size = lseek(fd, 0, SEEK_END);
+    CHECK(size > 0 && size < TEST_SIZE);
+
+    CHECK(test_decode(fd, out, TEST_SIZE) == TEST_SIZE);
+    CHECK(!memcmp(out, data, TEST_SIZE));
+
+    // Flipped byte in the first block is caught by the content checksum
+    CHECK(pread(fd, &byte, 1, 64) == 1);
+    byte ^= 0x01;
+    CHECK(pwrite(fd, &byte, 1, 64) == 1);
+    CHECK(test_decode(fd, out, TEST_SIZE) < 0);
+    byte ^= 0x01;
+    CHECK(pwrite(fd, &byte, 1, 64) == 1);
+
+    // Frames cut in a block or before the checksum are errors, not short reads
+    CHECK(ftruncate(fd, size - 2) == 0);
+    CHECK(test_decode(fd, out, TEST_SIZE) < 0);
+    CHECK(ftruncate(fd, size / 2) == 0);
+    CHECK(test_decode(fd, out, TEST_SIZE) < 0);
+    CHECK(ftruncate(fd, 5) == 0);
+    CHECK(test_decode(fd, out, TEST_SIZE) < 0);
+    close(fd);
+}
+
+// Returns length of frames copied from input of given length
+static ssize_t test_zstd_copy(const unsigned char *data, const size_t len)
+{
+    const int inFd = test_file(data, len);
+    const int outFd = test_file(NULL, 0);
+
+    ssize_t ret = inFd < 0 || outFd < 0 ? -1 : compress_zstd_copy(inFd, outFd);
+    if (!ret)
+        ret = lseek(outFd, 0, SEEK_END);
+
+    close(outFd);
+    close(inFd);
+    return ret;
+}
+
+static void test_zstd(void)
+{
+    // Two frames and padding of the last block as bsdtar writes to a pipe
+    unsigned char data[2 * sizeof g_zstdFrame + 1024];
+    const size_t len = 2 * sizeof g_zstdFrame;
+
+    memcpy(data, g_zstdFrame, sizeof g_zstdFrame);
+    memcpy(data + sizeof g_zstdFrame, g_zstdFrame, sizeof g_zstdFrame);
+    memset(data + len, 0, sizeof data - len);
+
+    CHECK(test_zstd_copy(data, len) == len);
+    CHECK(test_zstd_copy(data, sizeof data) == len);
+    CHECK(test_zstd_copy(data, len - 1) < 0);
+
+    data[sizeof data - 1] = 1;
+    CHECK(test_zstd_copy(data, sizeof data) < 0);
+}
+
+int main(void)
+{
+    unsigned char *data = malloc(TEST_SIZE);
+    unsigned char *out = malloc(TEST_SIZE);
+    if (!data || !out)
+        return 1;
+
+    test_data(data, TEST_SIZE);
+    test_reference();
+    test_round_trip(data, out);
+    test_zstd();
+
+    free(out);
+    free(data);
+    printf("compress_test: %s\n", g_failed ? "FAILED" : "passed");
+    return g_failed;
+}
@@ -0,0 +1,121 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// config.c: functions for reading initrd.* boot parameters
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "fs.h"
+#include "util.h"
+
+#define CONFIG_MAX_SIZE 4096
+#define CONFIG_MAX_ENTRY 64
+
+struct config_entry
+{
+    const char *key;
+    const char *value;
+};
+
+static char g_cmdline[CONFIG_MAX_SIZE];
+static struct config_entry g_entries[CONFIG_MAX_ENTRY];
+static int g_entryCount = 0;
+
+int config_load(void)
+{
+    ssize_t ret;
+
+    const int fd = open("/proc/cmdline", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        LOG_ERROR("open %d", errno);
+        return fd;
+    }
+
+    ret = TEMP_FAILURE_RETRY(read(fd, g_cmdline, sizeof g_cmdline - 1));
+    close(fd);
+    if (ret < 0)
+    {
+        LOG_ERROR("read %d", errno);
+        return ret;
+    }
+    g_cmdline[ret] = '\0';
+
+    // Parameters look like initrd.key=value and are separated by spaces
+    g_entryCount = 0;
+    char *ptr = g_cmdline;
+    while (*ptr && g_entryCount < CONFIG_MAX_ENTRY)
+    {
+        while (*ptr == ' ' || *ptr == '\n')
+            ptr++;
+
+        char *token = ptr;
+        while (*ptr && *ptr != ' ' && *ptr != '\n')
+            ptr++;
+        if (*ptr)
+            *ptr++ = '\0';
+
+        if (strncmp(token, CONFIG_PREFIX, sizeof CONFIG_PREFIX - 1))
+            continue;
+
+        token += sizeof CONFIG_PREFIX - 1;
+        char *value = strchr(token, '=');
+        if (value)
+            *value++ = '\0';
+        else
+            value = "1";
+
+        g_entries[g_entryCount].key = token;
+        g_entries[g_entryCount].value = value;
+        g_entryCount++;
+        LOG_INFO("%s%s=%s", CONFIG_PREFIX, token, value);
+    }
+
+    return g_entryCount;
+}
+
+const char *config_get(const char *key, const char *def)
+{
+    // Later parameters override earlier ones
+    for (int i = g_entryCount - 1; i >= 0; i--)
+    {
+        if (!strcmp(g_entries[i].key, key))
+            return g_entries[i].value;
+    }
+
+    return def;
+}
+
+long config_long(const char *key, const long def)
+{
+    const char *value = config_get(key, NULL);
+    if (!value || !*value)
+        return def;
+
+    char *end = NULL;
+    const long ret = strtol(value, &end, 0);
+    if (*end)
+    {
+        LOG_ERROR("%s%s=%s is not a number", CONFIG_PREFIX, key, value);
+        return def;
+    }
+
+    return ret;
+}
+
+// Override a parameter as if it was given at boot
+int config_set(const char *key, const char *value)
+{
+    if (g_entryCount >= CONFIG_MAX_ENTRY)
+        return -1;
+
+    g_entries[g_entryCount].key = key;
+    g_entries[g_entryCount].value = value;
+    g_entryCount++;
+    return 0;
+}
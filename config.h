@@ -0,0 +1,16 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// config.h: functions for reading initrd.* boot parameters
+
+#ifndef INITRD_CONFIG_H
+#define INITRD_CONFIG_H
+
+#define CONFIG_PREFIX "initrd."
+
+int config_load(void);
+const char *config_get(const char *key, const char *def);
+long config_long(const char *key, const long def);
+int config_set(const char *key, const char *value);
+
+#endif // INITRD_CONFIG_H
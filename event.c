@@ -0,0 +1,187 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// event.c: functions for epoll based event loop
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "fs.h"
+#include "util.h"
+
+#define EVENT_MAX_EVENTS 32
+
+struct event_entry
+{
+    event_callback callback;
+    void *ctx;
+    bool timer;
+};
+
+static int g_epollFd = -1;
+static struct event_entry *g_entries = NULL;
+static int g_entryCount = 0;
+
+int event_init(void)
+{
+    g_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epollFd < 0)
+        LOG_ERROR("epoll_create1 %d", errno);
+
+    return g_epollFd;
+}
+
+static int event_register(const int fd, const unsigned int events,
+    const event_callback callback, void *ctx, const bool timer)
+{
+    int ret;
+
+    if (fd >= g_entryCount)
+    {
+        int count = g_entryCount ? g_entryCount : 64;
+        while (count <= fd)
+            count *= 2;
+
+        struct event_entry *entries = realloc(g_entries,
+            count * sizeof *entries);
+        if (!entries)
+        {
+            LOG_ERROR("realloc %d", count);
+            return -1;
+        }
+
+        memset(&entries[g_entryCount], 0,
+            (count - g_entryCount) * sizeof *entries);
+        g_entries = entries;
+        g_entryCount = count;
+    }
+
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    ret = epoll_ctl(g_epollFd, EPOLL_CTL_ADD, fd, &ev);
+    if (ret < 0)
+    {
+        LOG_ERROR("epoll_ctl(ADD, %d) %d", fd, errno);
+        return ret;
+    }
+
+    g_entries[fd].callback = callback;
+    g_entries[fd].ctx = ctx;
+    g_entries[fd].timer = timer;
+    return 0;
+}
+
+int event_add(const int fd, const unsigned int events,
+    const event_callback callback, void *ctx)
+{
+    return event_register(fd, events, callback, ctx, false);
+}
+
+int event_mod(const int fd, const unsigned int events)
+{
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    const int ret = epoll_ctl(g_epollFd, EPOLL_CTL_MOD, fd, &ev);
+    if (ret < 0)
+        LOG_ERROR("epoll_ctl(MOD, %d) %d", fd, errno);
+
+    return ret;
+}
+
+int event_del(const int fd)
+{
+    if (fd < 0 || fd >= g_entryCount || !g_entries[fd].callback)
+        return 0;
+
+    memset(&g_entries[fd], 0, sizeof g_entries[fd]);
+    const int ret = epoll_ctl(g_epollFd, EPOLL_CTL_DEL, fd, NULL);
+    if (ret < 0)
+        LOG_ERROR("epoll_ctl(DEL, %d) %d", fd, errno);
+
+    return ret;
+}
+
+int event_timer(const long msec, const bool repeat,
+    const event_callback callback, void *ctx)
+{
+    int ret;
+
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        LOG_ERROR("timerfd_create %d", errno);
+        return fd;
+    }
+
+    struct itimerspec spec = { 0 };
+    spec.it_value.tv_sec = msec / 1000;
+    spec.it_value.tv_nsec = (msec % 1000) * 1000000;
+    if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+        spec.it_value.tv_nsec = 1;
+    if (repeat)
+        spec.it_interval = spec.it_value;
+
+    ret = timerfd_settime(fd, 0, &spec, NULL);
+    if (ret < 0)
+    {
+        LOG_ERROR("timerfd_settime %d", errno);
+        close(fd);
+        return ret;
+    }
+
+    ret = event_register(fd, EPOLLIN, callback, ctx, true);
+    if (ret < 0)
+    {
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+int event_loop(void)
+{
+    int ret;
+    struct epoll_event events[EVENT_MAX_EVENTS];
+
+    while (true)
+    {
+        const int count = TEMP_FAILURE_RETRY(epoll_wait(g_epollFd, events,
+            EVENT_MAX_EVENTS, -1));
+        if (count < 0)
+        {
+            LOG_ERROR("epoll_wait %d", errno);
+            return count;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            const int fd = events[i].data.fd;
+
+            // Skip stale events of fds removed by previous callbacks
+            if (fd >= g_entryCount || !g_entries[fd].callback)
+                continue;
+
+            struct event_entry entry = g_entries[fd];
+            if (entry.timer)
+            {
+                uint64_t expirations;
+                if (read(fd, &expirations, sizeof expirations) < 0
+                    && errno == EAGAIN)
+                {
+                    continue;
+                }
+            }
+
+            ret = entry.callback(fd, events[i].events, entry.ctx);
+            if (ret < 0)
+                return ret;
+        }
+
+        // Write messages of this wakeup in batches
+        log_flush();
+    }
+}
@@ -0,0 +1,25 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// event.h: functions for epoll based event loop
+
+#ifndef INITRD_EVENT_H
+#define INITRD_EVENT_H
+
+#include <stdbool.h>
+#include <sys/epoll.h>
+
+// Return negative value from callback to stop the event loop
+typedef int (*event_callback)(const int fd, const unsigned int events,
+    void *ctx);
+
+int event_init(void);
+int event_add(const int fd, const unsigned int events,
+    const event_callback callback, void *ctx);
+int event_mod(const int fd, const unsigned int events);
+int event_del(const int fd);
+int event_timer(const long msec, const bool repeat,
+    const event_callback callback, void *ctx);
+int event_loop(void);
+
+#endif // INITRD_EVENT_H
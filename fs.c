@@ -5,17 +5,42 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
 #include <sys/resource.h>
 #include <unistd.h>
 
+#include "child.h"
+#include "config.h"
+#include "fs.h"
+#include "mem.h"
+#include "metrics.h"
 #include "msg.h"
 #include "net.h"
+#include "trace.h"
 #include "util.h"
 
-volatile int g_kmsgFd = STDERR_FILENO;
+#define MOUNT_WORKER_COUNT 4
+#define TOOLCACHE_DIR "/toolcache"
+#define TOOLCACHE_BUFFER_SIZE 0x100000
+
+// Binaries from host, init runs on every launch or interop call and is cached,
+// bsdtar runs only for zstd imports and exports and is not worth boot time
+static struct mount_tool_entry
+{
+    const char *name;
+    const char *path;
+    const char *cachePath;
+    bool cached;
+} g_tools[] = {
+    { "init", "/tools/init", TOOLCACHE_DIR "/init", false },
+    { "bsdtar", "/tools/bsdtar", NULL, false }
+};
+
+int g_kmsgFd = STDERR_FILENO;
 
 int mount_init(const char *target)
 {
@@ -28,56 +53,170 @@ int mount_init(const char *target)
         return fd;
     }
 
-    ret = mount("/tools/init", target, NULL, MS_BIND, NULL);
+    const char *init = mount_tool("init");
+    ret = mount(init, target, NULL, MS_BIND, NULL);
     if (ret < 0)
-        LOG_ERROR("mount(%s, %s) %d", "/tools/init", target, errno);
+        LOG_ERROR("mount(%s, %s) %d", init, target, errno);
 
     close(fd);
     return ret;
 }
 
-int mount_overlay(const char *rootDir, char **lowerDir, char **overlayData)
+// Upper layer on tmpfs capped at initrd.overlay.size, or on a scratch disk
+static int mount_overlay_upper(struct arena *arena, const char *rwDir,
+    const char **upperRoot, bool *onDisk)
 {
     int ret;
-    char *rwDir = NULL, *upperDir = NULL, *workDir = NULL;
+    char *blkDev = NULL, *tempDir = NULL;
+
+    const char *upper = config_get("overlay.upper", "tmpfs");
+    const char *disk = config_get("overlay.disk", NULL);
+    *upperRoot = rwDir;
+    *onDisk = false;
+
+    if (!strcmp(upper, "disk") && disk)
+    {
+        ret = util_devpath(disk, &blkDev);
+        if (ret >= 0)
+        {
+            ret = util_mount(blkDev, rwDir, "ext4", 0,
+                mount_options(MOUNT_PROFILE_THROUGHPUT), 15000000000);
+            free(blkDev);
+        }
+
+        // Each launch gets its own directory, the disk is discarded by host
+        if (ret >= 0)
+        {
+            ret = util_mkdtemp(arena, rwDir, &tempDir);
+            if (ret >= 0)
+            {
+                *upperRoot = tempDir;
+                *onDisk = true;
+                LOG_INFO("overlay upper on %s", disk);
+                return 0;
+            }
+
+            // tmpfs must not hide the disk which stays mounted under it
+            if (umount(rwDir) < 0)
+            {
+                LOG_ERROR("umount(%s) %d", rwDir, errno);
+                return -1;
+            }
+        }
+
+        LOG_ERROR("overlay upper on %s failed, using tmpfs", disk);
+    }
+
+    // Plain tmpfs unless a size or huge pages are asked for
+    const char *size = config_get("overlay.size", NULL);
+    const char *huge = config_get("overlay.huge", NULL);
+    const char *data = size ? arena_printf(arena, "size=%s", size) : NULL;
+    if (size && !data) return -1;
+
+    // huge= needs transparent huge pages in kernel
+    if (huge)
+    {
+        const char *hugeData = arena_printf(arena, "%s%shuge=%s",
+            data ? data : "", data ? "," : "", huge);
+        if (!hugeData) return -1;
+
+        if (mount(NULL, rwDir, "tmpfs", 0, hugeData) >= 0)
+        {
+            LOG_INFO("overlay upper on tmpfs %s", hugeData);
+            return 0;
+        }
+    }
+
+    ret = util_mount(NULL, rwDir, "tmpfs", 0, data, 0);
+    if (ret >= 0 && data)
+        LOG_INFO("overlay upper on tmpfs %s", data);
+    return ret;
+}
+
+int mount_overlay(struct arena *arena, const char *rootDir, char **lowerDir,
+    char **overlayData)
+{
+    int ret;
+    char *upperDir, *workDir;
+    const char *upperRoot;
+    bool onDisk;
 
     ret = util_mkdir(rootDir, 0755);
     if (ret < 0) return ret;
 
-    ret = asprintf(lowerDir, "%s/lower", rootDir);
-    if (ret < 0) return ret;
+    *lowerDir = arena_printf(arena, "%s/lower", rootDir);
+    if (!*lowerDir) return -1;
 
     ret = util_mkdir(*lowerDir, 0755);
     if (ret < 0) return ret;
 
-    ret = asprintf(&rwDir, "%s/rw", rootDir);
-    if (ret < 0) return ret;
+    const char *rwDir = arena_printf(arena, "%s/rw", rootDir);
+    if (!rwDir) return -1;
 
-    ret = util_mount(NULL, rwDir, "tmpfs", 0, NULL, 0);
+    ret = util_mkdir(rwDir, 0755);
     if (ret < 0) return ret;
 
-    ret = asprintf(&upperDir, "%s/rw/upper", rootDir);
+    ret = mount_overlay_upper(arena, rwDir, &upperRoot, &onDisk);
     if (ret < 0) return ret;
 
+    // Let the reaper report the usage of upper layer when the distro exits
+    child_send_mount(rwDir);
+
+    upperDir = arena_printf(arena, "%s/upper", upperRoot);
+    if (!upperDir) return -1;
+
     ret = util_mkdir(upperDir, 0755);
     if (ret < 0) return ret;
 
-    ret = asprintf(&workDir, "%s/rw/work", rootDir);
-    if (ret < 0) return ret;
+    workDir = arena_printf(arena, "%s/work", upperRoot);
+    if (!workDir) return -1;
 
     ret = util_mkdir(workDir, 0755);
     if (ret < 0) return ret;
 
-    ret = asprintf(overlayData, "lowerdir=%s,upperdir=%s,workdir=%s",
-        *lowerDir, upperDir, workDir);
+    // Syncs only cost time on the scratch disk, host discards it anyway
+    const bool volatileUpper = onDisk && config_long("overlay.volatile", 0);
+    *overlayData = arena_printf(arena, "lowerdir=%s,upperdir=%s,workdir=%s%s",
+        *lowerDir, upperDir, workDir, volatileUpper ? ",volatile" : "");
+    return *overlayData ? 1 : -1;
+}
 
-    free(rwDir);
-    free(upperDir);
-    free(workDir);
-    return ret;
+// Online discard and atime updates cost writes, fstrim can reclaim later
+static const struct mount_profile_entry
+{
+    const char *name;
+    const char *options;
+} g_profiles[] = {
+    [MOUNT_PROFILE_DEFAULT] = { "default", NULL },
+    [MOUNT_PROFILE_SAFETY] = { "safety",
+        "discard,errors=remount-ro,data=ordered" },
+    [MOUNT_PROFILE_THROUGHPUT] = { "throughput",
+        "noatime,lazytime,commit=30,journal_async_commit,data=writeback,"
+        "errors=remount-ro" },
+    [MOUNT_PROFILE_LOWWRITE] = { "lowwrite",
+        "noatime,lazytime,commit=120,data=ordered,errors=remount-ro" }
+};
+
+// Profile from host, otherwise initrd.mount.profile (safety by default)
+const char *mount_options(const int profile)
+{
+    const int count = sizeof g_profiles / sizeof *g_profiles;
+
+    if (profile > MOUNT_PROFILE_DEFAULT && profile < count)
+        return g_profiles[profile].options;
+
+    const char *name = config_get("mount.profile", "safety");
+    for (int i = MOUNT_PROFILE_SAFETY; i < count; i++)
+    {
+        if (!strcmp(name, g_profiles[i].name))
+            return g_profiles[i].options;
+    }
+
+    LOG_ERROR("unknown mount profile %s", name);
+    return g_profiles[MOUNT_PROFILE_SAFETY].options;
 }
 
-int mount_root(void)
+static int mount_step_dev(void)
 {
     int ret;
 
@@ -92,11 +231,32 @@ int mount_root(void)
     else
         g_kmsgFd = kmsgFd;
 
-    ret = util_mount(NULL, "/proc", "proc", 0, NULL, 0);
-    if (ret < 0) return ret;
+    return ret;
+}
 
-    ret = util_mount(NULL, "/sys", "sysfs", 0, NULL, 0);
-    if (ret < 0) return ret;
+static int mount_step_proc(void)
+{
+    return util_mount(NULL, "/proc", "proc", 0, NULL, 0);
+}
+
+static int mount_step_sys(void)
+{
+    return util_mount(NULL, "/sys", "sysfs", 0, NULL, 0);
+}
+
+static int mount_step_cgroup(void)
+{
+    int ret;
+
+    // Controllers in use by cgroup v2 can not be mounted as v1 by distros
+    if (mem_cgroup2())
+    {
+        ret = util_mount(NULL, "/sys/fs/cgroup", "cgroup2",
+            MS_RELATIME | MS_NOEXEC | MS_NODEV | MS_NOSUID, "nsdelegate", 0);
+        if (ret < 0) return ret;
+
+        return mem_background_init();
+    }
 
     ret = util_mount(NULL, "/sys/fs/cgroup", "tmpfs", 0, NULL, 0);
     if (ret < 0) return ret;
@@ -105,38 +265,64 @@ int mount_root(void)
         MS_RELATIME | MS_NOEXEC | MS_NODEV | MS_NOSUID, "memory", 0);
     if (ret < 0) return ret;
 
-    ret = util_mkdir("/sys/fs/cgroup/memory/64M", 0755);
-    if (ret < 0) return ret;
+    return mem_background_init();
+}
 
-    ret = util_writefile("/sys/fs/cgroup/memory/64M/memory.limit_in_bytes",
-        "64M\n");
-    if (ret < 0) return ret;
+static int mount_step_share(void)
+{
+    int ret;
 
     ret = util_mount(NULL, "/share", "tmpfs", 0, NULL, 0);
     if (ret < 0) return ret;
 
     ret = mount(NULL, "/share", NULL, MS_SHARED, NULL);
-    if (ret < 0) return ret;
+    if (ret < 0)
+        LOG_ERROR("mount(%s) %d", "/share", errno);
 
-    ret = mount_plan_nine("tools", "/tools");
-    if (ret < 0) return ret;
+    return ret;
+}
 
-    ret = util_symlink("/tools/init", "/localhost");
-    if (ret < 0) return ret;
+static int mount_step_tools(void)
+{
+    if (config_long("9p.bench", 0))
+        plan_nine_bench("tools");
 
-    ret = util_symlink("/tools/init", "/telagent");
+    return mount_plan_nine("tools", "/tools");
+}
+
+static int mount_step_symlink(void)
+{
+    int ret;
+
+    const char *init = mount_tool("init");
+
+    ret = util_symlink(init, "/localhost");
     if (ret < 0) return ret;
 
-    ret = util_symlink("/tools/init", "/gns");
+    ret = util_symlink(init, "/telagent");
     if (ret < 0) return ret;
 
-    ret = util_mount(NULL, "/proc/sys/fs/binfmt_misc", "binfmt_misc",
+    return util_symlink(init, "/gns");
+}
+
+static int mount_step_binfmt(void)
+{
+    return util_mount(NULL, "/proc/sys/fs/binfmt_misc", "binfmt_misc",
         MS_RELATIME, NULL, 0);
-    if (ret < 0) return ret;
+}
 
-    ret = util_writefile("/proc/sys/fs/binfmt_misc/register",
-        ":WSLInterop:M::MZ::/tools/init:F\n");
-    if (ret < 0) return ret;
+// F flag opens the interpreter now, so /tools must be mounted
+static int mount_step_interop(void)
+{
+    char rule[64];
+
+    snprintf(rule, sizeof rule, ":WSLInterop:M::MZ::%s:F\n", mount_tool("init"));
+    return util_writefile("/proc/sys/fs/binfmt_misc/register", rule);
+}
+
+static int mount_step_sysctl(void)
+{
+    int ret;
 
     ret = util_writefile("/proc/sys/kernel/dmesg_restrict", "0\n");
     if (ret < 0) return ret;
@@ -144,35 +330,307 @@ int mount_root(void)
     ret = util_writefile("/proc/sys/fs/inotify/max_user_watches", "524288\n");
     if (ret < 0) return ret;
 
+    ret = util_writefile("/proc/sys/kernel/print-fatal-signals", "1\n");
+    if (ret < 0) return ret;
+
+    return util_writefile("/proc/sys/kernel/printk_devkmsg", "on\n");
+}
+
+static int mount_step_rlimit(void)
+{
     struct rlimit rlim = { .rlim_cur = 0x400, .rlim_max = 0x100000 };
-    ret = setrlimit(RLIMIT_NOFILE, &rlim);
+    const int ret = setrlimit(RLIMIT_NOFILE, &rlim);
     if (ret < 0)
-    {
         LOG_ERROR("setrlimit %d", errno);
-        return ret;
-    }
 
-    ret = util_writefile("/proc/sys/kernel/print-fatal-signals", "1\n");
-    if (ret < 0) return ret;
+    return ret;
+}
 
-    ret = util_writefile("/proc/sys/kernel/printk_devkmsg", "on\n");
-    if (ret < 0) return ret;
+static int mount_step_resolv(void)
+{
+    int ret;
 
     ret = util_mkdir("/etc", 0755);
     if (ret < 0) return ret;
 
-    ret = util_symlink("/share/resolv.conf", "/etc/resolv.conf");
-    if (ret < 0) return ret;
+    return util_symlink("/share/resolv.conf", "/etc/resolv.conf");
+}
+
+static int mount_tool_copy(const struct mount_tool_entry *tool)
+{
+    int ret = -1;
+    struct stat st = { 0 }, copySt = { 0 };
+    char source[64], target[64];
+
+    snprintf(source, sizeof source, "/tools/%s", tool->name);
+    snprintf(target, sizeof target, "%s/%s", TOOLCACHE_DIR, tool->name);
+
+    const int inFd = open(source, O_RDONLY | O_CLOEXEC);
+    if (inFd < 0)
+    {
+        LOG_ERROR("open(%s) %d", source, errno);
+        return inFd;
+    }
 
+    const int outFd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0755);
+    if (outFd < 0)
+    {
+        LOG_ERROR("open(%s) %d", target, errno);
+        close(inFd);
+        return outFd;
+    }
+
+    if (fstat(inFd, &st) < 0)
+    {
+        LOG_ERROR("fstat(%s) %d", source, errno);
+        goto cleanup;
+    }
+
+    // 9p can not copy in kernel, read in large blocks as msize allows
+    char *buf = malloc(TOOLCACHE_BUFFER_SIZE);
+    if (!buf)
+    {
+        LOG_ERROR("malloc %d", TOOLCACHE_BUFFER_SIZE);
+        goto cleanup;
+    }
+
+    ssize_t len;
+    while ((len = TEMP_FAILURE_RETRY(read(inFd, buf, TOOLCACHE_BUFFER_SIZE))) > 0)
+    {
+        char *ptr = buf;
+        while (len > 0)
+        {
+            const ssize_t written = TEMP_FAILURE_RETRY(write(outFd, ptr, len));
+            if (written < 0)
+                break;
+            ptr += written;
+            len -= written;
+        }
+        if (len)
+            break;
+    }
+    free(buf);
+
+    if (len < 0 || fstat(outFd, &copySt) < 0 || copySt.st_size != st.st_size)
+    {
+        LOG_ERROR("copy(%s) size %lld of %lld %d", source,
+            (long long)copySt.st_size, (long long)st.st_size, errno);
+        goto cleanup;
+    }
+
+    ret = fchmod(outFd, st.st_mode & 07777);
+    if (ret < 0)
+        LOG_ERROR("fchmod(%s) %d", target, errno);
+
+cleanup:
+    close(outFd);
+    close(inFd);
+    if (ret < 0)
+        unlink(target);
     return ret;
 }
 
-int mount_vhd(const unsigned int devMode, const char *scsiPath,
-    const unsigned int pmemId, const char *rootDir,
+// Copy hot binaries from /tools into tmpfs, they run from there if complete
+static int mount_step_toolcache(void)
+{
+    if (!config_long("toolcache", 1))
+        return 0;
+
+    if (util_mount(NULL, TOOLCACHE_DIR, "tmpfs", MS_NOSUID | MS_NODEV,
+        "mode=0755", 0) < 0)
+    {
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof g_tools / sizeof *g_tools; i++)
+    {
+        if (g_tools[i].cachePath)
+            g_tools[i].cached = mount_tool_copy(&g_tools[i]) >= 0;
+    }
+
+    if (mount(NULL, TOOLCACHE_DIR, NULL, MS_REMOUNT | MS_RDONLY | MS_NOSUID
+        | MS_NODEV, NULL) < 0)
+    {
+        LOG_ERROR("mount(%s) %d", TOOLCACHE_DIR, errno);
+    }
+
+    // Failures fall back to /tools, steps after this must not be skipped
+    return 0;
+}
+
+// Path of a binary from host, local copy if there is one
+const char *mount_tool(const char *name)
+{
+    for (size_t i = 0; i < sizeof g_tools / sizeof *g_tools; i++)
+    {
+        if (!strcmp(g_tools[i].name, name))
+            return g_tools[i].cached ? g_tools[i].cachePath : g_tools[i].path;
+    }
+
+    return NULL;
+}
+
+static int mount_step_config(void)
+{
+    return config_load() < 0 ? -1 : 0;
+}
+
+// Order of entries must match the bits of enum mount_step
+static const struct mount_step_entry
+{
+    const char *name;
+    int (*func)(void);
+    unsigned int deps;
+} g_steps[MOUNT_STEP_COUNT] = {
+    { "host", NULL, 0 },
+    { "dev", mount_step_dev, 0 },
+    { "proc", mount_step_proc, 0 },
+    { "sys", mount_step_sys, 0 },
+    { "cgroup", mount_step_cgroup, MOUNT_STEP_SYS | MOUNT_STEP_CONFIG },
+    { "share", mount_step_share, 0 },
+    { "tools", mount_step_tools, MOUNT_STEP_HOST },
+    { "symlink", mount_step_symlink, MOUNT_STEP_TOOLCACHE },
+    { "binfmt", mount_step_binfmt, MOUNT_STEP_PROC },
+    { "interop", mount_step_interop, MOUNT_STEP_BINFMT | MOUNT_STEP_TOOLCACHE },
+    { "sysctl", mount_step_sysctl, MOUNT_STEP_PROC },
+    { "rlimit", mount_step_rlimit, 0 },
+    { "resolv", mount_step_resolv, 0 },
+    { "config", mount_step_config, MOUNT_STEP_PROC },
+    { "toolcache", mount_step_toolcache, MOUNT_STEP_TOOLS }
+};
+
+static pthread_mutex_t g_stepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_stepCond = PTHREAD_COND_INITIALIZER;
+static unsigned int g_stepStarted = MOUNT_STEP_HOST;
+static unsigned int g_stepDone = 0;
+static unsigned int g_stepFailed = 0;
+static pthread_t g_workers[MOUNT_WORKER_COUNT];
+static int g_workerCount = 0;
+
+static void *mount_worker(void *arg)
+{
+    pthread_mutex_lock(&g_stepLock);
+    while (true)
+    {
+        int next = -1;
+        bool pending = false;
+
+        for (int i = 0; i < MOUNT_STEP_COUNT && next < 0; i++)
+        {
+            const unsigned int step = 1u << i;
+            if (g_stepStarted & step)
+                continue;
+
+            pending = true;
+            if (g_steps[i].deps & g_stepFailed)
+            {
+                LOG_ERROR("skip %s", g_steps[i].name);
+                g_stepStarted |= step;
+                g_stepDone |= step;
+                g_stepFailed |= step;
+                pthread_cond_broadcast(&g_stepCond);
+            }
+            else if ((g_steps[i].deps & g_stepDone) == g_steps[i].deps)
+                next = i;
+        }
+
+        if (!pending)
+            break;
+
+        if (next < 0)
+        {
+            pthread_cond_wait(&g_stepCond, &g_stepLock);
+            continue;
+        }
+
+        g_stepStarted |= 1u << next;
+        pthread_mutex_unlock(&g_stepLock);
+
+        const long long start = trace_now();
+        const int ret = g_steps[next].func();
+        trace_event("boot", g_steps[next].name, start, ret);
+        if (ret < 0)
+            LOG_ERROR("%s %d", g_steps[next].name, ret);
+
+        pthread_mutex_lock(&g_stepLock);
+        g_stepDone |= 1u << next;
+        if (ret < 0)
+            g_stepFailed |= 1u << next;
+        pthread_cond_broadcast(&g_stepCond);
+    }
+    pthread_mutex_unlock(&g_stepLock);
+
+    return NULL;
+}
+
+int mount_root(void)
+{
+    int ret = -1;
+
+    // Workers are joined before the first distro is cloned with raw clone
+    for (g_workerCount = 0; g_workerCount < MOUNT_WORKER_COUNT; g_workerCount++)
+    {
+        ret = pthread_create(&g_workers[g_workerCount], NULL, mount_worker,
+            NULL);
+        if (ret)
+        {
+            LOG_ERROR("pthread_create %d", ret);
+            break;
+        }
+    }
+
+    // Run the steps here too if no thread could be created
+    if (!g_workerCount)
+        mount_worker(NULL);
+
+    return 0;
+}
+
+void mount_signal(const unsigned int steps)
+{
+    pthread_mutex_lock(&g_stepLock);
+    g_stepDone |= steps;
+    pthread_cond_broadcast(&g_stepCond);
+    pthread_mutex_unlock(&g_stepLock);
+}
+
+int mount_wait(const unsigned int steps)
+{
+    int ret;
+
+    pthread_mutex_lock(&g_stepLock);
+    while ((g_stepDone & steps) != steps)
+        pthread_cond_wait(&g_stepCond, &g_stepLock);
+    ret = (g_stepFailed & steps) ? -1 : 0;
+    pthread_mutex_unlock(&g_stepLock);
+
+    return ret;
+}
+
+// Workers leave when no step is pending, after that PID 1 has one thread
+int mount_finish(void)
+{
+    const int ret = mount_wait(MOUNT_STEP_ALL);
+
+    for (int i = 0; i < g_workerCount; i++)
+    {
+        const int err = pthread_join(g_workers[i], NULL);
+        if (err)
+            LOG_ERROR("pthread_join %d", err);
+    }
+
+    g_workerCount = 0;
+    return ret;
+}
+
+int mount_vhd(struct arena *arena, const unsigned int devMode,
+    const char *scsiPath, const unsigned int pmemId, const char *rootDir,
     const char *fstype, const unsigned int reqMode, const void *mountData)
 {
     int ret;
     char *blkDev = NULL, *target = NULL, *overlayData = NULL;
+    const long long start = trace_now();
 
     if (devMode == DEVICE_MODE_SCSI)
         ret = util_devpath(scsiPath, &blkDev);
@@ -187,7 +645,7 @@ int mount_vhd(const unsigned int devMode, const char *scsiPath,
     if (ret < 0) return ret;
 
     if (reqMode & REQUEST_CREATE_OVERLAY_FS)
-        ret = mount_overlay(rootDir, &target, &overlayData);
+        ret = mount_overlay(arena, rootDir, &target, &overlayData);
     else
         target = (char*)rootDir;
 
@@ -201,11 +659,8 @@ int mount_vhd(const unsigned int devMode, const char *scsiPath,
     }
 
     free(blkDev);
-    if (reqMode & REQUEST_CREATE_OVERLAY_FS)
-    {
-        free(target);
-        free(overlayData);
-    }
 
+    trace_event("disk", "mount_vhd", start, ret);
+    metrics_observe(METRIC_MOUNT_VHD, start);
     return ret;
 }
@@ -6,13 +6,48 @@
 #ifndef INITRD_FS_H
 #define INITRD_FS_H
 
+#include "arena.h"
+
 extern int g_kmsgFd;
 
+// Steps of mount_root() which are run in parallel
+enum mount_step
+{
+    MOUNT_STEP_HOST = 1 << 0,
+    MOUNT_STEP_DEV = 1 << 1,
+    MOUNT_STEP_PROC = 1 << 2,
+    MOUNT_STEP_SYS = 1 << 3,
+    MOUNT_STEP_CGROUP = 1 << 4,
+    MOUNT_STEP_SHARE = 1 << 5,
+    MOUNT_STEP_TOOLS = 1 << 6,
+    MOUNT_STEP_SYMLINK = 1 << 7,
+    MOUNT_STEP_BINFMT = 1 << 8,
+    MOUNT_STEP_INTEROP = 1 << 9,
+    MOUNT_STEP_SYSCTL = 1 << 10,
+    MOUNT_STEP_RLIMIT = 1 << 11,
+    MOUNT_STEP_RESOLV = 1 << 12,
+    MOUNT_STEP_CONFIG = 1 << 13,
+    MOUNT_STEP_TOOLCACHE = 1 << 14
+};
+
+#define MOUNT_STEP_COUNT 15
+#define MOUNT_STEP_ALL ((1u << MOUNT_STEP_COUNT) - 1)
+// Everything except steps which need /tools from host
+#define MOUNT_STEP_CORE (MOUNT_STEP_ALL & ~(MOUNT_STEP_HOST \
+    | MOUNT_STEP_TOOLS | MOUNT_STEP_INTEROP | MOUNT_STEP_TOOLCACHE \
+    | MOUNT_STEP_SYMLINK))
+
 int mount_init(const char *target);
-int mount_overlay(const char *rootDir, char **lowerDir, char **overlayData);
+int mount_overlay(struct arena *arena, const char *rootDir, char **lowerDir,
+    char **overlayData);
 int mount_root(void);
-int mount_vhd(const unsigned int devMode, const char *scsiPath,
-    const unsigned int pmemId, const char *rootDir,
+const char *mount_options(const int profile);
+const char *mount_tool(const char *name);
+void mount_signal(const unsigned int steps);
+int mount_wait(const unsigned int steps);
+int mount_finish(void);
+int mount_vhd(struct arena *arena, const unsigned int devMode,
+    const char *scsiPath, const unsigned int pmemId, const char *rootDir,
     const char *fstype, const unsigned int reqMode, const void *mountData);
 
 #endif // INITRD_FS_H
@@ -0,0 +1,1177 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// hostsim.c: Lxss service stand-in and load generator for initrd
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/vm_sockets.h>
+
+#include "compress.h"
+#include "msg.h"
+
+#define LXSS_SERVER_PORT 50000
+#define LXSS_CLIENT_PORT 50001
+#define HOSTSIM_P9_MSIZE 0x100000
+#define HOSTSIM_BUFFER_SIZE 0x10000
+#define HOSTSIM_BUCKETS 40
+#define HOSTSIM_TYPES (MSG_SEND_CAPS + 1)
+
+#define LOG(...) { fputs("hostsim: ", stderr); fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); }
+
+// Latency histogram with power of two microsecond buckets
+struct histogram
+{
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long long min;
+    unsigned long long max;
+    unsigned long buckets[HOSTSIM_BUCKETS];
+};
+
+static struct histogram g_histograms[HOSTSIM_TYPES];
+static volatile unsigned long g_exitCount = 0;
+static int g_listenFd = -1;
+
+static const char *g_typeNames[HOSTSIM_TYPES] = {
+    [MSG_START_INIT] = "start_init",
+    [MSG_IMPORT_DISTRO] = "import",
+    [MSG_EXPORT_DISTRO] = "export",
+    [MSG_EJECT_SCSI] = "eject",
+    [MSG_START_PROC] = "start_proc",
+    [MSG_SEND_CAPS] = "caps"
+};
+
+static unsigned long long now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void histogram_add(const enum initrd_msg_type type,
+    const unsigned long long usec)
+{
+    struct histogram *hist = &g_histograms[type];
+    int bucket = 0;
+
+    while (bucket < HOSTSIM_BUCKETS - 1 && (1ULL << (bucket + 1)) <= usec)
+        bucket++;
+
+    if (!hist->count || usec < hist->min)
+        hist->min = usec;
+    if (usec > hist->max)
+        hist->max = usec;
+    hist->count++;
+    hist->sum += usec;
+    hist->buckets[bucket]++;
+}
+
+static unsigned long long histogram_percentile(const struct histogram *hist,
+    const unsigned int percent)
+{
+    unsigned long seen = 0;
+    const unsigned long target = (hist->count * percent + 99) / 100;
+
+    for (int i = 0; i < HOSTSIM_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= target)
+            return 1ULL << (i + 1);
+    }
+
+    return hist->max;
+}
+
+static void histogram_print(void)
+{
+    for (int type = 0; type < HOSTSIM_TYPES; type++)
+    {
+        const struct histogram *hist = &g_histograms[type];
+        if (!hist->count)
+            continue;
+
+        printf("%s: count %lu min %llu avg %llu p50 <%llu p90 <%llu p99 <%llu"
+            " max %llu usec\n", g_typeNames[type], hist->count, hist->min,
+            hist->sum / hist->count, histogram_percentile(hist, 50),
+            histogram_percentile(hist, 90), histogram_percentile(hist, 99),
+            hist->max);
+
+        for (int i = 0; i < HOSTSIM_BUCKETS; i++)
+        {
+            if (!hist->buckets[i])
+                continue;
+
+            printf("  %10llu - %10llu usec: %8lu ", i ? 1ULL << i : 0,
+                (1ULL << (i + 1)) - 1, hist->buckets[i]);
+            for (unsigned long j = 0;
+                j < 50 * hist->buckets[i] / hist->count; j++)
+            {
+                putchar('#');
+            }
+            putchar('\n');
+        }
+    }
+
+    printf("child exits: %lu\n", g_exitCount);
+}
+
+static int listen_socket(const char *unixDir, const unsigned int port)
+{
+    int ret;
+    int sock;
+
+    if (unixDir)
+    {
+        // initrd connects to <dir>/<port> with unix transport
+        struct sockaddr_un addr = { 0 };
+        addr.sun_family = AF_UNIX;
+        ret = snprintf(addr.sun_path, sizeof addr.sun_path, "%s/%u",
+            unixDir, port);
+        if (ret < 0 || ret >= sizeof addr.sun_path)
+        {
+            LOG("path too long %s", unixDir);
+            return -1;
+        }
+
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+        {
+            LOG("socket %d", errno);
+            return sock;
+        }
+
+        unlink(addr.sun_path);
+        ret = bind(sock, (struct sockaddr *)&addr, sizeof addr);
+    }
+    else
+    {
+        struct sockaddr_vm addr = { 0 };
+        addr.svm_family = AF_VSOCK;
+        addr.svm_cid = VMADDR_CID_ANY;
+        addr.svm_port = port;
+
+        sock = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+        {
+            LOG("socket %d", errno);
+            return sock;
+        }
+
+        ret = bind(sock, (struct sockaddr *)&addr, sizeof addr);
+    }
+
+    if (ret < 0)
+    {
+        LOG("bind %d", errno);
+        close(sock);
+        return ret;
+    }
+
+    ret = listen(sock, 128);
+    if (ret < 0)
+    {
+        LOG("listen %d", errno);
+        close(sock);
+        return ret;
+    }
+
+    return sock;
+}
+
+static int accept_socket(void)
+{
+    const int sock = accept4(g_listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0)
+        LOG("accept %d", errno);
+
+    return sock;
+}
+
+static int read_all(const int sock, void *buf, size_t len)
+{
+    char *ptr = buf;
+
+    while (len)
+    {
+        const ssize_t ret = read(sock, ptr, len);
+        if (ret <= 0)
+        {
+            if (ret < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int write_all(const int sock, const void *buf, size_t len)
+{
+    const char *ptr = buf;
+
+    while (len)
+    {
+        const ssize_t ret = write(sock, ptr, len);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int receive_caps(const int msgSock)
+{
+    struct initrd_msg_header header;
+    char buf[HOSTSIM_BUFFER_SIZE];
+
+    if (read_all(msgSock, &header, sizeof header) < 0
+        || header.type != MSG_SEND_CAPS || header.len < sizeof header
+        || header.len > sizeof buf)
+    {
+        LOG("bad MSG_SEND_CAPS");
+        return -1;
+    }
+
+    memcpy(buf, &header, sizeof header);
+    if (read_all(msgSock, buf + sizeof header, header.len - sizeof header) < 0)
+        return -1;
+
+    struct initrd_msg_send_caps *caps = (void *)buf;
+    buf[header.len - 1] = '\0';
+    LOG("caps seccomp_notif %d release %s", caps->seccomp_notif,
+        caps->release);
+    return 0;
+}
+
+// Message with a struct followed by NUL terminated strings
+static void *build_message(const enum initrd_msg_type type,
+    const char *scsiPath, const char *ipaddr, const char *gateway,
+    const char *ipv6addr, const unsigned int mtu, const char *swapPath,
+    const long swapSize, const int compression, const int level,
+    const int profile, size_t *len)
+{
+    char *msg = NULL;
+
+    if (type == MSG_START_PROC)
+    {
+        // IPv6 and MTU fields are sent only if asked, like older hosts
+        const size_t ipLen = strlen(ipaddr) + 1, gwLen = strlen(gateway) + 1;
+        const size_t ipv6Len = ipv6addr ? strlen(ipv6addr) + 1 : 0;
+        const size_t swapLen = swapPath ? strlen(swapPath) + 1 : 0;
+        const size_t procLen = ipv6addr || mtu
+            ? sizeof (struct initrd_msg_start_proc)
+            : offsetof(struct initrd_msg_start_proc, eth0_ipv6_prefix);
+        *len = procLen + ipLen + gwLen + ipv6Len + swapLen + 1;
+        msg = calloc(1, *len);
+        if (!msg)
+            return NULL;
+
+        struct initrd_msg_start_proc *proc = (void *)msg;
+        proc->eth0_ipaddr = procLen;
+        proc->eth0_gateway = proc->eth0_ipaddr + ipLen;
+        proc->swap_scsi_path = proc->eth0_gateway + gwLen + ipv6Len;
+        proc->entropy_buf = proc->swap_scsi_path + swapLen;
+        proc->eth0_prefix = 20;
+        memcpy(msg + proc->eth0_ipaddr, ipaddr, ipLen);
+        memcpy(msg + proc->eth0_gateway, gateway, gwLen);
+        if (swapPath)
+        {
+            proc->swap_size = swapSize;
+            memcpy(msg + proc->swap_scsi_path, swapPath, swapLen);
+        }
+        if (procLen == sizeof *proc)
+        {
+            proc->eth0_mtu = mtu;
+            proc->eth0_ipv6_prefix = 64;
+        }
+        if (ipv6addr)
+        {
+            proc->eth0_ipv6addr = proc->eth0_gateway + gwLen;
+            memcpy(msg + proc->eth0_ipv6addr, ipv6addr, ipv6Len);
+        }
+    }
+    else
+    {
+        // Optional fields are sent only if asked, like older hosts
+        const size_t pathLen = strlen(scsiPath) + 1;
+        const size_t initLen = profile > 0
+            ? sizeof (struct initrd_msg_start_init)
+            : compression >= 0
+            ? offsetof(struct initrd_msg_start_init, mount_profile)
+            : offsetof(struct initrd_msg_start_init, compression);
+        *len = initLen + pathLen;
+        msg = calloc(1, *len);
+        if (!msg)
+            return NULL;
+
+        struct initrd_msg_start_init *init = (void *)msg;
+        init->distro_scsi_path = initLen;
+        if (compression >= 0)
+        {
+            init->compression = compression;
+            init->compression_level = level;
+        }
+        if (profile > 0)
+            init->mount_profile = profile;
+        memcpy(msg + init->distro_scsi_path, scsiPath, pathLen);
+    }
+
+    struct initrd_msg_header *header = (void *)msg;
+    header->type = type;
+    header->len = *len;
+    return msg;
+}
+
+// Stream a tar file to stdin socket of import, an empty archive by default
+static void serve_import(const char *file)
+{
+    char buf[HOSTSIM_BUFFER_SIZE];
+
+    const int stdinSock = accept_socket();
+    const int stderrSock = accept_socket();
+    if (stdinSock < 0 || stderrSock < 0)
+        goto cleanup;
+
+    const int fd = file ? open(file, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd >= 0)
+    {
+        ssize_t ret;
+        while ((ret = read(fd, buf, sizeof buf)) > 0)
+        {
+            if (write_all(stdinSock, buf, ret) < 0)
+                break;
+        }
+        close(fd);
+    }
+    else
+    {
+        memset(buf, 0, 1024);
+        write_all(stdinSock, buf, 1024);
+    }
+    shutdown(stdinSock, SHUT_WR);
+
+    while (read(stderrSock, buf, sizeof buf) > 0)
+        ;
+
+cleanup:
+    close(stdinSock);
+    close(stderrSock);
+}
+
+// Count exported bytes and save them if a file is given
+static void serve_export(const char *file)
+{
+    char buf[HOSTSIM_BUFFER_SIZE];
+    unsigned long long total = 0;
+    ssize_t ret;
+
+    const int stdoutSock = accept_socket();
+    const int stderrSock = accept_socket();
+    if (stdoutSock < 0 || stderrSock < 0)
+        goto cleanup;
+
+    const unsigned long long start = now_usec();
+    const int fd = file
+        ? open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    while ((ret = read(stdoutSock, buf, sizeof buf)) > 0)
+    {
+        total += ret;
+        if (fd >= 0 && write_all(fd, buf, ret) < 0)
+            break;
+    }
+    if (fd >= 0)
+        close(fd);
+    while (read(stderrSock, buf, sizeof buf) > 0)
+        ;
+    LOG("export %llu bytes in %llu ms", total, (now_usec() - start) / 1000);
+
+cleanup:
+    close(stdoutSock);
+    close(stderrSock);
+}
+
+static void *exit_reader(void *arg)
+{
+    const int writeSock = *(int *)arg;
+    pid_t pid;
+
+    while (read_all(writeSock, &pid, sizeof pid) == 0)
+    {
+        g_exitCount++;
+        LOG("child exit %d", pid);
+    }
+
+    return NULL;
+}
+
+static int run_batch(const int msgSock, const enum initrd_msg_type type,
+    const int count, const void *msg, const size_t len, const char *file)
+{
+    int ret = 0;
+    unsigned long long start[count];
+    int socks[count];
+
+    // Stream sockets of an import or export can not be told apart from the
+    // launch sockets of the next one, so those run one at a time
+    const bool streams = type == MSG_IMPORT_DISTRO || type == MSG_EXPORT_DISTRO;
+
+    for (int i = 0; i < count; i++)
+    {
+        socks[i] = -1;
+        start[i] = now_usec();
+        if (!streams && write_all(msgSock, msg, len) < 0)
+        {
+            LOG("write %d", errno);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        int reply;
+
+        if (streams)
+        {
+            start[i] = now_usec();
+            if (write_all(msgSock, msg, len) < 0)
+            {
+                LOG("write %d", errno);
+                ret = -1;
+                break;
+            }
+        }
+
+        switch (type)
+        {
+            case MSG_START_INIT:
+            case MSG_IMPORT_DISTRO:
+            case MSG_EXPORT_DISTRO:
+                // Launch connections are accepted in the order of messages
+                socks[i] = accept_socket();
+                if (socks[i] < 0 || read_all(socks[i], &reply, sizeof reply) < 0)
+                {
+                    ret = -1;
+                    continue;
+                }
+
+                if (type == MSG_IMPORT_DISTRO)
+                    serve_import(file);
+                if (type == MSG_EXPORT_DISTRO)
+                    serve_export(file);
+                if (streams && read_all(socks[i], &reply, sizeof reply) == 0)
+                    LOG("%s returned %d", g_typeNames[type], reply);
+                break;
+            case MSG_EJECT_SCSI:
+                if (read_all(msgSock, &reply, sizeof reply) < 0)
+                    return -1;
+                break;
+            default:
+                break;
+        }
+
+        histogram_add(type, now_usec() - start[i]);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (socks[i] >= 0)
+            close(socks[i]);
+    }
+
+    return ret;
+}
+
+// Read-only 9P2000.L server of a local directory in place of /tools share
+struct p9_fid
+{
+    bool used;
+    int fd;
+    DIR *dir;
+    char *path;
+};
+
+struct p9_conn
+{
+    int sock;
+    unsigned int msize;
+    struct p9_fid *fids;
+    unsigned int fidCount;
+    char *in;
+    char *out;
+    size_t outLen;
+};
+
+static const char *g_p9Root = NULL;
+static unsigned int g_p9MaxMsize = HOSTSIM_P9_MSIZE;
+
+static void p9_put(struct p9_conn *conn, const void *data, const size_t len)
+{
+    if (conn->outLen + len <= conn->msize)
+        memcpy(&conn->out[conn->outLen], data, len);
+    conn->outLen += len;
+}
+
+static void p9_put8(struct p9_conn *conn, const uint8_t value)
+{
+    p9_put(conn, &value, sizeof value);
+}
+
+static void p9_put16(struct p9_conn *conn, const uint16_t value)
+{
+    p9_put(conn, &value, sizeof value);
+}
+
+static void p9_put32(struct p9_conn *conn, const uint32_t value)
+{
+    p9_put(conn, &value, sizeof value);
+}
+
+static void p9_put64(struct p9_conn *conn, const uint64_t value)
+{
+    p9_put(conn, &value, sizeof value);
+}
+
+static void p9_putstr(struct p9_conn *conn, const char *str)
+{
+    const size_t len = strlen(str);
+    p9_put16(conn, len);
+    p9_put(conn, str, len);
+}
+
+static void p9_putqid(struct p9_conn *conn, const struct stat *st)
+{
+    p9_put8(conn, S_ISDIR(st->st_mode) ? 0x80 : S_ISLNK(st->st_mode) ? 0x02 : 0);
+    p9_put32(conn, st->st_mtime);
+    p9_put64(conn, st->st_ino);
+}
+
+// Fields of requests, all little endian like the hosts this runs on
+static uint32_t p9_get32(const char *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof value);
+    return value;
+}
+
+static uint64_t p9_get64(const char *ptr)
+{
+    uint64_t value;
+    memcpy(&value, ptr, sizeof value);
+    return value;
+}
+
+static struct p9_fid *p9_fid(struct p9_conn *conn, const uint32_t fid,
+    const bool create)
+{
+    if (fid >= conn->fidCount)
+    {
+        if (!create || fid >= 0x100000)
+            return NULL;
+
+        unsigned int count = conn->fidCount ? conn->fidCount : 64;
+        while (count <= fid)
+            count *= 2;
+
+        struct p9_fid *fids = realloc(conn->fids, count * sizeof *fids);
+        if (!fids)
+            return NULL;
+
+        memset(&fids[conn->fidCount], 0,
+            (count - conn->fidCount) * sizeof *fids);
+        conn->fids = fids;
+        conn->fidCount = count;
+    }
+
+    struct p9_fid *entry = &conn->fids[fid];
+    if (!create && !entry->used)
+        return NULL;
+    return entry;
+}
+
+static void p9_clunk(struct p9_fid *fid)
+{
+    if (fid->dir)
+        closedir(fid->dir);
+    else if (fid->fd >= 0)
+        close(fid->fd);
+    free(fid->path);
+    memset(fid, 0, sizeof *fid);
+}
+
+static int p9_set(struct p9_fid *fid, const char *path)
+{
+    char *copy = strdup(path);
+    if (!copy)
+        return -ENOMEM;
+
+    if (fid->used)
+        p9_clunk(fid);
+    fid->used = true;
+    fid->fd = -1;
+    fid->path = copy;
+    return 0;
+}
+
+static int p9_walk(struct p9_conn *conn, const char *req, const char *end)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    struct p9_fid *fid = p9_fid(conn, p9_get32(req), false);
+    if (!fid)
+        return -EBADF;
+
+    const uint32_t newFid = p9_get32(req + 4);
+    uint16_t count;
+    memcpy(&count, req + 8, sizeof count);
+    req += 10;
+
+    snprintf(path, sizeof path, "%s", fid->path);
+    const size_t qidPos = conn->outLen;
+    p9_put16(conn, 0);
+
+    uint16_t walked = 0;
+    for (; walked < count; walked++)
+    {
+        uint16_t len;
+        if (req + 2 > end)
+            return -EINVAL;
+        memcpy(&len, req, sizeof len);
+        if (req + 2 + len > end)
+            return -EINVAL;
+
+        const size_t pathLen = strlen(path);
+        // Never walk above the served directory
+        if (len == 2 && !memcmp(req + 2, "..", 2))
+        {
+            char *slash = strrchr(path, '/');
+            if (slash && pathLen > strlen(g_p9Root))
+                *slash = '\0';
+        }
+        else if (pathLen + 1 + len < sizeof path)
+        {
+            path[pathLen] = '/';
+            memcpy(&path[pathLen + 1], req + 2, len);
+            path[pathLen + 1 + len] = '\0';
+        }
+        req += 2 + len;
+
+        if (lstat(path, &st) < 0)
+            break;
+        p9_putqid(conn, &st);
+    }
+
+    // Error only if the first name is not found, like other servers
+    if (count && !walked)
+        return -ENOENT;
+
+    memcpy(&conn->out[qidPos], &walked, sizeof walked);
+    if (walked == count)
+    {
+        struct p9_fid *target = p9_fid(conn, newFid, true);
+        if (!target)
+            return -ENOMEM;
+        return p9_set(target, path);
+    }
+
+    return 0;
+}
+
+static int p9_getattr(struct p9_conn *conn, const struct p9_fid *fid)
+{
+    struct stat st;
+
+    if (lstat(fid->path, &st) < 0)
+        return -errno;
+
+    p9_put64(conn, 0x7ff);
+    p9_putqid(conn, &st);
+    p9_put32(conn, st.st_mode);
+    p9_put32(conn, st.st_uid);
+    p9_put32(conn, st.st_gid);
+    p9_put64(conn, st.st_nlink);
+    p9_put64(conn, st.st_rdev);
+    p9_put64(conn, st.st_size);
+    p9_put64(conn, st.st_blksize);
+    p9_put64(conn, st.st_blocks);
+    p9_put64(conn, st.st_atim.tv_sec);
+    p9_put64(conn, st.st_atim.tv_nsec);
+    p9_put64(conn, st.st_mtim.tv_sec);
+    p9_put64(conn, st.st_mtim.tv_nsec);
+    p9_put64(conn, st.st_ctim.tv_sec);
+    p9_put64(conn, st.st_ctim.tv_nsec);
+    for (int i = 0; i < 4; i++)
+        p9_put64(conn, 0);
+    return 0;
+}
+
+static int p9_readdir(struct p9_conn *conn, struct p9_fid *fid,
+    const uint64_t offset, uint32_t count)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!fid->dir)
+    {
+        fid->dir = fdopendir(fid->fd);
+        if (!fid->dir)
+            return -errno;
+    }
+
+    if (offset)
+        seekdir(fid->dir, offset);
+    else
+        rewinddir(fid->dir);
+
+    const size_t countPos = conn->outLen;
+    p9_put32(conn, 0);
+    const size_t start = conn->outLen;
+
+    while (true)
+    {
+        const long pos = telldir(fid->dir);
+        struct dirent *dent = readdir(fid->dir);
+        if (!dent)
+            break;
+
+        const size_t len = 13 + 8 + 1 + 2 + strlen(dent->d_name);
+        if (conn->outLen - start + len > count)
+        {
+            seekdir(fid->dir, pos);
+            break;
+        }
+
+        snprintf(path, sizeof path, "%s/%s", fid->path, dent->d_name);
+        if (lstat(path, &st) < 0)
+            memset(&st, 0, sizeof st);
+        p9_putqid(conn, &st);
+        p9_put64(conn, telldir(fid->dir));
+        p9_put8(conn, dent->d_type);
+        p9_putstr(conn, dent->d_name);
+    }
+
+    count = conn->outLen - start;
+    memcpy(&conn->out[countPos], &count, sizeof count);
+    return 0;
+}
+
+static int p9_request(struct p9_conn *conn, const uint8_t type,
+    const char *req, const char *end)
+{
+    struct stat st;
+    struct p9_fid *fid = end - req >= 4 ? p9_fid(conn, p9_get32(req), false)
+        : NULL;
+
+    switch (type)
+    {
+        case 100: // Tversion
+        {
+            const uint32_t msize = p9_get32(req);
+            conn->msize = msize < g_p9MaxMsize ? msize : g_p9MaxMsize;
+            p9_put32(conn, conn->msize);
+            p9_putstr(conn, end - req >= 14 && !memcmp(req + 6, "9P2000.L", 8)
+                ? "9P2000.L" : "unknown");
+            return 0;
+        }
+        case 104: // Tattach
+            fid = p9_fid(conn, p9_get32(req), true);
+            if (!fid || lstat(g_p9Root, &st) < 0)
+                return -ENOENT;
+            p9_putqid(conn, &st);
+            return p9_set(fid, g_p9Root);
+        case 110: // Twalk
+            return p9_walk(conn, req, end);
+        case 24: // Tgetattr
+            return fid ? p9_getattr(conn, fid) : -EBADF;
+        case 12: // Tlopen
+        {
+            if (!fid)
+                return -EBADF;
+            const uint32_t flags = p9_get32(req + 4);
+            if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_TRUNC | O_CREAT)))
+                return -EROFS;
+
+            fid->fd = open(fid->path, O_RDONLY | O_CLOEXEC);
+            if (fid->fd < 0 || fstat(fid->fd, &st) < 0)
+                return -errno;
+            p9_putqid(conn, &st);
+            p9_put32(conn, 0);
+            return 0;
+        }
+        case 116: // Tread
+        {
+            if (!fid || fid->fd < 0)
+                return -EBADF;
+
+            uint32_t count = p9_get32(req + 12);
+            if (count > conn->msize - 11)
+                count = conn->msize - 11;
+
+            const ssize_t ret = pread(fid->fd, &conn->out[conn->outLen + 4],
+                count, p9_get64(req + 4));
+            if (ret < 0)
+                return -errno;
+            p9_put32(conn, ret);
+            conn->outLen += ret;
+            return 0;
+        }
+        case 40: // Treaddir
+            if (!fid || fid->fd < 0)
+                return -EBADF;
+            return p9_readdir(conn, fid, p9_get64(req + 4),
+                p9_get32(req + 12) < conn->msize - 11 ? p9_get32(req + 12)
+                : conn->msize - 11);
+        case 22: // Treadlink
+        {
+            char target[PATH_MAX];
+            if (!fid)
+                return -EBADF;
+
+            const ssize_t ret = readlink(fid->path, target, sizeof target - 1);
+            if (ret < 0)
+                return -errno;
+            target[ret] = '\0';
+            p9_putstr(conn, target);
+            return 0;
+        }
+        case 8: // Tstatfs
+        {
+            struct statvfs vfs;
+            if (!fid || statvfs(fid->path, &vfs) < 0)
+                return -EBADF;
+
+            p9_put32(conn, 0x01021997);
+            p9_put32(conn, vfs.f_bsize);
+            p9_put64(conn, vfs.f_blocks);
+            p9_put64(conn, vfs.f_bfree);
+            p9_put64(conn, vfs.f_bavail);
+            p9_put64(conn, vfs.f_files);
+            p9_put64(conn, vfs.f_ffree);
+            p9_put64(conn, vfs.f_fsid);
+            p9_put32(conn, vfs.f_namemax);
+            return 0;
+        }
+        case 120: // Tclunk
+            if (!fid)
+                return -EBADF;
+            p9_clunk(fid);
+            return 0;
+        case 108: // Tflush
+            return 0;
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+
+static void *p9_serve(void *arg)
+{
+    struct p9_conn conn = { .sock = (int)(intptr_t)arg, .msize = 0x2000 };
+
+    conn.in = malloc(g_p9MaxMsize);
+    conn.out = malloc(g_p9MaxMsize);
+    while (conn.in && conn.out)
+    {
+        uint32_t size;
+        uint16_t tag;
+
+        if (read_all(conn.sock, &size, sizeof size) < 0)
+            break;
+        if (size < 7 || size > g_p9MaxMsize
+            || read_all(conn.sock, conn.in, size - 4) < 0)
+        {
+            break;
+        }
+
+        const uint8_t type = conn.in[0];
+        memcpy(&tag, &conn.in[1], sizeof tag);
+
+        conn.outLen = 7;
+        int ret = p9_request(&conn, type, &conn.in[3], &conn.in[size - 4]);
+        if (!ret && conn.outLen > conn.msize)
+            ret = -ENOSPC;
+
+        // Rlerror carries errno of Linux which the client understands as is
+        uint8_t rtype = type + 1;
+        if (ret < 0)
+        {
+            conn.outLen = 7;
+            p9_put32(&conn, -ret);
+            rtype = 7;
+        }
+
+        size = conn.outLen;
+        memcpy(conn.out, &size, sizeof size);
+        conn.out[4] = rtype;
+        memcpy(&conn.out[5], &tag, sizeof tag);
+        if (write_all(conn.sock, conn.out, conn.outLen) < 0)
+            break;
+    }
+
+    for (unsigned int i = 0; i < conn.fidCount; i++)
+    {
+        if (conn.fids[i].used)
+            p9_clunk(&conn.fids[i]);
+    }
+    free(conn.fids);
+    free(conn.in);
+    free(conn.out);
+    close(conn.sock);
+    return NULL;
+}
+
+static void *p9_listen(void *arg)
+{
+    const int listenFd = (int)(intptr_t)arg;
+
+    while (true)
+    {
+        const int sock = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOG("accept %d", errno);
+            break;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, p9_serve, (void *)(intptr_t)sock))
+        {
+            LOG("pthread_create");
+            close(sock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+static int parse_compression(const char *arg, int *level)
+{
+    static const char *const names[] = {
+        [COMPRESSION_NONE] = "none",
+        [COMPRESSION_LZ4] = "lz4",
+        [COMPRESSION_ZSTD] = "zstd"
+    };
+
+    const char *colon = strchr(arg, ':');
+    const size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+    *level = colon ? atoi(colon + 1) : 0;
+
+    for (int i = 0; i < sizeof names / sizeof *names; i++)
+    {
+        if (strlen(names[i]) == len && !strncmp(arg, names[i], len))
+            return i;
+    }
+
+    return -1;
+}
+
+static int parse_profile(const char *arg)
+{
+    static const char *const names[] = {
+        [MOUNT_PROFILE_SAFETY] = "safety",
+        [MOUNT_PROFILE_THROUGHPUT] = "throughput",
+        [MOUNT_PROFILE_LOWWRITE] = "lowwrite"
+    };
+
+    for (int i = MOUNT_PROFILE_SAFETY; i < sizeof names / sizeof *names; i++)
+    {
+        if (!strcmp(arg, names[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n"
+        "  -u DIR      listen on DIR/50000 unix socket instead of vsock\n"
+        "  -t TYPE     start_init, import, export, eject or start_proc\n"
+        "  -s PATH     SCSI path of the distro disk\n"
+        "  -f FILE     tar file to send for import or save from export\n"
+        "  -z CODEC    ask export compression none, lz4 or zstd[:LEVEL]\n"
+        "  -P NAME     distro mount profile safety, throughput or lowwrite\n"
+        "  -n COUNT    number of messages to send (default 1)\n"
+        "  -c COUNT    messages sent at once (default 1)\n"
+        "  -i ADDR     eth0 address for start_proc\n"
+        "  -g ADDR     eth0 gateway for start_proc\n"
+        "  -6 ADDR     eth0 IPv6 address with /64 prefix for start_proc\n"
+        "  -m MTU      eth0 MTU for start_proc\n"
+        "  -S PATH     SCSI path of the swap disk for start_proc\n"
+        "  -Z MB       swap size for start_proc (default 1024)\n"
+        "  -9 DIR      serve DIR read-only with 9p on port 50001 as /tools\n"
+        "  -M MSIZE    largest 9p msize to accept (default 1048576)\n"
+        "  -w          wait for child exits after all messages\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int total = 1, concurrency = 1;
+    int compression = -1, level = 0, profile = 0;
+    bool waitExit = false;
+    const char *unixDir = NULL, *file = NULL;
+    const char *scsiPath = "/sys/bus/scsi/devices/0:0:0:1/block";
+    const char *ipaddr = "172.20.0.2", *gateway = "172.20.0.1";
+    const char *ipv6addr = NULL;
+    unsigned int mtu = 0;
+    const char *swapPath = NULL;
+    long swapSize = 1024;
+    enum initrd_msg_type type = MSG_START_INIT;
+
+    while ((opt = getopt(argc, argv, "u:t:s:f:n:c:i:g:6:m:S:Z:9:M:z:P:wh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u': unixDir = optarg; break;
+            case 's': scsiPath = optarg; break;
+            case 'f': file = optarg; break;
+            case 'n': total = atoi(optarg); break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 'i': ipaddr = optarg; break;
+            case 'g': gateway = optarg; break;
+            case '6': ipv6addr = optarg; break;
+            case 'm': mtu = strtoul(optarg, NULL, 10); break;
+            case 'S': swapPath = optarg; break;
+            case 'Z': swapSize = atol(optarg); break;
+            case '9': g_p9Root = optarg; break;
+            case 'M': g_p9MaxMsize = strtoul(optarg, NULL, 0); break;
+            case 'w': waitExit = true; break;
+            case 'z':
+                compression = parse_compression(optarg, &level);
+                if (compression < 0)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'P':
+                profile = parse_profile(optarg);
+                if (profile < 0)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 't':
+                for (type = 0; type < HOSTSIM_TYPES; type++)
+                {
+                    if (g_typeNames[type] && !strcmp(optarg, g_typeNames[type]))
+                        break;
+                }
+                if (type == HOSTSIM_TYPES || type == MSG_SEND_CAPS)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt != 'h';
+        }
+    }
+
+    if (total < 1 || concurrency < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Streams of import and export can not be told apart when mixed
+    if (type == MSG_IMPORT_DISTRO || type == MSG_EXPORT_DISTRO)
+        concurrency = 1;
+
+    if (g_p9MaxMsize < 0x1000 || g_p9MaxMsize > HOSTSIM_P9_MSIZE)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    pthread_t thread;
+    if (g_p9Root)
+    {
+        const int p9Fd = listen_socket(unixDir, LXSS_CLIENT_PORT);
+        if (p9Fd < 0)
+            return 1;
+        if (pthread_create(&thread, NULL, p9_listen, (void *)(intptr_t)p9Fd))
+        {
+            LOG("pthread_create");
+            return 1;
+        }
+    }
+
+    g_listenFd = listen_socket(unixDir, LXSS_SERVER_PORT);
+    if (g_listenFd < 0)
+        return 1;
+
+    LOG("waiting for initrd");
+    const unsigned long long bootStart = now_usec();
+    const int msgSock = accept_socket();
+    if (msgSock < 0 || receive_caps(msgSock) < 0)
+        return 1;
+    histogram_add(MSG_SEND_CAPS, now_usec() - bootStart);
+
+    int writeSock = accept_socket();
+    if (writeSock < 0)
+        return 1;
+
+    if (pthread_create(&thread, NULL, exit_reader, &writeSock))
+    {
+        LOG("pthread_create");
+        return 1;
+    }
+
+    size_t len;
+    void *msg = build_message(type, scsiPath, ipaddr, gateway, ipv6addr, mtu,
+        swapPath, swapSize * 1024 * 1024, compression, level, profile, &len);
+    if (!msg)
+        return 1;
+
+    int ret = 0;
+    for (int sent = 0; sent < total && !ret; sent += concurrency)
+    {
+        const int count = total - sent < concurrency ? total - sent : concurrency;
+        ret = run_batch(msgSock, type, count, msg, len, file);
+    }
+
+    if (waitExit)
+    {
+        while (g_exitCount < total)
+            sleep(1);
+    }
+
+    histogram_print();
+    free(msg);
+    close(msgSock);
+    close(g_listenFd);
+    return ret ? 1 : 0;
+}
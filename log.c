@@ -0,0 +1,138 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// log.c: functions for buffered logging to /dev/kmsg
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "fs.h"
+#include "log.h"
+
+#define LOG_BUFFER_SIZE 0x4000
+#define LOG_LINE_SIZE 512
+// Keep each kmsg record below LOG_LINE_MAX of printk
+#define LOG_RECORD_SIZE 960
+#define LOG_INFO_PREFIX "<6>"
+
+int g_logLevel = LOG_LEVEL;
+
+static pthread_mutex_t g_logLock = PTHREAD_MUTEX_INITIALIZER;
+static char g_logBuffer[LOG_BUFFER_SIZE];
+static size_t g_logLen = 0;
+static bool g_logSync = false;
+
+void log_init(void)
+{
+    g_logLevel = config_long("loglevel", LOG_LEVEL);
+}
+
+// Forked children keep messages of parent in buffer, drop them and
+// write every message directly as children may exec at any time
+void log_child(void)
+{
+    pthread_mutex_init(&g_logLock, NULL);
+    g_logLen = 0;
+    g_logSync = true;
+}
+
+static void log_flush_locked(void)
+{
+    char record[sizeof LOG_INFO_PREFIX + LOG_RECORD_SIZE];
+    size_t offset = 0;
+
+    // Pack as many whole lines as possible in one kmsg record
+    while (offset < g_logLen)
+    {
+        size_t len = 0;
+        while (offset + len < g_logLen)
+        {
+            const char *end = memchr(&g_logBuffer[offset + len], '\n',
+                g_logLen - offset - len);
+            const size_t lineLen = end - &g_logBuffer[offset + len] + 1;
+            if (len && len + lineLen > LOG_RECORD_SIZE)
+                break;
+            len += lineLen;
+        }
+
+        if (len > LOG_RECORD_SIZE)
+            len = LOG_RECORD_SIZE;
+
+        memcpy(record, LOG_INFO_PREFIX, sizeof LOG_INFO_PREFIX - 1);
+        memcpy(&record[sizeof LOG_INFO_PREFIX - 1], &g_logBuffer[offset], len);
+        if (write(g_kmsgFd, record, sizeof LOG_INFO_PREFIX - 1 + len) < 0)
+            break;
+        offset += len;
+    }
+
+    g_logLen = 0;
+}
+
+void log_flush(void)
+{
+    pthread_mutex_lock(&g_logLock);
+    log_flush_locked();
+    pthread_mutex_unlock(&g_logLock);
+}
+
+void log_error(const char *format, ...)
+{
+    va_list args;
+    char line[LOG_LINE_SIZE];
+
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (len >= sizeof line)
+    {
+        len = sizeof line - 1;
+        line[len - 1] = '\n';
+    }
+
+    // Keep order with earlier messages and write errors synchronously
+    pthread_mutex_lock(&g_logLock);
+    log_flush_locked();
+    if (write(g_kmsgFd, line, len) < 0)
+        g_logLen = 0;
+    pthread_mutex_unlock(&g_logLock);
+}
+
+void log_info(const char *format, ...)
+{
+    va_list args;
+    char line[LOG_LINE_SIZE];
+
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (len >= sizeof line)
+    {
+        len = sizeof line - 1;
+        line[len - 1] = '\n';
+    }
+
+    pthread_mutex_lock(&g_logLock);
+    if (g_logSync)
+    {
+        memcpy(g_logBuffer, line, len);
+        g_logLen = len;
+        log_flush_locked();
+    }
+    else
+    {
+        if (g_logLen + len > LOG_BUFFER_SIZE)
+            log_flush_locked();
+        memcpy(&g_logBuffer[g_logLen], line, len);
+        g_logLen += len;
+    }
+    pthread_mutex_unlock(&g_logLock);
+}
@@ -0,0 +1,28 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// log.h: functions for buffered logging to /dev/kmsg
+
+#ifndef INITRD_LOG_H
+#define INITRD_LOG_H
+
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_INFO 6
+
+// Messages above this level are compiled out e.g. make LOG_LEVEL=3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+extern int g_logLevel;
+
+#define LOG_ERROR(str, ...) { log_error("<3>ERROR: %s:%u: " str "\n", __func__, __LINE__, ##__VA_ARGS__); }
+#define LOG_INFO(str, ...) { if (LOG_LEVEL >= LOG_LEVEL_INFO && g_logLevel >= LOG_LEVEL_INFO) log_info("INFO: %s:%u: " str "\n", __func__, __LINE__, ##__VA_ARGS__); }
+
+void log_init(void);
+void log_child(void);
+void log_flush(void);
+void log_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_info(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#endif // INITRD_LOG_H
@@ -4,44 +4,91 @@
 // main.c: main function
 
 #include <errno.h>
-#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/signalfd.h>
 #include <sys/reboot.h>
-#include <sys/wait.h>
 #include <unistd.h>
 
+#include "child.h"
+#include "event.h"
 #include "fs.h"
+#include "mem.h"
+#include "metrics.h"
 #include "msg.h"
 #include "net.h"
 #include "proc.h"
+#include "trace.h"
 #include "util.h"
 
-int main(void)
+// One Lxss message channel with its own receive ring
+struct session
 {
-    int ret;
+    int sock;
+    struct msg_ring ring;
+};
 
-    const int msgSock = connect_hv_socket(LXSS_SERVER_PORT, -1, true);
-    if (msgSock < 0)
+static int on_message(const int fd, const unsigned int events, void *ctx)
+{
+    struct session *session = ctx;
+
+    if (events & EPOLLIN)
     {
-        LOG_ERROR("msgSock %d", errno);
+        struct initrd_msg_buffer *buf;
+        ssize_t recvRet = msg_receive(fd, &session->ring);
+        if (recvRet < 0 && errno == EAGAIN)
+            return 0;
+        if (recvRet <= 0)
+            return -1;
+
+        while ((recvRet = msg_next(&session->ring, &buf)) > 0)
+            msg_process(fd, buf);
+        if (recvRet < 0)
+            return -1;
+    }
+    else if (events & (EPOLLERR | EPOLLHUP))
+    {
+        LOG_ERROR("epoll msgSock %d", errno);
         return -1;
     }
 
-    if (msg_cap(msgSock) < 0)
+    return 0;
+}
+
+static int on_signal(const int fd, const unsigned int events, void *ctx)
+{
+    int ret;
+    const int writeSock = *(int *)ctx;
+
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        LOG_ERROR("epoll sigFd %d", errno);
         return -1;
+    }
 
-    const int writeSock = connect_hv_socket(LXSS_SERVER_PORT, -1, true);
-    if (writeSock < 0)
+    struct signalfd_siginfo siginfo;
+    ret = TEMP_FAILURE_RETRY(read(fd, &siginfo, sizeof siginfo));
+
+    if(ret != sizeof siginfo)
     {
-        LOG_ERROR("writeSock %d", errno);
+        LOG_ERROR("read(sigFd) %d", errno);
         return -1;
     }
 
-    if (mount_root() < 0)
+    if (siginfo.ssi_signo != SIGCHLD)
+    {
+        LOG_ERROR("read(sigFd) signal %d.\n", siginfo.ssi_signo);
         return -1;
+    }
+
+    return child_reap(writeSock);
+}
+
+int main(void)
+{
+    int ret;
 
+    // Block SIGCHLD before any thread is created for signalfd
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGCHLD);
@@ -53,87 +100,69 @@ int main(void)
         return -1;
     }
 
-    struct pollfd pfds[2] = {
-        { msgSock, POLLIN, 0 },
-        { sigFd, POLLIN, 0 }
-    };
-    size_t msgLen = 0;
-    struct initrd_msg_buffer *buf = NULL;
+    metrics_init();
+
+    // Mount the local file systems while talking with Lxss service
+    if (mount_root() < 0)
+        return -1;
+
+    // Transport of host sockets is chosen by boot parameters
+    if (mount_wait(MOUNT_STEP_CONFIG) < 0)
+        return -1;
+
+    const int msgSock = connect_hv_socket("msg", LXSS_SERVER_PORT, -1, true);
+    if (msgSock < 0)
+    {
+        LOG_ERROR("msgSock %d", errno);
+        return -1;
+    }
+
+    const long long start = trace_now();
+    ret = msg_cap(msgSock);
+    trace_event("msg", "msg_cap", start, ret);
+    if (ret < 0)
+        return -1;
 
-    while (true)
+    int writeSock = connect_hv_socket("exit", LXSS_SERVER_PORT, -1, true);
+    if (writeSock < 0)
     {
-        do
-        {
-pollstart:
-            if (poll(pfds, 2, -1) < 0)
-            {
-                LOG_ERROR("poll %d", errno);
-                goto cleanup;
-            }
-
-            if (pfds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
-            {
-                LOG_ERROR("poll msgSock %d", errno);
-                goto cleanup;
-            }
-
-            if (pfds[0].revents & POLLIN)
-            {
-                ssize_t recvRet = msg_receive(msgSock, &buf, &msgLen);
-                if (recvRet <= 0)
-                    goto cleanup;
-                msg_process(msgSock, buf, recvRet);
-            }
-
-            if (pfds[1].revents & (POLLERR | POLLHUP | POLLNVAL))
-            {
-                LOG_ERROR("poll sigFd %d", errno);
-                goto cleanup;
-            }
-        }
-        while ((pfds[1].revents & POLLIN) == 0);
-
-        struct signalfd_siginfo siginfo;
-        ret = TEMP_FAILURE_RETRY(read(sigFd, &siginfo, sizeof siginfo));
-
-        if(ret != sizeof siginfo)
-        {
-            LOG_ERROR("read(sigFd) %d", errno);
-            goto cleanup;
-        }
-
-        if (siginfo.ssi_signo != SIGCHLD)
-        {
-            LOG_ERROR("read(sigFd) signal %d.\n", siginfo.ssi_signo);
-            break;
-        }
-
-        while (true)
-        {
-            int wstatus;
-            pid_t child = waitpid(-1, &wstatus, WNOHANG);
-            if (!child)
-                break;
-            if (child <= 0)
-            {
-                if (errno != ECHILD)
-                    LOG_ERROR("waitpid %d", errno);
-                goto pollstart;
-            }
-            sync();
-
-            ret = TEMP_FAILURE_RETRY(write(writeSock, &child, sizeof child));
-            if (ret < 0)
-                LOG_ERROR("write(writeSock) %d", errno);
-        }
+        LOG_ERROR("writeSock %d", errno);
+        return -1;
     }
 
+    mount_signal(MOUNT_STEP_HOST);
+    if (mount_wait(MOUNT_STEP_CORE) < 0)
+        return -1;
+
+    log_init();
+    trace_open();
+
+    if (event_init() < 0)
+        return -1;
+
+    static struct session session;
+    session.sock = msgSock;
+    ret = event_add(msgSock, EPOLLIN, on_message, &session);
+    if (ret < 0)
+        goto cleanup;
+
+    ret = event_add(sigFd, EPOLLIN, on_signal, &writeSock);
+    if (ret < 0)
+        goto cleanup;
+
+    pool_init();
+    mem_pressure_init();
+    metrics_open();
+
+    event_loop();
+
 cleanup:
-    free(buf);
+    free(session.ring.buf);
     close(sigFd);
     close(msgSock);
     close(writeSock);
     sync();
     LOG_INFO("main exit %d", errno);
+    log_flush();
     reboot(RB_POWER_OFF);
 }
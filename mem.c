@@ -0,0 +1,736 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// mem.c: functions for managing memory of the VM
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/swap.h>
+#include <unistd.h>
+
+#include "child.h"
+#include "config.h"
+#include "event.h"
+#include "fs.h"
+#include "mem.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+
+#define SWAP_SIGNATURE "SWAPSPACE2"
+#define SWAP_SIGNATURE_LEN 10
+#define SWAP_VERSION 1
+#define SWAP_MIN_PAGES 10
+#define COMPACT_IDLE_PERCENT 90
+#define PSI_FILE "/proc/pressure/memory"
+#define PSI_WINDOW_USEC 1000000
+#define PSI_RELAX_MSEC 10000
+#define PSI_ACT_MSEC 5000
+#define PSI_HIGH_PERCENT 90
+#define PSI_RECLAIM_PERCENT 5
+#define PSI_HIGH_MIN (256L << 20)
+#define MEM_CGROUP_ROOT "/sys/fs/cgroup"
+#define MEM_BACKGROUND_GROUP MEM_CGROUP_ROOT "/background"
+#define MEM_V1_GROUP MEM_CGROUP_ROOT "/memory/64M"
+#define MEM_HIGH_FILE "memory.high"
+#define MEM_HIGH_MAX "max\n"
+#define MEM_USAGE_FILE "memory.current"
+#define MEM_RECLAIM_FILE "memory.reclaim"
+#define GROUP_RETRY_MSEC 1000
+#define GROUP_RETRY_MAX 30
+
+// Header in the first page of a swap device, same as mkswap writes
+struct swap_header
+{
+    char bootbits[1024];
+    uint32_t version;
+    uint32_t last_page;
+    uint32_t nr_badpages;
+    unsigned char uuid[16];
+    char volume_name[16];
+};
+
+// Memory cgroup of a running distro which is throttled under pressure
+struct mem_group
+{
+    struct mem_group *next;
+    int id;
+    pid_t pid;
+    bool throttled;
+    bool dead;
+    int retries;
+    char path[64];
+};
+
+static int g_compactTimer = -1;
+static bool g_compactBusy = false;
+static int g_psiFd = -1;
+static int g_relaxTimer = -1;
+static long long g_pressureLast = 0;
+static bool g_reclaimBusy = false;
+static int g_groupTimer = -1;
+static struct mem_group *g_groups = NULL;
+static unsigned long long g_cpuTotal = 0;
+static unsigned long long g_cpuIdle = 0;
+
+static int swap_format(const int fd, const char *blkDev, const long size)
+{
+    int ret;
+    uint64_t devSize;
+    const long pageSize = sysconf(_SC_PAGESIZE);
+
+    ret = ioctl(fd, BLKGETSIZE64, &devSize);
+    if (ret < 0)
+    {
+        LOG_ERROR("ioctl(BLKGETSIZE64, %s) %d", blkDev, errno);
+        return ret;
+    }
+
+    // Host may attach a disk larger than the swap it asked for
+    if (size > 0 && (uint64_t)size < devSize)
+        devSize = size;
+
+    const uint64_t pages = devSize / pageSize;
+    if (pages < SWAP_MIN_PAGES || pages - 1 > UINT32_MAX)
+    {
+        LOG_ERROR("swap size of %s incorrect %llu", blkDev,
+            (unsigned long long)devSize);
+        return -1;
+    }
+
+    char *page = calloc(1, pageSize);
+    if (!page)
+    {
+        LOG_ERROR("calloc %ld", pageSize);
+        return -1;
+    }
+
+    ret = TEMP_FAILURE_RETRY(pread(fd, page, pageSize, 0));
+    if (ret != pageSize)
+    {
+        LOG_ERROR("pread(%s) %d", blkDev, errno);
+        free(page);
+        return -1;
+    }
+
+    // Keep an existing swap area of the same size, it may be in use already
+    struct swap_header *header = (void *)page;
+    if (!memcmp(&page[pageSize - SWAP_SIGNATURE_LEN], SWAP_SIGNATURE,
+        SWAP_SIGNATURE_LEN) && header->version == SWAP_VERSION
+        && header->last_page == pages - 1)
+    {
+        free(page);
+        return 0;
+    }
+
+    memset(page, 0, pageSize);
+    header->version = SWAP_VERSION;
+    header->last_page = pages - 1;
+    if (getrandom(header->uuid, sizeof header->uuid, 0) < 0)
+        LOG_ERROR("getrandom %d", errno);
+    memcpy(&page[pageSize - SWAP_SIGNATURE_LEN], SWAP_SIGNATURE,
+        SWAP_SIGNATURE_LEN);
+
+    ret = TEMP_FAILURE_RETRY(pwrite(fd, page, pageSize, 0));
+    if (ret != pageSize)
+    {
+        LOG_ERROR("pwrite(%s) %d", blkDev, errno);
+        ret = -1;
+    }
+    else
+        ret = fsync(fd);
+
+    LOG_INFO("swap %s formatted %llu pages", blkDev, (unsigned long long)pages);
+    free(page);
+    return ret;
+}
+
+static int swap_enable(const char *scsiPath, const long size)
+{
+    int ret;
+    char *blkDev = NULL;
+
+    ret = util_devpath(scsiPath, &blkDev);
+    if (ret < 0)
+        return ret;
+
+    const int fd = open(blkDev, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        LOG_ERROR("open(%s) %d", blkDev, errno);
+        free(blkDev);
+        return fd;
+    }
+
+    ret = swap_format(fd, blkDev, size);
+    close(fd);
+
+    if (ret >= 0)
+    {
+        // Above swap files of distros which get the default negative ones
+        const long priority = config_long("swap.priority", 10);
+        int flags = SWAP_FLAG_DISCARD;
+        if (priority >= 0)
+        {
+            flags |= SWAP_FLAG_PREFER
+                | ((priority << SWAP_FLAG_PRIO_SHIFT) & SWAP_FLAG_PRIO_MASK);
+        }
+
+        ret = swapon(blkDev, flags);
+        if (ret < 0 && errno == EBUSY)
+            ret = 0;
+        else if (ret < 0)
+            LOG_ERROR("swapon(%s) %d", blkDev, errno);
+    }
+
+    free(blkDev);
+    return ret;
+}
+
+// Swap is set up in a reaped child, PID 1 keeps no threads which hold locks
+int mem_swap(const char *scsiPath, const long size)
+{
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        LOG_ERROR("fork %d", errno);
+        return pid;
+    }
+
+    if (pid)
+        return child_track_internal(pid, NULL, NULL);
+
+    child_init();
+    const long long start = trace_now();
+    const int ret = swap_enable(scsiPath, size);
+    trace_event("mem", "mem_swap", start, ret);
+
+    // Host reads the outcome from metrics, it has no reply for START_PROC
+    metrics_set(METRIC_SWAP_ENABLED, ret < 0 ? -1 : 1);
+    if (ret < 0)
+    {
+        LOG_ERROR("swap %s failed", scsiPath);
+        exit(1);
+    }
+
+    LOG_INFO("swap %s enabled", scsiPath);
+    exit(0);
+}
+
+// Value of a /proc/meminfo field in kB, negative if it is not found
+static long mem_info(const char *key)
+{
+    char line[128];
+    long value = -1;
+    const size_t keyLen = strlen(key);
+
+    FILE *file = fopen("/proc/meminfo", "re");
+    if (!file)
+    {
+        LOG_ERROR("fopen(/proc/meminfo) %d", errno);
+        return -1;
+    }
+
+    while (fgets(line, sizeof line, file))
+    {
+        if (!strncmp(line, key, keyLen) && line[keyLen] == ':')
+        {
+            value = strtol(&line[keyLen + 1], NULL, 10);
+            break;
+        }
+    }
+
+    fclose(file);
+    return value;
+}
+
+// CPUs were mostly idle since the previous pass
+static bool mem_idle(void)
+{
+    unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+
+    FILE *file = fopen("/proc/stat", "re");
+    if (!file)
+    {
+        LOG_ERROR("fopen(/proc/stat) %d", errno);
+        return false;
+    }
+
+    const int count = fscanf(file, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+        &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+    fclose(file);
+    if (count != 8)
+        return false;
+
+    const unsigned long long total = user + nice + system + idle + iowait
+        + irq + softirq + steal;
+    const unsigned long long totalDelta = total - g_cpuTotal;
+    const unsigned long long idleDelta = idle + iowait - g_cpuIdle;
+    g_cpuTotal = total;
+    g_cpuIdle = idle + iowait;
+
+    return totalDelta && idleDelta * 100 >= totalDelta * COMPACT_IDLE_PERCENT;
+}
+
+// Writes to drop_caches and compact_memory take seconds on large VMs
+static void mem_compact_worker(void)
+{
+    const long long start = trace_now();
+    const long freeBefore = mem_info("MemFree");
+
+    // Only clean page cache is dropped, dirty pages stay until written back
+    const long dropCache = config_long("compact.dropcache", 0);
+    if (dropCache > 0 && mem_info("Cached") > dropCache * 1024)
+        util_writefile("/proc/sys/vm/drop_caches", "1\n");
+
+    // Free pages in large blocks are reported to host and returned
+    util_writefile("/proc/sys/vm/compact_memory", "1\n");
+
+    const long freed = (mem_info("MemFree") - freeBefore) * 1024
+        / sysconf(_SC_PAGESIZE);
+    LOG_INFO("compact freed %ld pages", freed);
+    trace_event("mem", "mem_compact", start, freed);
+}
+
+static void on_compact_done(const int status, void *ctx)
+{
+    g_compactBusy = false;
+}
+
+static int on_compact(const int fd, const unsigned int events, void *ctx)
+{
+    if (!mem_idle())
+    {
+        LOG_INFO("compact skipped, CPUs less than %d%% idle", COMPACT_IDLE_PERCENT);
+        return 0;
+    }
+
+    if (g_compactBusy)
+        return 0;
+
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        LOG_ERROR("fork %d", errno);
+        return 0;
+    }
+
+    if (!pid)
+    {
+        child_init();
+        mem_compact_worker();
+        exit(0);
+    }
+
+    g_compactBusy = child_track_internal(pid, on_compact_done, NULL) >= 0;
+    return 0;
+}
+
+// Compact memory every timeout seconds, host sends 0 to disable it
+int mem_compact(const int timeout)
+{
+    if (g_compactTimer >= 0)
+    {
+        event_del(g_compactTimer);
+        close(g_compactTimer);
+        g_compactTimer = -1;
+    }
+
+    if (timeout <= 0)
+        return 0;
+
+    mem_idle();
+    g_compactTimer = event_timer(timeout * 1000L, true, on_compact, NULL);
+    return g_compactTimer < 0 ? -1 : 0;
+}
+
+static long mem_readlong(const char *path)
+{
+    char buf[32];
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    const ssize_t ret = TEMP_FAILURE_RETRY(read(fd, buf, sizeof buf - 1));
+    close(fd);
+    if (ret <= 0)
+        return -1;
+
+    buf[ret] = '\0';
+    return strtol(buf, NULL, 10);
+}
+
+static int mem_group_write(const struct mem_group *group, const char *file,
+    const char *data)
+{
+    char path[128];
+
+    snprintf(path, sizeof path, "%s/%s", group->path, file);
+    return util_writefile(path, data);
+}
+
+// Create a memory cgroup for a distro, the distro joins it before it starts its init
+int mem_group_create(void)
+{
+    static int nextId = 0;
+
+    if (!mem_cgroup2())
+        return -1;
+
+    struct mem_group *group = calloc(1, sizeof *group);
+    if (!group)
+    {
+        LOG_ERROR("calloc %zu", sizeof *group);
+        return -1;
+    }
+
+    group->id = ++nextId;
+    snprintf(group->path, sizeof group->path, "%s/distro-%d", MEM_CGROUP_ROOT,
+        group->id);
+    const int ret = util_mkdir(group->path, 0755);
+    if (ret < 0)
+    {
+        free(group);
+        return ret;
+    }
+
+    group->next = g_groups;
+    g_groups = group;
+    return group->id;
+}
+
+// Called by the distro child, so that none of its processes run outside the group
+int mem_group_join(const int id)
+{
+    char path[128];
+
+    snprintf(path, sizeof path, "%s/distro-%d/cgroup.procs", MEM_CGROUP_ROOT, id);
+    return util_writefile(path, "0\n");
+}
+
+static struct mem_group **mem_group_find(const int id, const pid_t pid)
+{
+    struct mem_group **group;
+
+    for (group = &g_groups; *group; group = &(*group)->next)
+    {
+        if (id ? (*group)->id == id : (*group)->pid == pid)
+            break;
+    }
+
+    return group;
+}
+
+int mem_group_add(const int id, const pid_t pid)
+{
+    struct mem_group *group = *mem_group_find(id, 0);
+    if (!group)
+        return -1;
+
+    group->pid = pid;
+    return 0;
+}
+
+// Tasks of a killed distro may still be exiting, a busy group is kept and retried
+static bool mem_group_free(struct mem_group **group)
+{
+    struct mem_group *found = *group;
+
+    if (rmdir(found->path) < 0)
+    {
+        if (errno == EBUSY && found->retries < GROUP_RETRY_MAX)
+        {
+            found->retries++;
+            found->dead = true;
+            found->pid = 0;
+            return false;
+        }
+        LOG_ERROR("rmdir(%s) %d", found->path, errno);
+    }
+
+    *group = found->next;
+    free(found);
+    return true;
+}
+
+static int on_group_retry(const int fd, const unsigned int events, void *ctx)
+{
+    bool busy = false;
+
+    event_del(fd);
+    close(fd);
+    g_groupTimer = -1;
+
+    struct mem_group **group = &g_groups;
+    while (*group)
+    {
+        if ((*group)->dead && mem_group_free(group))
+            continue;
+        busy |= (*group)->dead;
+        group = &(*group)->next;
+    }
+
+    if (busy)
+        g_groupTimer = event_timer(GROUP_RETRY_MSEC, false, on_group_retry, NULL);
+    return 0;
+}
+
+void mem_group_remove(const int id, const pid_t pid)
+{
+    struct mem_group **group = mem_group_find(id, pid);
+    if (!*group || mem_group_free(group) || g_groupTimer >= 0)
+        return;
+
+    g_groupTimer = event_timer(GROUP_RETRY_MSEC, false, on_group_retry, NULL);
+}
+
+// Pressure handling is over, let distros grow again
+static int on_relax(const int fd, const unsigned int events, void *ctx)
+{
+    event_del(fd);
+    close(fd);
+    g_relaxTimer = -1;
+
+    for (struct mem_group *group = g_groups; group; group = group->next)
+    {
+        if (group->throttled)
+        {
+            mem_group_write(group, MEM_HIGH_FILE, MEM_HIGH_MAX);
+            group->throttled = false;
+        }
+    }
+
+    LOG_INFO("memory limits lifted after %d ms", PSI_RELAX_MSEC);
+    return 0;
+}
+
+// Reclaim waits for writeback and can take long, PID 1 does not wait for it
+static void mem_reclaim_worker(void)
+{
+    char data[32], path[128];
+
+    // Clean page cache is the cheapest memory to give up
+    util_writefile("/proc/sys/vm/drop_caches", "1\n");
+
+    for (struct mem_group *group = g_groups; group; group = group->next)
+    {
+        if (group->dead)
+            continue;
+
+        snprintf(path, sizeof path, "%s/%s", group->path, MEM_USAGE_FILE);
+        const long usage = mem_readlong(path);
+        snprintf(path, sizeof path, "%s/%s", group->path, MEM_RECLAIM_FILE);
+        if (usage > 0 && !access(path, W_OK))
+        {
+            snprintf(data, sizeof data, "%ld\n", usage / 100 * PSI_RECLAIM_PERCENT);
+            util_writefile(path, data);
+        }
+    }
+}
+
+static void on_reclaim_done(const int status, void *ctx)
+{
+    g_reclaimBusy = false;
+}
+
+static void mem_reclaim_start(void)
+{
+    if (g_reclaimBusy)
+        return;
+
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        LOG_ERROR("fork %d", errno);
+        return;
+    }
+
+    if (!pid)
+    {
+        child_init();
+        mem_reclaim_worker();
+        exit(0);
+    }
+
+    g_reclaimBusy = child_track_internal(pid, on_reclaim_done, NULL) >= 0;
+}
+
+static int on_pressure(const int fd, const unsigned int events, void *ctx)
+{
+    char data[32], path[128];
+    const long long start = trace_now();
+
+    if (events & EPOLLERR)
+    {
+        LOG_ERROR("epoll %s", PSI_FILE);
+        event_del(fd);
+        close(fd);
+        g_psiFd = -1;
+        return 0;
+    }
+
+    // Throttling stalls tasks too, acting on each trigger would feed on itself
+    if (g_pressureLast && start - g_pressureLast < PSI_ACT_MSEC * 1000LL)
+        return 0;
+    g_pressureLast = start;
+
+    mem_reclaim_start();
+
+    // Limit is set once from usage at first throttle, until limits are lifted
+    int count = 0;
+    for (struct mem_group *group = g_groups; group; group = group->next)
+    {
+        if (group->dead || group->throttled)
+            continue;
+
+        snprintf(path, sizeof path, "%s/%s", group->path, MEM_USAGE_FILE);
+        const long usage = mem_readlong(path);
+        if (usage <= 0)
+            continue;
+
+        // Throttle below the current usage so that distros reclaim by themselves
+        const long high = usage / 100 * PSI_HIGH_PERCENT;
+        snprintf(data, sizeof data, "%ld\n", high);
+        if (high >= PSI_HIGH_MIN && mem_group_write(group, MEM_HIGH_FILE, data) >= 0)
+        {
+            group->throttled = true;
+            count++;
+        }
+    }
+
+    // Not pushed back by later triggers, throttling itself keeps them coming
+    if (g_relaxTimer < 0)
+        g_relaxTimer = event_timer(PSI_RELAX_MSEC, false, on_relax, NULL);
+
+    LOG_INFO("memory pressure, %d distros throttled", count);
+    trace_event("mem", "mem_pressure", start, count);
+    return 0;
+}
+
+// Act when tasks stall on memory for initrd.psi.stall usec in a second
+int mem_pressure_init(void)
+{
+    int ret;
+    char trigger[64];
+
+    // Throttling needs memory.high of cgroup v2
+    const long stall = config_long("psi.stall", 100000);
+    if (stall <= 0 || !mem_cgroup2())
+        return 0;
+
+    g_psiFd = open(PSI_FILE, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (g_psiFd < 0)
+    {
+        LOG_ERROR("open(%s) %d", PSI_FILE, errno);
+        return g_psiFd;
+    }
+
+    snprintf(trigger, sizeof trigger, "some %ld %d", stall, PSI_WINDOW_USEC);
+    ret = TEMP_FAILURE_RETRY(write(g_psiFd, trigger, strlen(trigger) + 1));
+    if (ret < 0)
+    {
+        LOG_ERROR("write(%s) %d", PSI_FILE, errno);
+        goto cleanup;
+    }
+
+    ret = event_add(g_psiFd, EPOLLPRI, on_pressure, NULL);
+    if (ret >= 0)
+        return 0;
+
+cleanup:
+    close(g_psiFd);
+    g_psiFd = -1;
+    return ret;
+}
+
+static int mem_background_write(const char *file, const char *data)
+{
+    char path[128];
+
+    snprintf(path, sizeof path, "%s/%s", MEM_BACKGROUND_GROUP, file);
+    return util_writefile(path, data);
+}
+
+// initrd.cgroup2=1 hands memory, cpu and io controllers to cgroup v2
+bool mem_cgroup2(void)
+{
+    return config_long("cgroup2", 0) > 0;
+}
+
+// Import and export yield to distros instead of a hard memory cap
+int mem_background_init(void)
+{
+    int ret;
+    char data[64];
+
+    // Without cgroup v2 they are capped in a v1 memory group like before
+    if (!mem_cgroup2())
+    {
+        ret = util_mkdir(MEM_V1_GROUP, 0755);
+        if (ret < 0)
+            return ret;
+
+        return util_writefile(MEM_V1_GROUP "/memory.limit_in_bytes", "64M\n");
+    }
+
+    // Controllers are enabled one by one, a missing one should not stop others
+    util_writefile(MEM_CGROUP_ROOT "/cgroup.subtree_control", "+memory\n");
+    util_writefile(MEM_CGROUP_ROOT "/cgroup.subtree_control", "+cpu\n");
+    util_writefile(MEM_CGROUP_ROOT "/cgroup.subtree_control", "+io\n");
+
+    ret = util_mkdir(MEM_BACKGROUND_GROUP, 0755);
+    if (ret < 0)
+        return ret;
+
+    snprintf(data, sizeof data, "%ld\n", config_long("background.cpuweight", 20));
+    mem_background_write("cpu.weight", data);
+
+    snprintf(data, sizeof data, "default %ld\n",
+        config_long("background.ioweight", 20));
+    mem_background_write("io.weight", data);
+
+    // e.g. initrd.background.iomax=8:16_wbps=104857600
+    const char *ioMax = config_get("background.iomax", NULL);
+    if (ioMax && *ioMax)
+    {
+        snprintf(data, sizeof data, "%s\n", ioMax);
+        for (char *ch = data; *ch; ch++)
+        {
+            if (*ch == '_')
+                *ch = ' ';
+        }
+        mem_background_write("io.max", data);
+    }
+
+    // Half of memory by default, page cache above it is reclaimed first
+    long high = config_long("background.memhigh", 0);
+    if (high > 0)
+        high <<= 20;
+    else
+        high = mem_info("MemTotal") * 1024 / 2;
+    if (high > 0)
+    {
+        snprintf(data, sizeof data, "%ld\n", high);
+        mem_background_write(MEM_HIGH_FILE, data);
+    }
+
+    return 0;
+}
+
+// Called in the forked import or export child
+int mem_background_join(void)
+{
+    if (!mem_cgroup2())
+        return util_writefile(MEM_V1_GROUP "/tasks", "0\n");
+
+    return mem_background_write("cgroup.procs", "0\n");
+}
@@ -0,0 +1,23 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// mem.h: functions for managing memory of the VM
+
+#ifndef INITRD_MEM_H
+#define INITRD_MEM_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+int mem_background_init(void);
+int mem_background_join(void);
+bool mem_cgroup2(void);
+int mem_compact(const int timeout);
+int mem_group_add(const int id, const pid_t pid);
+int mem_group_create(void);
+int mem_group_join(const int id);
+void mem_group_remove(const int id, const pid_t pid);
+int mem_pressure_init(void);
+int mem_swap(const char *scsiPath, const long size);
+
+#endif // INITRD_MEM_H
@@ -0,0 +1,361 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// metrics.c: functions for runtime counters in Prometheus text format
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "event.h"
+#include "metrics.h"
+#include "msg.h"
+#include "net.h"
+#include "trace.h"
+#include "util.h"
+
+#define METRICS_PORT 50005
+#define METRICS_BUFFER_SIZE 0x8000
+#define METRICS_BUCKET_COUNT 7
+#define METRICS_MSG_TYPES (MSG_SEND_CAPS + 2)
+
+// Call sites of connect_hv_socket() and connect_hv_async(), other is the last
+static const char *const g_connectSites[] = {
+    "launch", "import_stdin", "import_stderr", "export_stdout",
+    "export_stderr", "localhost", "telemetry", "msg", "exit", "tools",
+    "tracker", "other"
+};
+
+#define METRICS_SITE_COUNT (sizeof g_connectSites / sizeof *g_connectSites)
+
+struct metric_buckets
+{
+    unsigned long long buckets[METRICS_BUCKET_COUNT];
+    unsigned long long count;
+    unsigned long long sumUsec;
+};
+
+// Distro children update the counters too, so they live in a shared mapping
+struct metrics
+{
+    unsigned long long counters[METRIC_COUNTER_COUNT];
+    long long gauges[METRIC_GAUGE_COUNT];
+    unsigned long long messages[METRICS_MSG_TYPES];
+    struct metric_buckets histograms[METRIC_HISTOGRAM_COUNT];
+    struct metric_buckets connects[METRICS_SITE_COUNT];
+};
+
+struct metrics_out
+{
+    char buf[METRICS_BUFFER_SIZE];
+    size_t len;
+};
+
+// Upper bounds in usec, the last bucket is +Inf
+static const long long g_bucketUsec[METRICS_BUCKET_COUNT - 1] = {
+    100, 1000, 10000, 100000, 1000000, 10000000
+};
+
+static const char *const g_bucketNames[METRICS_BUCKET_COUNT] = {
+    "0.0001", "0.001", "0.01", "0.1", "1", "10", "+Inf"
+};
+
+static const char *const g_histogramNames[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_MSG_PROCESS] = "initrd_msg_process_seconds",
+    [METRIC_MOUNT_VHD] = "initrd_mount_vhd_seconds",
+    [METRIC_DEVPATH] = "initrd_devpath_wait_seconds"
+};
+
+static struct metrics g_localMetrics;
+static struct metrics *g_metrics = &g_localMetrics;
+
+// Called before any child or thread is created
+int metrics_init(void)
+{
+    void *shared = mmap(NULL, sizeof g_localMetrics, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        LOG_ERROR("mmap %d", errno);
+        return -1;
+    }
+
+    g_metrics = shared;
+    return 0;
+}
+
+void metrics_add(const enum metric_counter counter,
+    const unsigned long long value)
+{
+    __atomic_add_fetch(&g_metrics->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void metrics_set(const enum metric_gauge gauge, const long long value)
+{
+    __atomic_store_n(&g_metrics->gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void metrics_message(const int type)
+{
+    const int slot = type >= 0 && type < METRICS_MSG_TYPES - 1
+        ? type : METRICS_MSG_TYPES - 1;
+    __atomic_add_fetch(&g_metrics->messages[slot], 1, __ATOMIC_RELAXED);
+}
+
+static void metrics_buckets_add(struct metric_buckets *hist,
+    const long long start)
+{
+    int i;
+    const long long usec = trace_now() - start;
+
+    for (i = 0; i < METRICS_BUCKET_COUNT - 1; i++)
+    {
+        if (usec <= g_bucketUsec[i])
+            break;
+    }
+
+    __atomic_add_fetch(&hist->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sumUsec, usec > 0 ? usec : 0, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(const enum metric_histogram histogram,
+    const long long start)
+{
+    metrics_buckets_add(&g_metrics->histograms[histogram], start);
+}
+
+void metrics_connect(const char *site, const long long start)
+{
+    size_t i;
+
+    for (i = 0; i < METRICS_SITE_COUNT - 1; i++)
+    {
+        if (!strcmp(site, g_connectSites[i]))
+            break;
+    }
+
+    metrics_buckets_add(&g_metrics->connects[i], start);
+}
+
+static void metrics_printf(struct metrics_out *out, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    const int ret = vsnprintf(&out->buf[out->len], sizeof out->buf - out->len,
+        format, args);
+    va_end(args);
+
+    if (ret > 0)
+    {
+        out->len += ret;
+        if (out->len >= sizeof out->buf)
+            out->len = sizeof out->buf - 1;
+    }
+}
+
+static unsigned long long metrics_read(const unsigned long long *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static void metrics_counter(struct metrics_out *out, const char *name,
+    const char *help, const enum metric_counter counter)
+{
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name,
+        help, name, name, metrics_read(&g_metrics->counters[counter]));
+}
+
+static void metrics_gauge(struct metrics_out *out, const char *name,
+    const char *help, const enum metric_gauge gauge)
+{
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name,
+        help, name, name,
+        (long long)__atomic_load_n(&g_metrics->gauges[gauge], __ATOMIC_RELAXED));
+}
+
+static void metrics_seconds(struct metrics_out *out, const char *name,
+    const char *help, const enum metric_counter counter)
+{
+    const unsigned long long usec = metrics_read(&g_metrics->counters[counter]);
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu.%06llu\n",
+        name, help, name, name, usec / 1000000, usec % 1000000);
+}
+
+// Buckets are kept apart and summed here as Prometheus expects
+static void metrics_buckets(struct metrics_out *out, const char *name,
+    const char *label, const struct metric_buckets *hist)
+{
+    char labels[64];
+    unsigned long long total = 0;
+    const char *sep = *label ? "," : "";
+
+    for (int i = 0; i < METRICS_BUCKET_COUNT; i++)
+    {
+        total += metrics_read(&hist->buckets[i]);
+        metrics_printf(out, "%s_bucket{%s%sle=\"%s\"} %llu\n", name, label, sep,
+            g_bucketNames[i], total);
+    }
+
+    if (*label)
+        snprintf(labels, sizeof labels, "{%s}", label);
+    else
+        labels[0] = '\0';
+
+    const unsigned long long sum = metrics_read(&hist->sumUsec);
+    metrics_printf(out, "%s_sum%s %llu.%06llu\n%s_count%s %llu\n", name,
+        labels, sum / 1000000, sum % 1000000, name, labels,
+        metrics_read(&hist->count));
+}
+
+static void metrics_render(struct metrics_out *out)
+{
+    char label[64];
+
+    out->len = 0;
+    out->buf[0] = '\0';
+
+    metrics_printf(out, "# HELP initrd_messages_total Lxss messages received\n"
+        "# TYPE initrd_messages_total counter\n");
+    for (int i = 0; i < METRICS_MSG_TYPES - 1; i++)
+    {
+        const char *name = msg_name(i);
+        if (strcmp(name, "MSG_UNKNOWN"))
+        {
+            metrics_printf(out, "initrd_messages_total{type=\"%s\"} %llu\n",
+                name, metrics_read(&g_metrics->messages[i]));
+        }
+    }
+    metrics_printf(out, "initrd_messages_total{type=\"MSG_UNKNOWN\"} %llu\n",
+        metrics_read(&g_metrics->messages[METRICS_MSG_TYPES - 1]));
+
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        metrics_printf(out, "# TYPE %s histogram\n", g_histogramNames[i]);
+        metrics_buckets(out, g_histogramNames[i], "",
+            &g_metrics->histograms[i]);
+    }
+
+    metrics_printf(out, "# TYPE initrd_connect_seconds histogram\n");
+    for (size_t i = 0; i < METRICS_SITE_COUNT; i++)
+    {
+        snprintf(label, sizeof label, "site=\"%s\"", g_connectSites[i]);
+        metrics_buckets(out, "initrd_connect_seconds", label,
+            &g_metrics->connects[i]);
+    }
+
+    metrics_counter(out, "initrd_children_reaped_total",
+        "Children reaped by PID 1", METRIC_CHILDREN_REAPED);
+    metrics_counter(out, "initrd_exit_notifications_total",
+        "Exited PIDs written to Lxss service", METRIC_EXITS_NOTIFIED);
+    metrics_counter(out, "initrd_import_bytes_total",
+        "Tar bytes of imported distros", METRIC_IMPORT_BYTES);
+    metrics_seconds(out, "initrd_import_seconds_total",
+        "Time spent importing distros", METRIC_IMPORT_USEC);
+    metrics_counter(out, "initrd_export_bytes_total",
+        "Tar bytes of exported distros", METRIC_EXPORT_BYTES);
+    metrics_seconds(out, "initrd_export_seconds_total",
+        "Time spent exporting distros", METRIC_EXPORT_USEC);
+    metrics_counter(out, "initrd_pool_hits_total",
+        "Host connects served from the pool", METRIC_POOL_HITS);
+    metrics_counter(out, "initrd_pool_misses_total",
+        "Host connects which found the pool empty", METRIC_POOL_MISSES);
+    metrics_gauge(out, "initrd_swap_enabled",
+        "Swap disk of host is in use, -1 if its setup failed", METRIC_SWAP_ENABLED);
+}
+
+static struct metrics_out g_out;
+
+static int metrics_write_all(const int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        const ssize_t ret = TEMP_FAILURE_RETRY(write(fd, buf, len));
+        if (ret < 0)
+            return ret;
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+// Renamed into place so that a reader never sees a partial file
+static int on_metrics_timer(const int fd, const unsigned int events, void *ctx)
+{
+    metrics_render(&g_out);
+
+    const int fileFd = open(METRICS_FILE ".tmp",
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fileFd < 0)
+    {
+        LOG_ERROR("open(%s) %d", METRICS_FILE, errno);
+        return 0;
+    }
+
+    const int ret = metrics_write_all(fileFd, g_out.buf, g_out.len);
+    close(fileFd);
+    if (ret < 0 || rename(METRICS_FILE ".tmp", METRICS_FILE) < 0)
+        LOG_ERROR("write(%s) %d", METRICS_FILE, errno);
+    return 0;
+}
+
+// Each connection gets one snapshot, HTTP is left to a proxy on host
+static int on_metrics_accept(const int fd, const unsigned int events,
+    void *ctx)
+{
+    const int sock = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0)
+    {
+        LOG_ERROR("accept4 %d", errno);
+        return 0;
+    }
+
+    metrics_render(&g_out);
+    if (metrics_write_all(sock, g_out.buf, g_out.len) < 0)
+        LOG_ERROR("write %d", errno);
+    close(sock);
+    return 0;
+}
+
+// Publish metrics to /share, to a host port or both
+int metrics_open(void)
+{
+    int ret = 0;
+    const char *output = config_get("metrics", "off");
+    const bool share = !strcmp(output, "share") || !strcmp(output, "all");
+    const bool vsock = !strcmp(output, "vsock") || !strcmp(output, "all");
+
+    if (share)
+    {
+        const long interval = config_long("metrics.interval", 10);
+        on_metrics_timer(-1, 0, NULL);
+        if (interval > 0 && event_timer(interval * 1000, true,
+            on_metrics_timer, NULL) < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (vsock)
+    {
+        const int sock = listen_hv_socket(config_long("metrics.port",
+            METRICS_PORT));
+        if (sock < 0 || event_add(sock, EPOLLIN, on_metrics_accept, NULL) < 0)
+        {
+            if (sock >= 0)
+                close(sock);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
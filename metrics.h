@@ -0,0 +1,48 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// metrics.h: functions for runtime counters in Prometheus text format
+
+#ifndef INITRD_METRICS_H
+#define INITRD_METRICS_H
+
+#define METRICS_FILE "/share/initrd-metrics.prom"
+
+enum metric_counter
+{
+    METRIC_CHILDREN_REAPED = 0,
+    METRIC_EXITS_NOTIFIED = 1,
+    METRIC_IMPORT_BYTES = 2,
+    METRIC_IMPORT_USEC = 3,
+    METRIC_EXPORT_BYTES = 4,
+    METRIC_EXPORT_USEC = 5,
+    METRIC_POOL_HITS = 6,
+    METRIC_POOL_MISSES = 7,
+    METRIC_COUNTER_COUNT = 8
+};
+
+enum metric_gauge
+{
+    METRIC_SWAP_ENABLED = 0,
+    METRIC_GAUGE_COUNT = 1
+};
+
+enum metric_histogram
+{
+    METRIC_MSG_PROCESS = 0,
+    METRIC_MOUNT_VHD = 1,
+    METRIC_DEVPATH = 2,
+    METRIC_HISTOGRAM_COUNT = 3
+};
+
+int metrics_init(void);
+void metrics_add(const enum metric_counter counter,
+    const unsigned long long value);
+void metrics_message(const int type);
+void metrics_set(const enum metric_gauge gauge, const long long value);
+void metrics_observe(const enum metric_histogram histogram,
+    const long long start);
+void metrics_connect(const char *site, const long long start);
+int metrics_open(void);
+
+#endif // INITRD_METRICS_H
@@ -5,6 +5,7 @@
 
 #include <errno.h>
 #include <sched.h>
+#include <stddef.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,12 +16,21 @@
 #include <unistd.h>
 #include <linux/seccomp.h>
 
+#include "child.h"
+#include "compress.h"
 #include "fs.h"
+#include "mem.h"
+#include "metrics.h"
 #include "msg.h"
 #include "net.h"
 #include "proc.h"
+#include "trace.h"
 #include "util.h"
 
+#define MSG_RING_SIZE (64 * 1024)
+#define MSG_MAX_SIZE (16 * 1024 * 1024)
+#define MSG_ALIGN sizeof (long)
+
 ssize_t msg_cap(const int msgSock)
 {
     ssize_t ret;
@@ -55,134 +65,352 @@ ssize_t msg_cap(const int msgSock)
     return ret;
 }
 
-ssize_t msg_receive(const int msgSock, struct initrd_msg_buffer **buf, size_t *len)
+ssize_t msg_receive(const int msgSock, struct msg_ring *ring)
 {
     ssize_t ret;
-    struct initrd_msg_header header = { 0 };
+    size_t need = MSG_RING_SIZE;
 
-    ret = TEMP_FAILURE_RETRY(recv(msgSock, &header, sizeof header, MSG_WAITALL));
-    if (ret <= 0)
+    // Move the partial message to the front to make room after it
+    if (ring->head)
     {
-        LOG_ERROR("recv %d", errno);
-        return ret;
+        memmove(ring->buf, &ring->buf[ring->head], ring->tail - ring->head);
+        ring->tail -= ring->head;
+        ring->head = 0;
+    }
+
+    if (ring->tail >= sizeof (struct initrd_msg_header))
+    {
+        const struct initrd_msg_header *header = (void *)ring->buf;
+        if (header->len > 0 && header->len <= MSG_MAX_SIZE
+            && (size_t)header->len > need)
+        {
+            need = header->len;
+        }
+    }
+
+    if (ring->size < need)
+    {
+        char *new_buf = realloc(ring->buf, need);
+        if (!new_buf)
+        {
+            LOG_ERROR("realloc %zu", need);
+            return -1;
+        }
+        ring->buf = new_buf;
+        ring->size = need;
     }
 
-    if (ret != sizeof header)
+    // Take everything which is queued in the socket with one read
+    ret = TEMP_FAILURE_RETRY(recv(msgSock, &ring->buf[ring->tail],
+        ring->size - ring->tail, MSG_DONTWAIT));
+    if (ret < 0 && errno != EAGAIN)
+        LOG_ERROR("recv %d", errno);
+    if (ret > 0)
+        ring->tail += ret;
+
+    return ret;
+}
+
+int msg_next(struct msg_ring *ring, struct initrd_msg_buffer **buf)
+{
+    struct initrd_msg_header header;
+    const size_t avail = ring->tail - ring->head;
+
+    if (avail < sizeof header)
+        return 0;
+
+    memcpy(&header, &ring->buf[ring->head], sizeof header);
+    if (header.len < (int)sizeof header || header.len > MSG_MAX_SIZE)
     {
-        LOG_ERROR("header size incorrect %zd", ret);
+        LOG_ERROR("header.len incorrect %d", header.len);
         return -1;
     }
 
-    LOG_INFO("ret %zd", ret);
+    if (avail < (size_t)header.len)
+        return 0;
+
+    // Messages follow each other unpadded, realign before the fields are read
+    if (ring->head % MSG_ALIGN)
+    {
+        memmove(ring->buf, &ring->buf[ring->head], avail);
+        ring->tail = avail;
+        ring->head = 0;
+    }
+
     LOG_INFO("header.type %d", header.type);
     LOG_INFO("header.len %d", header.len);
 
-    size_t temp_len = header.len;
-    if (!(*buf) | (*len < header.len))
+    *buf = (void *)&ring->buf[ring->head];
+    ring->head += header.len;
+    if (ring->head == ring->tail)
+        ring->head = ring->tail = 0;
+    return 1;
+}
+
+// String field of a message, NULL if it is not inside the message
+const char *msg_string(const struct initrd_msg_buffer *buf,
+    const unsigned int offset)
+{
+    const char *msg = (const char *)buf;
+
+    if (offset < sizeof (struct initrd_msg_header)
+        || offset >= (unsigned int)buf->len
+        || !memchr(&msg[offset], '\0', buf->len - offset))
     {
-        void *new_buf = realloc(*buf, header.len);
-        if (!new_buf)
-            return -1;
-        *buf = new_buf;
-        *len = header.len;
+        LOG_ERROR("string offset incorrect %u", offset);
+        return NULL;
     }
 
-    (*buf)->type = header.type;
-    (*buf)->len = header.len;
-    void **msg = &((*buf)->msg);
+    return &msg[offset];
+}
 
-    for (temp_len -= sizeof header; temp_len; temp_len -= ret)
+const char *msg_name(const enum initrd_msg_type type)
+{
+    switch (type)
     {
-        ret = TEMP_FAILURE_RETRY(recv(msgSock, msg, temp_len, 0));
-        if (ret <= 0)
-            return ret;
+        case MSG_START_INIT: return "MSG_START_INIT";
+        case MSG_IMPORT_DISTRO: return "MSG_IMPORT_DISTRO";
+        case MSG_EXPORT_DISTRO: return "MSG_EXPORT_DISTRO";
+        case MSG_EJECT_SCSI: return "MSG_EJECT_SCSI";
+        case MSG_START_PROC: return "MSG_START_PROC";
+        case MSG_MOUNT_DISK: return "MSG_MOUNT_DISK";
+        case MSG_UNMOUNT_DISK: return "MSG_UNMOUNT_DISK";
+        case MSG_SEND_CAPS: return "MSG_SEND_CAPS";
+        default: return "MSG_UNKNOWN";
+    }
+}
+
+// Rest of MSG_START_PROC which is run when network setup is finished
+struct msg_start_proc_state
+{
+    long long start;
+    int entropySize;
+    char entropy[];
+};
 
-        msg = (void **)((char *)msg + ret);
+static void msg_start_proc_done(const int ret, void *ctx)
+{
+    struct msg_start_proc_state *state = ctx;
+
+    if (state->entropySize)
+    {
+        const long long start = trace_now();
+        const int entropyRet = util_entropy(state->entropy, state->entropySize);
+        trace_event("msg", "util_entropy", start, entropyRet);
     }
 
-    return header.len;
+    trace_event("msg", "MSG_START_PROC_done", state->start, ret);
+    free(state);
 }
 
-int msg_process(const int msgSock, struct initrd_msg_buffer *buf, size_t len)
+// Rest of distro messages which is run when the connect for result is done
+struct msg_start_distro_state
 {
-    int ret = -1;
+    long long start;
+    struct initrd_msg_buffer buf[];
+};
 
-    switch (buf->type)
+static void msg_start_distro(const int writeSock, void *ctx)
+{
+    int ret = writeSock;
+    struct msg_start_distro_state *state = ctx;
+    struct initrd_msg_buffer *buf = state->buf;
+    struct initrd_msg_start_init *msg = (void*)buf;
+    const enum initrd_msg_type type = buf->type;
+    const char *scsiPath = msg_string(buf, msg->distro_scsi_path);
+    struct arena arena;
+    char arenaBuf[4096];
+
+    if (writeSock < 0) goto cleanup;
+    arena_init(&arena, arenaBuf, sizeof arenaBuf);
+
+    int parentChan, childChan;
+    child_channel(&parentChan, &childChan);
+    const int group = type == MSG_START_INIT ? mem_group_create() : -1;
+
+    const int tidUserDistro = syscall(SYS_clone,
+        CLONE_NEWPID | CLONE_NEWIPC | CLONE_NEWUTS | CLONE_NEWNS | SIGCHLD, 0, 0, 0, 0);
+    if (tidUserDistro < 0)
     {
-        case MSG_START_INIT:
-        case MSG_IMPORT_DISTRO:
-        case MSG_EXPORT_DISTRO:
+        LOG_ERROR("clone tidUserDistro %d", errno);
+        close(parentChan);
+        close(childChan);
+        close(writeSock);
+        if (group > 0)
+            mem_group_remove(group, 0);
+        ret = tidUserDistro;
+        goto cleanup;
+    }
+
+    if (!tidUserDistro) // child
+    {
+        child_init();
+        close(parentChan);
+        g_mountChan = childChan;
+        if (group > 0 && mem_group_join(group) < 0)
+            LOG_ERROR("join memory cgroup %d", group);
+
+        // Older hosts do not send mount profile
+        const char *options = mount_options(msg->distro_scsi_path
+            >= sizeof *msg ? msg->mount_profile : MOUNT_PROFILE_DEFAULT);
+        LOG_INFO("distro mount options %s", options);
+        ret = mount_vhd(&arena, DEVICE_MODE_SCSI, scsiPath, 0, "/distro",
+                "ext4", 0, options);
+
+        if (buf->type)
         {
-            struct initrd_msg_start_init *msg = (void*)buf;
-            LOG_INFO("distro_scsi_path %s", (char*)msg + msg->distro_scsi_path);
+            if (ret >= 0)
+                child_send_mount("/distro");
 
-            const int writeSock = connect_hv_socket(LXSS_SERVER_PORT, -1, false);
-            if (writeSock < 0) return writeSock;
+            mem_background_join();
 
-            const int tidUserDistro = syscall(SYS_clone,
-                CLONE_NEWPID | CLONE_NEWIPC | CLONE_NEWUTS | CLONE_NEWNS | SIGCHLD, 0, 0, 0, 0);
-            if (tidUserDistro < 0)
+            if (buf->type == MSG_IMPORT_DISTRO)
+                ret = start_import("/distro");
+            if (buf->type == MSG_EXPORT_DISTRO)
             {
-                LOG_ERROR("clone tidUserDistro %d", errno);
-                return tidUserDistro;
+                // Older hosts do not send compression fields
+                int level;
+                enum initrd_compression compression = compress_config(&level);
+                if (msg->distro_scsi_path
+                    >= offsetof(struct initrd_msg_start_init, mount_profile))
+                {
+                    compression = msg->compression;
+                    if (msg->compression_level)
+                        level = msg->compression_level;
+                }
+                ret = start_export("/distro", compression, level);
             }
+            if (TEMP_FAILURE_RETRY(write(writeSock, &ret, sizeof ret)) < 0)
+                LOG_ERROR("write(writeSock) %d", errno);
+            close(writeSock);
+            exit(ret);
+        }
 
-            if (!tidUserDistro) // child
-            {
-                ret = mount_vhd(DEVICE_MODE_SCSI,
-                        (char*)msg + msg->distro_scsi_path, 0, "/distro",
-                        "ext4", 0, "discard,errors=remount-ro,data=ordered");
+        util_mount(NULL, "/wslg", "tmpfs", 0, NULL, 0);
+        mount(NULL, "/wslg", NULL, MS_SHARED, NULL);
+        g_addGui = true;
 
-                if (buf->type)
-                {
-                    char *pidData = NULL;
-                    if (asprintf(&pidData, "%d\n", getpid()) > 0)
-                    {
-                        util_writefile("/sys/fs/cgroup/memory/64M/tasks", pidData);
-                        free(pidData);
-                    }
-
-                    if (buf->type == MSG_IMPORT_DISTRO)
-                        ret = start_import("/distro");
-                    if (buf->type == MSG_EXPORT_DISTRO)
-                        ret = start_export("/distro");
-                    if (TEMP_FAILURE_RETRY(write(writeSock, &ret, sizeof ret)) < 0)
-                        LOG_ERROR("write(writeSock) %d", errno);
-                    close(writeSock);
-                    exit(ret);
-                }
+        // Assume system.vhd is read-only
+        if (ret < 0)
+        {
+            mount_vhd(&arena, DEVICE_MODE_SCSI, scsiPath, 0, "/systemvhd",
+                "ext4", REQUEST_MOUNT_SYSTEM_VHD, NULL);
+
+            start_overlay_init(&arena, writeSock, "/system",
+                NULL, NULL, NULL, NULL);
+        }
+        else
+            start_init(&arena, writeSock, "/distro", NULL, NULL, NULL, NULL);
+    }
+    else // parent
+    {
+        close(childChan);
+        child_track(tidUserDistro, parentChan);
+        if (group > 0)
+            mem_group_add(group, tidUserDistro);
+
+        ret = TEMP_FAILURE_RETRY(write(writeSock, &tidUserDistro, sizeof tidUserDistro));
+        if (ret < 0)
+            LOG_ERROR("write(writeSock) %d", errno);
+    }
 
-                util_mount(NULL, "/wslg", "tmpfs", 0, NULL, 0);
-                mount(NULL, "/wslg", NULL, MS_SHARED, NULL);
-                g_addGui = true;
 
-                // Assume system.vhd is read-only
-                if (ret < 0)
-                {
-                    mount_vhd(DEVICE_MODE_SCSI,
-                        (char*)msg + msg->distro_scsi_path, 0, "/systemvhd",
-                        "ext4", REQUEST_MOUNT_SYSTEM_VHD, NULL);
+    arena_reset(&arena);
 
-                    start_overlay_init(writeSock, "/system", NULL, NULL, NULL, NULL);
-                }
-                else
-                    start_init(writeSock, "/distro", NULL, NULL, NULL, NULL);
-            }
-            else // parent
+cleanup:
+    trace_event("msg", "start_distro_done", state->start, ret);
+    free(state);
+}
+
+// Smallest length of each message type which has fixed fields
+static size_t msg_min_len(const enum initrd_msg_type type)
+{
+    switch (type)
+    {
+        case MSG_START_INIT:
+        case MSG_IMPORT_DISTRO:
+        case MSG_EXPORT_DISTRO:
+            return offsetof(struct initrd_msg_start_init, compression);
+        case MSG_EJECT_SCSI: return sizeof (struct initrd_msg_eject_scsi);
+        case MSG_START_PROC:
+            return offsetof(struct initrd_msg_start_proc, eth0_ipv6_prefix);
+        default: return sizeof (struct initrd_msg_header);
+    }
+}
+
+// Strings follow the fields the host knows of, the first one marks their end
+static unsigned int msg_start_proc_strings(const struct initrd_msg_start_proc *msg)
+{
+    unsigned int first = msg->eth0_ipaddr;
+
+    if (msg->eth0_gateway < first)
+        first = msg->eth0_gateway;
+    if (msg->swap_scsi_path && msg->swap_scsi_path < first)
+        first = msg->swap_scsi_path;
+    if (msg->entropy_size > 0 && msg->entropy_buf < first)
+        first = msg->entropy_buf;
+
+    return first;
+}
+
+int msg_process(const int msgSock, struct initrd_msg_buffer *buf)
+{
+    int ret = -1;
+    const long long start = trace_now();
+    const enum initrd_msg_type type = buf->type;
+
+    metrics_message(type);
+    if ((size_t)buf->len < msg_min_len(type))
+    {
+        LOG_ERROR("%s too short %d", msg_name(type), buf->len);
+        trace_event("msg", msg_name(type), start, ret);
+        metrics_observe(METRIC_MSG_PROCESS, start);
+        return ret;
+    }
+
+    switch (buf->type)
+    {
+        case MSG_START_INIT:
+        case MSG_IMPORT_DISTRO:
+        case MSG_EXPORT_DISTRO:
+        {
+            struct initrd_msg_start_init *msg = (void*)buf;
+            const char *scsiPath = msg_string(buf, msg->distro_scsi_path);
+            if (!scsiPath) break;
+            LOG_INFO("distro_scsi_path %s", scsiPath);
+
+            // Distros need /tools from host which may be still mounting and
+            // are cloned only after the mount workers have left
+            ret = mount_finish();
+            if (ret < 0) break;
+
+            // Launch continues when the connect for its result is done
+            struct msg_start_distro_state *state = malloc(sizeof *state
+                + buf->len);
+            if (!state)
             {
-                ret = TEMP_FAILURE_RETRY(write(writeSock, &tidUserDistro, sizeof tidUserDistro));
-                if (ret < 0)
-                    LOG_ERROR("write(writeSock) %d", errno);
+                LOG_ERROR("malloc %d", buf->len);
+                ret = -1;
+                break;
             }
 
+            state->start = start;
+            memcpy(state->buf, buf, buf->len);
+            ret = connect_hv_async("launch", LXSS_SERVER_PORT, false,
+                msg_start_distro, state);
+            if (ret < 0)
+                free(state);
+
             break;
         }
         case MSG_EJECT_SCSI:
         {
             struct initrd_msg_eject_scsi *msg = (void*)buf;
-            LOG_INFO("distro_scsi_path %s", (char*)msg + msg->distro_scsi_path);
+            const char *scsiPath = msg_string(buf, msg->distro_scsi_path);
+            if (scsiPath)
+                LOG_INFO("distro_scsi_path %s", scsiPath);
 
-            const int ejectRet = util_devdelete((char*)msg + msg->distro_scsi_path);
+            const int ejectRet = scsiPath ? util_devdelete(scsiPath) : -1;
 
             ret = TEMP_FAILURE_RETRY(write(msgSock, &ejectRet, sizeof ejectRet));
             if (ret < 0)
@@ -193,26 +421,78 @@ int msg_process(const int msgSock, struct initrd_msg_buffer *buf, size_t len)
         case MSG_START_PROC:
         {
             struct initrd_msg_start_proc *msg = (void*)buf;
+            const char *ipaddr = msg_string(buf, msg->eth0_ipaddr);
+            const char *gateway = msg_string(buf, msg->eth0_gateway);
+
+            struct nic_config config = { ipaddr, gateway, msg->eth0_prefix };
+            if (msg_start_proc_strings(msg) >= sizeof *msg)
+            {
+                config.ipv6prefix = msg->eth0_ipv6_prefix;
+                config.mtu = msg->eth0_mtu;
+                if (msg->eth0_ipv6addr)
+                    config.ipv6addr = msg_string(buf, msg->eth0_ipv6addr);
+                if (msg->eth0_ipv6gateway)
+                    config.ipv6gateway = msg_string(buf, msg->eth0_ipv6gateway);
+            }
+            const char *swapPath = msg->swap_scsi_path
+                ? msg_string(buf, msg->swap_scsi_path) : NULL;
 
             LOG_INFO("swap_size %ld", msg->swap_size);
             LOG_INFO("entropy_size %d", msg->entropy_size);
             LOG_INFO("compact_timeout %d", msg->compact_timeout);
-            LOG_INFO("eth0_ipaddr %s", (char*)msg + msg->eth0_ipaddr);
-            LOG_INFO("eth0_gateway %s", (char*)msg + msg->eth0_gateway);
-            LOG_INFO("swap_scsi_path %s", (char*)msg + msg->swap_scsi_path);
+            LOG_INFO("eth0_ipaddr %s", ipaddr ? ipaddr : "");
+            LOG_INFO("eth0_gateway %s", gateway ? gateway : "");
+            LOG_INFO("swap_scsi_path %s", swapPath ? swapPath : "");
             LOG_INFO("eth0_prefix %d", msg->eth0_prefix);
+            LOG_INFO("eth0_ipv6addr %s", config.ipv6addr ? config.ipv6addr : "");
+            LOG_INFO("eth0_mtu %u", config.mtu);
             LOG_INFO("enable_telemetry %d", msg->enable_telemetry);
             LOG_INFO("enable_localhost %d", msg->enable_localhost);
 
-            nic_addip((char*)msg + msg->eth0_ipaddr,
-                (char*)msg + msg->eth0_gateway, msg->eth0_prefix);
+            // Entropy is added after network is up, copy it
+            int entropySize = msg->entropy_size > 0 ? msg->entropy_size : 0;
+            if (entropySize && (msg->entropy_buf < msg_min_len(type)
+                || msg->entropy_buf > (unsigned int)buf->len
+                || (unsigned int)entropySize > buf->len - msg->entropy_buf))
+            {
+                LOG_ERROR("entropy_buf incorrect %u", msg->entropy_buf);
+                entropySize = 0;
+            }
+
+            struct msg_start_proc_state *state = malloc(sizeof *state + entropySize);
+            if (state)
+            {
+                state->start = start;
+                state->entropySize = entropySize;
+                if (entropySize)
+                    memcpy(state->entropy, (char*)msg + msg->entropy_buf, entropySize);
+            }
+            else
+                LOG_ERROR("malloc %d", entropySize);
 
+            // A bad address only costs the network, the rest is still set up
+            if (!ipaddr || !gateway)
+            {
+                LOG_ERROR("eth0_ipaddr %u eth0_gateway %u", msg->eth0_ipaddr,
+                    msg->eth0_gateway);
+                ret = -1;
+            }
+            else
+                ret = nic_addip(&config, state ? msg_start_proc_done : NULL, state);
+            if (ret < 0 && state)
+                msg_start_proc_done(ret, state);
+
+            // Host accepts helper connects in message order, before later launches
             if (msg->enable_telemetry)
                 start_telemetry();
             if (msg->enable_localhost)
                 start_localhost();
-            if (msg->entropy_size > 0)
-                util_entropy((char*)msg + msg->entropy_buf, msg->entropy_size);
+
+            mem_compact(msg->compact_timeout);
+
+            // Swap disk is attached by host only if swap is asked for
+            if (msg->swap_size > 0 && swapPath && *swapPath)
+                mem_swap(swapPath, msg->swap_size);
 
             break;
         }
@@ -220,5 +500,7 @@ int msg_process(const int msgSock, struct initrd_msg_buffer *buf, size_t len)
             LOG_INFO("process_msg unimplemented header.type %d.\n", buf->type);
     }
 
+    trace_event("msg", msg_name(type), start, ret);
+    metrics_observe(METRIC_MSG_PROCESS, start);
     return ret;
 }
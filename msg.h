@@ -6,6 +6,8 @@
 #ifndef INITRD_MSG_H
 #define INITRD_MSG_H
 
+#include <sys/types.h>
+
 enum initrd_msg_type
 {
     MSG_START_INIT = 0,
@@ -45,11 +47,24 @@ enum initrd_device_mode
     DEVICE_MODE_PMEM = 2
 };
 
+// ext4 mount options of distro disk
+enum initrd_mount_profile
+{
+    MOUNT_PROFILE_DEFAULT = 0,
+    MOUNT_PROFILE_SAFETY = 1,
+    MOUNT_PROFILE_THROUGHPUT = 2,
+    MOUNT_PROFILE_LOWWRITE = 3
+};
+
 struct initrd_msg_start_init
 {
     enum initrd_msg_type type;
     unsigned int len;
     unsigned int distro_scsi_path;
+    // Optional, present if distro_scsi_path points after them
+    int compression;
+    int compression_level;
+    enum initrd_mount_profile mount_profile;
 };
 
 // type 3
@@ -75,6 +90,11 @@ struct initrd_msg_start_proc
     char eth0_prefix;
     char enable_telemetry;
     char enable_localhost;
+    // Optional, present if every string points after them
+    char eth0_ipv6_prefix;
+    unsigned int eth0_mtu;
+    unsigned int eth0_ipv6addr;
+    unsigned int eth0_ipv6gateway;
 };
 
 // type 9
@@ -86,8 +106,21 @@ struct initrd_msg_send_caps
     char release[];
 };
 
+// Received bytes of a message socket, messages are decoded in place
+struct msg_ring
+{
+    char *buf;
+    size_t size;
+    size_t head;
+    size_t tail;
+};
+
 ssize_t msg_cap(const int msgSock);
-ssize_t msg_receive(const int msgSock, struct initrd_msg_buffer **buf, size_t *len);
-int msg_process(const int sock, struct initrd_msg_buffer *buf, size_t len);
+const char *msg_name(const enum initrd_msg_type type);
+ssize_t msg_receive(const int msgSock, struct msg_ring *ring);
+int msg_next(struct msg_ring *ring, struct initrd_msg_buffer **buf);
+const char *msg_string(const struct initrd_msg_buffer *buf,
+    const unsigned int offset);
+int msg_process(const int sock, struct initrd_msg_buffer *buf);
 
 #endif // INITRD_MSG_H
@@ -7,57 +7,365 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <net/if.h>
-#include <net/route.h>
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <linux/vm_sockets.h>
 #include <unistd.h>
 
+#include "config.h"
+#include "event.h"
 #include "fs.h"
+#include "metrics.h"
+#include "net.h"
+#include "rtnl.h"
+#include "trace.h"
 #include "util.h"
 
-#define VSOCK_BUFFER_SIZE 0x10000
+#define PLAN9_MSIZE_DEFAULT 0x2000
+#define PLAN9_MSIZE_MIN 0x2000
+#define PLAN9_MSIZE_MAX 0x100000
+#define PLAN9_BENCH_DIR "/bench9p"
+#define PLAN9_BENCH_OPENS 100
+#define POOL_MAX_SIZE 16
+#define POOL_RETRY_MSEC 1000
+#define NIC_WAIT_MSEC 5000
 
-int connect_hv_socket(const unsigned int port, const int newfd,
-    const bool cloexec)
+enum transport_type
+{
+    TRANSPORT_VSOCK = 0,
+    TRANSPORT_UNIX = 1
+};
+
+// Host connections which are already established for Lxss service port
+struct socket_pool
+{
+    int size;
+    int count;
+    int pending;
+    int socks[POOL_MAX_SIZE];
+    // Non-blocking connects still in flight
+    int pendingSocks[POOL_MAX_SIZE];
+    unsigned long hits;
+    unsigned long misses;
+};
+
+// Settings of 9p mounts from host, initrd.9p.* boot parameters
+struct plan_nine_options
+{
+    unsigned int msize;
+    int sockbuf;
+    const char *cache;
+};
+
+enum nic_stage
+{
+    NIC_STAGE_LINK = 0,
+    NIC_STAGE_CONFIGURE = 1
+};
+
+// Network setup of MSG_START_PROC which is run by the event loop
+struct nic_setup
+{
+    int sock;
+    int timerFd;
+    int ifindex;
+    enum nic_stage stage;
+    long long start;
+    long long stageStart;
+    struct in_addr ipaddr;
+    struct in_addr gateway;
+    struct in6_addr ipv6addr;
+    struct in6_addr ipv6gateway;
+    bool ipv6;
+    bool ipv6Route;
+    unsigned char prefix;
+    unsigned char ipv6prefix;
+    unsigned int mtu;
+    nic_callback done;
+    void *ctx;
+};
+
+static enum transport_type g_transport = TRANSPORT_VSOCK;
+static const char *g_unixDir = NULL;
+
+// Connect started by connect_hv_async() which is waiting for EPOLLOUT
+struct connect_job
+{
+    struct connect_job *next;
+    const char *site;
+    unsigned int port;
+    bool cloexec;
+    long long start;
+    connect_callback done;
+    void *ctx;
+};
+
+static struct socket_pool g_pool = { 0 };
+
+// Host pairs server port connects with requests by accept order, one is in flight
+static bool g_connectBusy = false;
+static struct connect_job *g_connectQueue = NULL;
+
+// initrd.transport=vsock (default) or unix:DIR to connect DIR/<port>
+static void transport_init(void)
+{
+    static bool loaded = false;
+    if (loaded)
+        return;
+
+    loaded = true;
+    const char *transport = config_get("transport", "vsock");
+    if (!strncmp(transport, "unix:", 5))
+    {
+        g_transport = TRANSPORT_UNIX;
+        g_unixDir = transport + 5;
+    }
+    else if (strcmp(transport, "vsock"))
+        LOG_ERROR("unknown transport %s", transport);
+}
+
+static int transport_socket(const int flags)
 {
     int ret;
-    int flag;
 
-    flag = SOCK_STREAM | (cloexec ? SOCK_CLOEXEC : 0);
-    const int sock = socket(AF_VSOCK, flag, 0);
+    transport_init();
+    const int sock = socket(g_transport == TRANSPORT_UNIX ? AF_UNIX : AF_VSOCK,
+        SOCK_STREAM | flags, 0);
     if (sock < 0)
     {
         LOG_ERROR("socket %d", errno);
         return sock;
     }
 
-    struct timeval timeout = { .tv_sec = 30, .tv_usec = 0 };
-    ret = setsockopt(sock, AF_VSOCK, SO_VM_SOCKETS_CONNECT_TIMEOUT,
-        &timeout, sizeof timeout);
-    if (ret < 0)
+    if (g_transport == TRANSPORT_VSOCK)
     {
-        LOG_ERROR("setsockopt %d", errno);
-        goto cleanup;
+        struct timeval timeout = { .tv_sec = 30, .tv_usec = 0 };
+        ret = setsockopt(sock, AF_VSOCK, SO_VM_SOCKETS_CONNECT_TIMEOUT,
+            &timeout, sizeof timeout);
+        if (ret < 0)
+        {
+            LOG_ERROR("setsockopt %d", errno);
+            close(sock);
+            return ret;
+        }
+    }
+
+    return sock;
+}
+
+static int transport_connect(const int sock, const unsigned int port)
+{
+    if (g_transport == TRANSPORT_UNIX)
+    {
+        struct sockaddr_un addr = { 0 };
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof addr.sun_path, "%s/%u", g_unixDir, port);
+        return connect(sock, (struct sockaddr *)&addr, sizeof addr);
     }
 
     struct sockaddr_vm addr = { 0 };
     addr.svm_family = AF_VSOCK;
     addr.svm_cid = VMADDR_CID_HOST;
     addr.svm_port = port;
-    ret = connect(sock, (struct sockaddr *)&addr, sizeof addr);
-    if (ret < 0)
+    return connect(sock, (struct sockaddr *)&addr, sizeof addr);
+}
+
+// Host connects to this port of the VM, or to DIR/<port> with unix transport
+int listen_hv_socket(const unsigned int port)
+{
+    int ret;
+
+    const int sock = transport_socket(SOCK_CLOEXEC);
+    if (sock < 0)
+        return sock;
+
+    if (g_transport == TRANSPORT_UNIX)
     {
-        LOG_ERROR("connect %d", errno);
-        goto cleanup;
+        struct sockaddr_un addr = { 0 };
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof addr.sun_path, "%s/%u", g_unixDir, port);
+        unlink(addr.sun_path);
+        ret = bind(sock, (struct sockaddr *)&addr, sizeof addr);
+    }
+    else
+    {
+        struct sockaddr_vm addr = { 0 };
+        addr.svm_family = AF_VSOCK;
+        addr.svm_cid = VMADDR_CID_ANY;
+        addr.svm_port = port;
+        ret = bind(sock, (struct sockaddr *)&addr, sizeof addr);
+    }
+
+    if (ret < 0 || listen(sock, 4) < 0)
+    {
+        LOG_ERROR("listen(%u) %d", port, errno);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int on_pool_retry(const int fd, const unsigned int events, void *ctx)
+{
+    event_del(fd);
+    close(fd);
+    pool_refill();
+    return 0;
+}
+
+static int on_pool_connect(const int fd, const unsigned int events, void *ctx)
+{
+    int error = 0;
+    socklen_t len = sizeof error;
+
+    event_del(fd);
+    for (int i = 0; i < g_pool.pending; i++)
+    {
+        if (g_pool.pendingSocks[i] == fd)
+        {
+            g_pool.pendingSocks[i] = g_pool.pendingSocks[--g_pool.pending];
+            break;
+        }
+    }
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+
+    if (error || g_pool.count == g_pool.size)
+    {
+        if (error)
+            LOG_ERROR("connect %d", error);
+        close(fd);
+
+        // Do not spin when host does not accept connections
+        if (error && event_timer(POOL_RETRY_MSEC, false, on_pool_retry, NULL) >= 0)
+            return 0;
     }
+    else
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        g_pool.socks[g_pool.count++] = fd;
+    }
+
+    if (!error)
+        pool_refill();
+    return 0;
+}
+
+void pool_init(void)
+{
+    g_pool.size = config_long("pool", 0);
+    if (g_pool.size > POOL_MAX_SIZE)
+        g_pool.size = POOL_MAX_SIZE;
+
+    pool_refill();
+}
 
+// Start non-blocking connects in event loop until pool is full
+void pool_refill(void)
+{
+    int ret;
+
+    while (g_pool.count + g_pool.pending < g_pool.size)
+    {
+        const int sock = transport_socket(SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0)
+            return;
+
+        ret = transport_connect(sock, LXSS_SERVER_PORT);
+        if (ret < 0 && errno != EINPROGRESS)
+        {
+            LOG_ERROR("connect %d", errno);
+            close(sock);
+            return;
+        }
+
+        ret = event_add(sock, EPOLLOUT, on_pool_connect, NULL);
+        if (ret < 0)
+        {
+            close(sock);
+            return;
+        }
+        g_pool.pendingSocks[g_pool.pending++] = sock;
+    }
+}
+
+// Connections in pool belong to PID 1 only, children make their own
+void pool_child(void)
+{
+    for (int i = 0; i < g_pool.count; i++)
+        close(g_pool.socks[i]);
+    for (int i = 0; i < g_pool.pending; i++)
+        close(g_pool.pendingSocks[i]);
+
+    memset(&g_pool, 0, sizeof g_pool);
+}
+
+static int pool_take(const bool cloexec)
+{
+    if (!g_pool.size)
+        return -1;
+
+    if (!g_pool.count)
+    {
+        g_pool.misses++;
+        metrics_add(METRIC_POOL_MISSES, 1);
+        LOG_INFO("pool miss hits %lu misses %lu", g_pool.hits, g_pool.misses);
+        return -1;
+    }
+
+    // Oldest first as Lxss service accepts connections in order
+    const int sock = g_pool.socks[0];
+    g_pool.count--;
+    memmove(&g_pool.socks[0], &g_pool.socks[1], g_pool.count * sizeof sock);
+    g_pool.hits++;
+    metrics_add(METRIC_POOL_HITS, 1);
+    LOG_INFO("pool hit hits %lu misses %lu", g_pool.hits, g_pool.misses);
+
+    if (!cloexec)
+        fcntl(sock, F_SETFD, 0);
+
+    pool_refill();
+    return sock;
+}
+
+// Connect latency of each call site goes to trace as vsock events
+int connect_hv_socket(const char *site, const unsigned int port,
+    const int newfd, const bool cloexec)
+{
+    int ret;
+    int flag;
+    int sock = -1;
+    const long long start = trace_now();
+
+    if (port == LXSS_SERVER_PORT)
+        sock = pool_take(cloexec);
+
+    if (sock < 0)
+    {
+        sock = transport_socket(cloexec ? SOCK_CLOEXEC : 0);
+        if (sock < 0)
+            return sock;
+
+        ret = transport_connect(sock, port);
+        if (ret < 0)
+        {
+            LOG_ERROR("connect %d", errno);
+            goto cleanup;
+        }
+    }
+
+    trace_event("vsock", site, start, sock);
+    metrics_connect(site, start);
     if (newfd < 0 || sock == newfd)
         return sock;
 
@@ -71,15 +379,150 @@ cleanup:
     return ret;
 }
 
-int mount_plan_nine(const char *source, const char *target)
+static int connect_start(struct connect_job *job);
+
+static void connect_finish(struct connect_job *job, const int sock)
+{
+    trace_event("vsock", job->site, job->start, sock);
+    metrics_connect(job->site, job->start);
+    if (job->port == LXSS_SERVER_PORT)
+        g_connectBusy = false;
+    job->done(sock, job->ctx);
+    free(job);
+
+    while (!g_connectBusy && g_connectQueue)
+    {
+        struct connect_job *next = g_connectQueue;
+        g_connectQueue = next->next;
+        if (connect_start(next) < 0)
+            connect_finish(next, -1);
+    }
+}
+
+static int on_connect(const int fd, const unsigned int events, void *ctx)
+{
+    int error = 0;
+    socklen_t len = sizeof error;
+
+    event_del(fd);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+
+    if (error)
+    {
+        LOG_ERROR("connect %d", error);
+        close(fd);
+        connect_finish(ctx, -1);
+        return 0;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    connect_finish(ctx, fd);
+    return 0;
+}
+
+static int connect_start(struct connect_job *job)
 {
     int ret;
-    char *mountData = NULL;
+    int sock = -1;
+
+    if (job->port == LXSS_SERVER_PORT)
+    {
+        g_connectBusy = true;
+        sock = pool_take(job->cloexec);
+    }
+
+    if (sock >= 0)
+    {
+        connect_finish(job, sock);
+        return 0;
+    }
+
+    sock = transport_socket(SOCK_NONBLOCK | (job->cloexec ? SOCK_CLOEXEC : 0));
+    if (sock < 0)
+        goto cleanup;
+
+    ret = transport_connect(sock, job->port);
+
+    // Unix socket with full backlog does not queue the connect
+    if (ret < 0 && errno == EAGAIN)
+    {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+        ret = transport_connect(sock, job->port);
+    }
 
-    const int sock = connect_hv_socket(LXSS_CLIENT_PORT, -1, true);
+    if (!ret)
+    {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+        connect_finish(job, sock);
+        return 0;
+    }
+
+    if (errno != EINPROGRESS)
+    {
+        LOG_ERROR("connect %d", errno);
+        goto cleanup;
+    }
+
+    ret = event_add(sock, EPOLLOUT, on_connect, job);
+    if (ret >= 0)
+        return 0;
+
+cleanup:
+    if (sock >= 0)
+        close(sock);
+    if (job->port == LXSS_SERVER_PORT)
+        g_connectBusy = false;
+    return -1;
+}
+
+// Connect in event loop, done gets the blocking socket or -1 unless this fails
+int connect_hv_async(const char *site, const unsigned int port,
+    const bool cloexec, const connect_callback done, void *ctx)
+{
+    struct connect_job *job = calloc(1, sizeof *job);
+    if (!job)
+    {
+        LOG_ERROR("calloc %s", site);
+        return -1;
+    }
+
+    job->site = site;
+    job->port = port;
+    job->cloexec = cloexec;
+    job->start = trace_now();
+    job->done = done;
+    job->ctx = ctx;
+
+    // Later connects wait so that they reach the host in the order asked
+    if (port == LXSS_SERVER_PORT && g_connectBusy)
+    {
+        struct connect_job **tail = &g_connectQueue;
+        while (*tail)
+            tail = &(*tail)->next;
+        *tail = job;
+        return 0;
+    }
+
+    if (connect_start(job) < 0)
+    {
+        free(job);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int plan_nine_mount(const char *source, const char *target,
+    const struct plan_nine_options *options)
+{
+    int ret;
+    char mountData[160];
+
+    const int sock = connect_hv_socket("tools", LXSS_CLIENT_PORT, -1, true);
     if (sock < 0) return sock;
 
-    const int size = VSOCK_BUFFER_SIZE;
+    const int size = options->sockbuf;
     ret = setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
     if (ret < 0)
     {
@@ -94,114 +537,321 @@ int mount_plan_nine(const char *source, const char *target)
         goto cleanup;
     }
 
-    ret = asprintf(&mountData,
-        "msize=%d,trans=fd,rfdno=%d,wfdno=%d,cache=loose,aname=%s;fmask=022",
-        VSOCK_BUFFER_SIZE, sock, sock, source);
-    if (ret < 0)
-    {
-        LOG_ERROR("asprintf(%s)", source);
-        goto cleanup;
-    }
+    snprintf(mountData, sizeof mountData,
+        "msize=%u,trans=fd,rfdno=%d,wfdno=%d,cache=%s,aname=%s;fmask=022",
+        options->msize, sock, sock, options->cache, source);
 
     ret = util_mount(source, target, "9p", MS_RDONLY, mountData, 0);
 
 cleanup:
-    if (mountData)
-        free(mountData);
     close(sock);
     return ret;
 }
 
-int nic_enable(const int sock, const char *nic)
+// msize which the kernel agreed with the host, shown in mount options
+static unsigned int plan_nine_msize(const char *target)
 {
-    int ret;
-    struct ifreq ifr;
+    char line[512], mountPoint[256];
+    unsigned int msize = PLAN9_MSIZE_DEFAULT;
 
-    memset(&ifr, 0, sizeof ifr);
-    strncpy(ifr.ifr_name, nic, IFNAMSIZ);
-    ret = ioctl(sock, SIOCGIFFLAGS, &ifr);
-    if (ret < 0)
+    FILE *file = fopen("/proc/self/mounts", "re");
+    if (!file)
+        return 0;
+
+    while (fgets(line, sizeof line, file))
     {
-        LOG_ERROR("ioctl(SIOCGIFFLAGS) %d", errno);
-        return ret;
+        const char *opt = strstr(line, "msize=");
+        if (sscanf(line, "%*s %255s", mountPoint) == 1
+            && !strcmp(mountPoint, target) && opt)
+        {
+            msize = strtoul(opt + 6, NULL, 10);
+        }
     }
 
-    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
-    ret = ioctl(sock, SIOCSIFFLAGS, &ifr);
-    if (ret < 0)
-        LOG_ERROR("ioctl(SIOCSIFFLAGS) %d", errno);
+    fclose(file);
+    return msize;
+}
 
-    return ret;
+// initrd.9p.msize=0 (default) asks the largest msize and host lowers it
+static void plan_nine_options(struct plan_nine_options *options)
+{
+    options->msize = config_long("9p.msize", 0);
+    if (!options->msize || options->msize > PLAN9_MSIZE_MAX)
+        options->msize = PLAN9_MSIZE_MAX;
+    options->sockbuf = config_long("9p.sockbuf", 0);
+    if (options->sockbuf <= 0)
+        options->sockbuf = options->msize;
+    options->cache = config_get("9p.cache", "loose");
 }
 
-int nic_addip(const char *ipaddr, const char *gateway, const char prefix)
+int mount_plan_nine(const char *source, const char *target)
 {
     int ret;
-    struct ifreq ifr;
-    struct rtentry route;
-    struct sockaddr_in *addr;
-    struct timespec start, end;
+    struct plan_nine_options options;
+    const long long start = trace_now();
 
-    const int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0)
+    plan_nine_options(&options);
+
+    // Older hosts may refuse an msize larger than theirs instead of lowering it
+    while (true)
     {
-        LOG_ERROR("socket %d", errno);
-        return sock;
+        ret = plan_nine_mount(source, target, &options);
+        if (ret >= 0 || options.msize / 2 < PLAN9_MSIZE_MIN)
+            break;
+
+        options.msize /= 2;
+        if (options.sockbuf > (int)options.msize)
+            options.sockbuf = options.msize;
+        LOG_INFO("9p retry msize %u", options.msize);
     }
 
-    ret = nic_enable(sock, "lo");
-    if (ret < 0)
-        goto cleanup;
+    if (ret >= 0)
+    {
+        LOG_INFO("9p %s msize %u sockbuf %d cache %s", target,
+            plan_nine_msize(target), options.sockbuf, options.cache);
+    }
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    memset(&ifr, 0, sizeof ifr);
-    strncpy(ifr.ifr_name, "eth0", IFNAMSIZ);
-    addr = (struct sockaddr_in *)&ifr.ifr_addr;
-    addr->sin_family = AF_INET;
-    addr->sin_addr.s_addr = inet_addr(ipaddr);
+    trace_event("net", "mount_plan_nine", start, ret);
+    return ret;
+}
 
-    while(true)
+// Time opens and a sequential read of a file with each 9p setting
+void plan_nine_bench(const char *source)
+{
+    static const unsigned int msizes[] = { 0x2000, 0x10000, 0x40000, 0x100000 };
+    static const char *caches[] = { "none", "loose", "mmap" };
+    const char *file = config_get("9p.benchfile", "init");
+    char path[256];
+
+    const int bufSize = PLAN9_MSIZE_MAX;
+    char *buf = malloc(bufSize);
+    if (!buf)
     {
-        ret = ioctl(sock, SIOCSIFADDR, &ifr);
-        if (!ret)
-            break;
+        LOG_ERROR("malloc %d", bufSize);
+        return;
+    }
+
+    if (util_mkdir(PLAN9_BENCH_DIR, 0755) < 0)
+    {
+        free(buf);
+        return;
+    }
 
-        clock_gettime(CLOCK_MONOTONIC, &end);
-        if ((ret < 0) && end.tv_nsec - start.tv_nsec
-            + 1000000000 * (end.tv_sec - start.tv_sec) > 5000000000)
+    snprintf(path, sizeof path, "%s/%s", PLAN9_BENCH_DIR, file);
+    for (size_t i = 0; i < sizeof msizes / sizeof *msizes; i++)
+    {
+        for (size_t j = 0; j < sizeof caches / sizeof *caches; j++)
         {
-            LOG_ERROR("ioctl(SIOCSIFADDR) %d", errno);
-            goto cleanup;
+            struct plan_nine_options options = { msizes[i], msizes[i], caches[j] };
+            if (plan_nine_mount(source, PLAN9_BENCH_DIR, &options) < 0)
+                continue;
+
+            long long start = trace_now();
+            for (int k = 0; k < PLAN9_BENCH_OPENS; k++)
+            {
+                const int fd = open(path, O_RDONLY | O_CLOEXEC);
+                if (fd >= 0)
+                    close(fd);
+            }
+            const long long openUsec = (trace_now() - start) / PLAN9_BENCH_OPENS;
+
+            long long bytes = 0;
+            start = trace_now();
+            const int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0)
+            {
+                ssize_t ret;
+                while ((ret = TEMP_FAILURE_RETRY(read(fd, buf, bufSize))) > 0)
+                    bytes += ret;
+                close(fd);
+            }
+            const long long readUsec = trace_now() - start;
+
+            const long rate = readUsec ? bytes / readUsec : 0;
+            LOG_INFO("9p bench msize %u cache %s: open %lld usec read %lld bytes"
+                " %ld MB/s", plan_nine_msize(PLAN9_BENCH_DIR), caches[j], openUsec,
+                bytes, rate);
+            trace_event("9p", "plan_nine_bench", start, rate);
+
+            if (umount(PLAN9_BENCH_DIR) < 0)
+                LOG_ERROR("umount(%s) %d", PLAN9_BENCH_DIR, errno);
         }
-        usleep(10000);
     }
 
-    addr = (struct sockaddr_in *)&ifr.ifr_netmask;
-    addr->sin_family = AF_INET;
-    addr->sin_addr.s_addr = htonl(-1 << (32 - prefix));
-    ret = ioctl(sock, SIOCSIFNETMASK, &ifr);
-    if (ret < 0)
+    rmdir(PLAN9_BENCH_DIR);
+    free(buf);
+}
+
+static const char *nic_stage_name(const enum nic_stage stage)
+{
+    switch (stage)
     {
-        LOG_ERROR("ioctl(SIOCSIFNETMASK) %d", errno);
-        goto cleanup;
+        case NIC_STAGE_LINK: return "nic_link";
+        case NIC_STAGE_CONFIGURE: return "nic_configure";
+        default: return "nic_done";
     }
+}
 
-    ret = nic_enable(sock, "eth0");
-    if (ret < 0)
-        goto cleanup;
+// Loopback and eth0 are set up with one batch of requests
+static int nic_configure(struct nic_setup *setup)
+{
+    struct rtnl_batch batch;
+    rtnl_batch_init(&batch);
 
-    memset(&route, 0, sizeof route);
-    route.rt_dst.sa_family = AF_INET;
-    route.rt_gateway.sa_family = AF_INET;
-    route.rt_genmask.sa_family = AF_INET;
-    route.rt_flags = RTF_UP | RTF_GATEWAY;
-    addr = (struct sockaddr_in *)&route.rt_gateway;
-    addr->sin_addr.s_addr = inet_addr(gateway);
-    ret = ioctl(sock, SIOCADDRT, &route);
-    if (ret < 0)
-        LOG_ERROR("ioctl(SIOCADDRT) %d", errno);
+    const int loIndex = if_nametoindex("lo");
+    if (loIndex && rtnl_set_link(&batch, loIndex, 0) < 0)
+        return -1;
 
-cleanup:
-    close(sock);
+    if (rtnl_add_address(&batch, setup->ifindex, AF_INET, &setup->ipaddr,
+        setup->prefix) < 0 || rtnl_set_link(&batch, setup->ifindex, setup->mtu) < 0
+        || rtnl_add_route(&batch, setup->ifindex, AF_INET, &setup->gateway) < 0)
+    {
+        return -1;
+    }
+
+    if (setup->ipv6 && rtnl_add_address(&batch, setup->ifindex, AF_INET6,
+        &setup->ipv6addr, setup->ipv6prefix) < 0)
+    {
+        return -1;
+    }
+
+    if (setup->ipv6Route && rtnl_add_route(&batch, setup->ifindex, AF_INET6,
+        &setup->ipv6gateway) < 0)
+    {
+        return -1;
+    }
+
+    // Requests use their own socket, link events would fill the receive buffer
+    const int fd = rtnl_open(false);
+    if (fd < 0)
+        return fd;
+
+    const int ret = rtnl_commit(fd, &batch);
+    close(fd);
     return ret;
 }
+
+static void nic_finish(struct nic_setup *setup, const int ret)
+{
+    if (setup->timerFd >= 0)
+    {
+        event_del(setup->timerFd);
+        close(setup->timerFd);
+    }
+
+    trace_event("net", nic_stage_name(setup->stage), setup->stageStart, ret);
+    close(setup->sock);
+    trace_event("net", "nic_addip", setup->start, ret);
+    if (setup->done)
+        setup->done(ret, setup->ctx);
+    free(setup);
+}
+
+static void nic_linked(struct nic_setup *setup, const int ifindex)
+{
+    event_del(setup->sock);
+    if (setup->timerFd >= 0)
+    {
+        event_del(setup->timerFd);
+        close(setup->timerFd);
+        setup->timerFd = -1;
+    }
+
+    setup->ifindex = ifindex;
+    trace_event("net", nic_stage_name(setup->stage), setup->stageStart, ifindex);
+    setup->stage = NIC_STAGE_CONFIGURE;
+    setup->stageStart = trace_now();
+
+    nic_finish(setup, nic_configure(setup));
+}
+
+static int on_nic_link(const int fd, const unsigned int events, void *ctx)
+{
+    struct nic_setup *setup = ctx;
+
+    const int ifindex = rtnl_link_wait(fd, "eth0");
+    if (ifindex > 0)
+        nic_linked(setup, ifindex);
+    else if (ifindex < 0)
+    {
+        event_del(fd);
+        nic_finish(setup, ifindex);
+    }
+
+    return 0;
+}
+
+static int on_nic_timeout(const int fd, const unsigned int events, void *ctx)
+{
+    struct nic_setup *setup = ctx;
+
+    LOG_ERROR("eth0 not found in %d ms", NIC_WAIT_MSEC);
+    event_del(setup->sock);
+    nic_finish(setup, -1);
+    return 0;
+}
+
+int nic_addip(const struct nic_config *config, const nic_callback done,
+    void *ctx)
+{
+    int ret;
+
+    struct nic_setup *setup = calloc(1, sizeof *setup);
+    if (!setup)
+    {
+        LOG_ERROR("calloc %zu", sizeof *setup);
+        return -1;
+    }
+
+    // Message buffer is reused after this returns, keep parsed values only
+    if (inet_pton(AF_INET, config->ipaddr, &setup->ipaddr) != 1
+        || inet_pton(AF_INET, config->gateway, &setup->gateway) != 1)
+    {
+        LOG_ERROR("inet_pton(%s, %s)", config->ipaddr, config->gateway);
+        free(setup);
+        return -1;
+    }
+
+    if (config->ipv6addr && *config->ipv6addr)
+        setup->ipv6 = inet_pton(AF_INET6, config->ipv6addr, &setup->ipv6addr) == 1;
+    if (config->ipv6gateway && *config->ipv6gateway)
+    {
+        setup->ipv6Route = inet_pton(AF_INET6, config->ipv6gateway,
+            &setup->ipv6gateway) == 1;
+    }
+
+    setup->prefix = config->prefix;
+    setup->ipv6prefix = config->ipv6prefix ? config->ipv6prefix : 64;
+    setup->mtu = config->mtu;
+    setup->timerFd = -1;
+    setup->done = done;
+    setup->ctx = ctx;
+    setup->stage = NIC_STAGE_LINK;
+    setup->start = setup->stageStart = trace_now();
+
+    // Subscribe before looking so that eth0 is not missed in between
+    setup->sock = rtnl_open(true);
+    if (setup->sock < 0)
+    {
+        free(setup);
+        return -1;
+    }
+
+    const int ifindex = if_nametoindex("eth0");
+    if (ifindex > 0)
+    {
+        nic_linked(setup, ifindex);
+        return 0;
+    }
+
+    ret = event_add(setup->sock, EPOLLIN, on_nic_link, setup);
+    if (ret < 0)
+    {
+        close(setup->sock);
+        free(setup);
+        return ret;
+    }
+
+    setup->timerFd = event_timer(NIC_WAIT_MSEC, false, on_nic_timeout, setup);
+    return 0;
+}
@@ -8,10 +8,35 @@
 
 #include <stdbool.h>
 
-int connect_hv_socket(const unsigned int port, const int newfd,
-    const bool cloexec);
+// Addresses of eth0 sent by host, IPv6 and MTU are optional
+struct nic_config
+{
+    const char *ipaddr;
+    const char *gateway;
+    char prefix;
+    const char *ipv6addr;
+    const char *ipv6gateway;
+    char ipv6prefix;
+    unsigned int mtu;
+};
+
+// Called when network setup is finished, ret is negative on failure
+typedef void (*nic_callback)(const int ret, void *ctx);
+
+// Called with connected socket or -1 when connect fails
+typedef void (*connect_callback)(const int sock, void *ctx);
+
+int connect_hv_socket(const char *site, const unsigned int port,
+    const int newfd, const bool cloexec);
+int connect_hv_async(const char *site, const unsigned int port,
+    const bool cloexec, const connect_callback done, void *ctx);
+int listen_hv_socket(const unsigned int port);
 int mount_plan_nine(const char *source, const char *target);
-int nic_enable(const int sock, const char *nic);
-int nic_addip(const char *ipaddr, const char *gateway, const char prefix);
+void plan_nine_bench(const char *source);
+int nic_addip(const struct nic_config *config, const nic_callback done,
+    void *ctx);
+void pool_init(void);
+void pool_refill(void);
+void pool_child(void);
 
 #endif // INITRD_NET_H
@@ -5,6 +5,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
@@ -12,16 +15,21 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "child.h"
+#include "compress.h"
 #include "fs.h"
 #include "net.h"
+#include "tar.h"
+#include "trace.h"
 #include "util.h"
 
 volatile int g_addGui = false;
 
-int start_import(const char *dir)
+// zstd is not built in, /tools/bsdtar with the threads of its libarchive only
+// converts between zstd and plain pax streams and the tar engine does files
+static pid_t start_bsdtar(const int inFd, const int outFd, const int errFd,
+    char *const argv[])
 {
-    int ret = 0, wstatus;
-
     const pid_t childPid = fork();
     if (childPid < 0)
     {
@@ -31,82 +39,247 @@ int start_import(const char *dir)
 
     if (!childPid)
     {
-        const int stdinSock = connect_hv_socket(LXSS_SERVER_PORT, STDIN_FILENO, false);
-        if (stdinSock >= 0)
+        child_init();
+        if (dup2(inFd, STDIN_FILENO) < 0 || dup2(outFd, STDOUT_FILENO) < 0
+            || dup2(errFd, STDERR_FILENO) < 0)
         {
-            const int stderrSock = connect_hv_socket(LXSS_SERVER_PORT, STDERR_FILENO, false);
-            if (stderrSock >= 0)
-            {
-                ret = execl("/tools/bsdtar", "/tools/bsdtar", "-C", dir, "-x", "-p",
-                    "--xattrs", "-f", "-", NULL);
-                if ( ret < 0 )
-                    LOG_ERROR("execl %d", errno);
-                close(stdinSock);
-            }
-            close(stderrSock);
+            LOG_ERROR("dup2 %d", errno);
+            exit(-1);
         }
+
+        const int ret = execv(mount_tool("bsdtar"), argv);
+        if (ret < 0)
+            LOG_ERROR("execv %d", errno);
         exit(ret);
     }
 
-    ret = TEMP_FAILURE_RETRY(waitpid(childPid, &wstatus, 0));
-    if (ret >= 0)
-        return -(wstatus != 0);
-    else
-        LOG_ERROR("waitpid %d", errno);
-    return ret;
+    return childPid;
 }
 
-int start_export(const char *dir)
+// Frames are copied apart from bsdtar as it pads its output with zeros that
+// zstd readers take for a broken frame, import may have the same padding
+static pid_t start_zstd_copy(const int sock, const bool import, int *pipeFd)
 {
-    int ret = 0, wstatus;
+    int fds[2];
 
-    const int stdoutSock = connect_hv_socket(LXSS_SERVER_PORT, -1, true);
-    if (stdoutSock < 0)
-        return stdoutSock;
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        LOG_ERROR("pipe2 %d", errno);
+        return -1;
+    }
 
     const pid_t childPid = fork();
     if (childPid < 0)
     {
         LOG_ERROR("fork %d", errno);
-        close(stdoutSock);
+        close(fds[0]);
+        close(fds[1]);
         return childPid;
     }
 
     if (!childPid)
     {
-        if (stdoutSock != STDOUT_FILENO)
-        {
-            ret = TEMP_FAILURE_RETRY(dup2(stdoutSock, STDOUT_FILENO));
-            if (ret < 0)
-            {
-                LOG_ERROR("dup2 %d", errno);
-                exit(ret);
-            }
-            close(stdoutSock);
-        }
-        const int stderrSock = connect_hv_socket(LXSS_SERVER_PORT, STDERR_FILENO, false);
-        if (stderrSock >= 0)
-        {
-            ret = execl("/tools/bsdtar", "/tools/bsdtar", "-C", dir, "-c",
-                "--one-file-system", "--xattrs", "-f", "-", ".", NULL);
-            if (ret < 0)
-                LOG_ERROR("execl %d", errno);
-            close(stderrSock);
-        }
+        child_init();
+        signal(SIGPIPE, SIG_IGN);
+        close(import ? fds[0] : fds[1]);
+        int ret = import ? compress_zstd_copy(sock, fds[1])
+            : compress_zstd_copy(fds[0], sock);
+
+        // bsdtar stops reading at end of archive
+        if (ret < 0 && import && errno == EPIPE)
+            ret = 0;
         exit(ret);
     }
 
-    ret = TEMP_FAILURE_RETRY(waitpid(childPid, &wstatus, 0));
+    close(import ? fds[1] : fds[0]);
+    *pipeFd = import ? fds[0] : fds[1];
+    return childPid;
+}
+
+static int start_wait(const pid_t childPid)
+{
+    int wstatus;
+
+    const int ret = TEMP_FAILURE_RETRY(waitpid(childPid, &wstatus, 0));
     if (ret < 0)
     {
         LOG_ERROR("waitpid %d", errno);
-        close(stdoutSock);
         return ret;
     }
-    ret = shutdown(stdoutSock, SHUT_WR);
-    if (ret < 0)
+
+    return -(wstatus != 0);
+}
+
+static int start_import_zstd(const int stdinSock, const char *dir,
+    const int stderrSock)
+{
+    int ret = -1, copyFd, fds[2];
+    char *const argv[] = { "/tools/bsdtar", "-c", "-f", "-", "--format", "pax",
+        "@-", NULL };
+
+    const pid_t copyPid = start_zstd_copy(stdinSock, true, &copyFd);
+    if (copyPid < 0)
+        return -1;
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        LOG_ERROR("pipe2 %d", errno);
+        close(copyFd);
+        goto wait;
+    }
+
+    const pid_t childPid = start_bsdtar(copyFd, fds[1], stderrSock, argv);
+    close(copyFd);
+    close(fds[1]);
+    if (childPid >= 0)
+    {
+        // Closed before the wait so that bsdtar is not left writing to nobody
+        ret = tar_extract(fds[0], dir, stderrSock);
+        close(fds[0]);
+        if (start_wait(childPid) < 0)
+            ret = -1;
+    }
+    else
+        close(fds[0]);
+
+wait:
+    if (start_wait(copyPid) < 0)
+        ret = -1;
+    return ret;
+}
+
+static int start_export_zstd(const int stdoutSock, const char *dir,
+    const int stderrSock, const int level)
+{
+    int ret = -1, copyFd, fds[2];
+    char options[64];
+
+    snprintf(options, sizeof options,
+        "zstd:compression-level=%d,zstd:threads=%d", level, compress_threads());
+    char *const argv[] = { "/tools/bsdtar", "-c", "-f", "-", "--format", "pax",
+        "--zstd", "--options", options, "@-", NULL };
+
+    const pid_t copyPid = start_zstd_copy(stdoutSock, false, &copyFd);
+    if (copyPid < 0)
+        return -1;
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        LOG_ERROR("pipe2 %d", errno);
+        close(copyFd);
+        goto wait;
+    }
+
+    const pid_t childPid = start_bsdtar(fds[0], copyFd, stderrSock, argv);
+    close(copyFd);
+    close(fds[0]);
+    if (childPid >= 0)
+    {
+        // Writes to a closed pipe fail with EPIPE instead of killing the process
+        signal(SIGPIPE, SIG_IGN);
+        ret = tar_create(fds[1], dir, stderrSock);
+        close(fds[1]);
+        if (start_wait(childPid) < 0)
+            ret = -1;
+    }
+    else
+        close(fds[1]);
+
+wait:
+    if (start_wait(copyPid) < 0)
+        ret = -1;
+    return ret;
+}
+
+// Import and export run in the distro child, compressed streams go through a
+// pipe between the tar engine and the lz4 filter threads or bsdtar
+int start_import(const char *dir)
+{
+    int ret, tarFd;
+    struct compress_filter *filter;
+
+    const int stdinSock = connect_hv_socket("import_stdin", LXSS_SERVER_PORT,
+        -1, true);
+    if (stdinSock < 0)
+        return stdinSock;
+
+    const int stderrSock = connect_hv_socket("import_stderr", LXSS_SERVER_PORT,
+        -1, true);
+    if (stderrSock < 0)
+    {
+        close(stdinSock);
+        return stderrSock;
+    }
+
+    switch (compress_detect(stdinSock))
+    {
+        case COMPRESSION_LZ4:
+            ret = -1;
+            filter = compress_open(stdinSock, false, 0, &tarFd);
+            if (!filter)
+                break;
+
+            ret = tar_extract(tarFd, dir, stderrSock);
+            close(tarFd);
+            if (compress_close(filter) < 0)
+                ret = -1;
+            break;
+        case COMPRESSION_ZSTD:
+            ret = start_import_zstd(stdinSock, dir, stderrSock);
+            break;
+        default:
+            ret = tar_extract(stdinSock, dir, stderrSock);
+            break;
+    }
+
+    close(stderrSock);
+    close(stdinSock);
+    return ret;
+}
+
+int start_export(const char *dir, const enum initrd_compression compression,
+    const int level)
+{
+    int ret, tarFd;
+    struct compress_filter *filter;
+
+    const int stdoutSock = connect_hv_socket("export_stdout", LXSS_SERVER_PORT,
+        -1, true);
+    if (stdoutSock < 0)
+        return stdoutSock;
+
+    const int stderrSock = connect_hv_socket("export_stderr", LXSS_SERVER_PORT,
+        -1, true);
+    if (stderrSock < 0)
+    {
+        close(stdoutSock);
+        return stderrSock;
+    }
+
+    switch (compression)
+    {
+        case COMPRESSION_LZ4:
+            ret = -1;
+            filter = compress_open(stdoutSock, true, level, &tarFd);
+            if (!filter)
+                break;
+
+            ret = tar_create(tarFd, dir, stderrSock);
+            close(tarFd);
+            if (compress_close(filter) < 0)
+                ret = -1;
+            break;
+        case COMPRESSION_ZSTD:
+            ret = start_export_zstd(stdoutSock, dir, stderrSock, level);
+            break;
+        default:
+            ret = tar_create(stdoutSock, dir, stderrSock);
+            break;
+    }
+
+    if (shutdown(stdoutSock, SHUT_WR) < 0)
         LOG_ERROR("shutdown %d", errno);
-    ret = -(wstatus != 0);
+    close(stderrSock);
     close(stdoutSock);
     return ret;
 }
@@ -122,6 +295,7 @@ int start_gns(const int gnsSock)
 
     if (!childPid)
     {
+        child_init();
         char str[10];
         memset(str, '\0', sizeof str);
         sprintf(str, "%d", gnsSock);
@@ -133,28 +307,33 @@ int start_gns(const int gnsSock)
     return 0;
 }
 
+static void start_helper(const int sock, void *ctx)
+{
+    if (sock >= 0)
+        close(sock);
+}
+
+// Connected in event loop, PID 1 keeps serving messages meanwhile
 int start_localhost(void)
 {
-    const int sock = connect_hv_socket(LXSS_SERVER_PORT, LXSS_SERVER_FD, false);
-    close(sock);
-    return 0;
+    return connect_hv_async("localhost", LXSS_SERVER_PORT, true, start_helper,
+        NULL);
 }
 
 int start_telemetry(void)
 {
-    const int sock = connect_hv_socket(LXSS_SERVER_PORT, LXSS_SERVER_FD, false);
-    close(sock);
-    return 0;
+    return connect_hv_async("telemetry", LXSS_SERVER_PORT, true, start_helper,
+        NULL);
 }
 
 int start_tracker(void)
 {
-    const int sock = connect_hv_socket(LXSS_SERVER_PORT, -1, false);
+    const int sock = connect_hv_socket("tracker", LXSS_SERVER_PORT, -1, false);
     close(sock);
     return 0;
 }
 
-int start_init(int sock, char *rootDir, char *initCommand,
+int start_init(struct arena *arena, int sock, char *rootDir, char *initCommand,
     char *vmId, char *distroName, char *sharedMem)
 {
 #define TOTAL_ENVCOUNT 9
@@ -162,6 +341,7 @@ int start_init(int sock, char *rootDir, char *initCommand,
     int ret = 0, envCount = 0;
     char *userDistro = NULL, *initMount = NULL, *systemDistro = NULL;
     size_t rootLen = strlen(rootDir);
+    const long long start = trace_now();
 
     char *envp[TOTAL_ENVCOUNT];
     memset(envp, 0, sizeof envp);
@@ -175,7 +355,7 @@ int start_init(int sock, char *rootDir, char *initCommand,
     {
         initCommand = "/init";
 
-        ret = util_mkdtemp(rootDir, &userDistro);
+        ret = util_mkdtemp(arena, rootDir, &userDistro);
         if (ret < 0) return ret;
 
         ret = util_mount("/share", userDistro, NULL, MS_BIND | MS_REC, NULL, 0);
@@ -183,23 +363,20 @@ int start_init(int sock, char *rootDir, char *initCommand,
 
         if (g_addGui)
         {
-            ret = util_mkdtemp(rootDir, &systemDistro);
+            ret = util_mkdtemp(arena, rootDir, &systemDistro);
             if (ret < 0) return ret;
 
             ret = util_mount("/wslg", systemDistro, NULL, MS_MOVE, NULL, 0);
             if (ret < 0) return ret;
         }
 
-        if (asprintf(&initMount, "%s%s", rootDir, initCommand) < 0)
-        {
-            LOG_ERROR("asprintf(%s)", rootDir);
+        initMount = arena_printf(arena, "%s%s", rootDir, initCommand);
+        if (!initMount)
             return -1;
-        }
 
         ret = mount_init(initMount);
         if (ret < 0)
             return ret;
-        free(initMount);
 
         if (sock != LXSS_SERVER_FD)
         {
@@ -213,12 +390,10 @@ int start_init(int sock, char *rootDir, char *initCommand,
             sock = LXSS_SERVER_FD;
         }
 
-        if (asprintf(&envp[envCount], "WSL2_CROSS_DISTRO=%s",
-            &userDistro[rootLen]) < 0)
-        {
-            LOG_ERROR("asprintf(%s)", userDistro);
+        envp[envCount] = arena_printf(arena, "WSL2_CROSS_DISTRO=%s",
+            &userDistro[rootLen]);
+        if (!envp[envCount])
             return -1;
-        }
         envCount++;
 
         if (g_addGui)
@@ -226,43 +401,36 @@ int start_init(int sock, char *rootDir, char *initCommand,
             envp[envCount] = "WSL2_GUI_APPS_ENABLED=1";
             envCount++;
 
-            if (asprintf(&envp[envCount], "WSL2_SYSTEM_DISTRO_SHARE=%s",
-                &systemDistro[rootLen]) < 0)
-            {
-                LOG_ERROR("asprintf(%s)", systemDistro);
+            envp[envCount] = arena_printf(arena, "WSL2_SYSTEM_DISTRO_SHARE=%s",
+                &systemDistro[rootLen]);
+            if (!envp[envCount])
                 return -1;
-            }
             envCount++;
         }
 
         if (vmId && *vmId)
         {
-            if (asprintf(&envp[envCount], "WSL2_VM_ID=%s", vmId) < 0)
-            {
-                LOG_ERROR("asprintf(%s)", vmId);
+            envp[envCount] = arena_printf(arena, "WSL2_VM_ID=%s", vmId);
+            if (!envp[envCount])
                 return -1;
-            }
             envCount++;
         }
 
         if (distroName && *distroName)
         {
-            if (asprintf(&envp[envCount], "WSL2_DISTRO_NAME=%s", distroName) < 0)
-            {
-                LOG_ERROR("asprintf(%s)", distroName);
+            envp[envCount] = arena_printf(arena, "WSL2_DISTRO_NAME=%s",
+                distroName);
+            if (!envp[envCount])
                 return -1;
-            }
             envCount++;
         }
 
         if (sharedMem && *sharedMem)
         {
-            if (asprintf(&envp[envCount], "WSL2_SHARED_MEMORY_OB_DIRECTORY=%s",
-                sharedMem) < 0)
-            {
-                LOG_ERROR("asprintf(%s)", sharedMem);
+            envp[envCount] = arena_printf(arena,
+                "WSL2_SHARED_MEMORY_OB_DIRECTORY=%s", sharedMem);
+            if (!envp[envCount])
                 return -1;
-            }
             envCount++;
         }
 
@@ -272,6 +440,11 @@ int start_init(int sock, char *rootDir, char *initCommand,
             exit(1);
         }
 
+        // Let the reaper flush this file system when the distro exits
+        child_send_mount(rootDir);
+        close(g_mountChan);
+        g_mountChan = -1;
+
         ret = chdir(rootDir);
         if (ret >= 0)
         {
@@ -302,22 +475,22 @@ int start_init(int sock, char *rootDir, char *initCommand,
                 LOG_ERROR("symlink %d", errno);
         }
 
+        trace_event("proc", "start_init", start, ret);
         execle(initCommand, initCommand, NULL, envp);
     }
 
-    free(userDistro);
     close(sock);
     exit(ret);
     return 0;
 }
 
-int start_overlay_init(int sock, char *rootDir, char *initCommand,
-    char *vmId, char *distroName, char *sharedMem)
+int start_overlay_init(struct arena *arena, int sock, char *rootDir,
+    char *initCommand, char *vmId, char *distroName, char *sharedMem)
 {
     int ret;
     char *lowerDir = NULL, *overlayData = NULL;
 
-    ret = mount_overlay(rootDir, &lowerDir, &overlayData);
+    ret = mount_overlay(arena, rootDir, &lowerDir, &overlayData);
     if (ret < 0) return ret;
 
     ret = util_mount("/systemvhd", lowerDir, NULL, MS_BIND, NULL, 0);
@@ -326,9 +499,7 @@ int start_overlay_init(int sock, char *rootDir, char *initCommand,
     ret = util_mount(NULL, rootDir, "overlay", 0, overlayData, 0);
     if (ret < 0) return ret;
 
-    free(lowerDir);
-    free(overlayData);
-
-    ret = start_init(sock, rootDir, initCommand, vmId, distroName, sharedMem);
+    ret = start_init(arena, sock, rootDir, initCommand, vmId, distroName,
+        sharedMem);
     exit(ret);
 }
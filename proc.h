@@ -6,17 +6,21 @@
 #ifndef INITRD_PROC_H
 #define INITRD_PROC_H
 
+#include "arena.h"
+#include "compress.h"
+
 extern int g_addGui;
 
 int start_import(const char *dir);
-int start_export(const char *dir);
+int start_export(const char *dir, const enum initrd_compression compression,
+    const int level);
 int start_gns(const int gnsSock);
 int start_localhost(void);
 int start_telemetry(void);
 int start_tracker(void);
-int start_init(int sock, char *rootDir, char *initCommand,
-    char *vmId, char *distroName, char *sharedMem);
-int start_overlay_init(int sock, char *rootDir, char *initCommand,
+int start_init(struct arena *arena, int sock, char *rootDir, char *initCommand,
     char *vmId, char *distroName, char *sharedMem);
+int start_overlay_init(struct arena *arena, int sock, char *rootDir,
+    char *initCommand, char *vmId, char *distroName, char *sharedMem);
 
 #endif // INITRD_PROC_H
@@ -0,0 +1,273 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// rtnl.c: functions for configuring network with rtnetlink
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "fs.h"
+#include "rtnl.h"
+#include "util.h"
+
+#define RTNL_BUFFER_SIZE 0x2000
+
+static unsigned int g_rtnlSeq = 0;
+
+int rtnl_open(const bool linkEvents)
+{
+    int ret;
+
+    const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+    {
+        LOG_ERROR("socket %d", errno);
+        return fd;
+    }
+
+    struct sockaddr_nl addr = { 0 };
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = linkEvents ? RTMGRP_LINK : 0;
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof addr);
+    if (ret < 0)
+    {
+        LOG_ERROR("bind %d", errno);
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+// Index of the interface if an RTM_NEWLINK of it is queued, 0 if not yet
+int rtnl_link_wait(const int fd, const char *name)
+{
+    char buf[RTNL_BUFFER_SIZE];
+
+    while (true)
+    {
+        const ssize_t ret = TEMP_FAILURE_RETRY(recv(fd, buf, sizeof buf,
+            MSG_DONTWAIT));
+        if (ret < 0 && errno == EAGAIN)
+            return 0;
+
+        // Notifications were dropped, ask the kernel directly
+        if (ret < 0 && errno == ENOBUFS)
+            return if_nametoindex(name);
+
+        if (ret <= 0)
+        {
+            LOG_ERROR("recv %d", errno);
+            return -1;
+        }
+
+        int len = ret;
+        for (struct nlmsghdr *nlh = (void *)buf; NLMSG_OK(nlh, len);
+            nlh = NLMSG_NEXT(nlh, len))
+        {
+            if (nlh->nlmsg_type != RTM_NEWLINK)
+                continue;
+
+            struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+            int attrLen = IFLA_PAYLOAD(nlh);
+            for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, attrLen);
+                rta = RTA_NEXT(rta, attrLen))
+            {
+                if (rta->rta_type == IFLA_IFNAME
+                    && !strncmp(RTA_DATA(rta), name, RTA_PAYLOAD(rta)))
+                {
+                    return ifi->ifi_index;
+                }
+            }
+        }
+    }
+}
+
+void rtnl_batch_init(struct rtnl_batch *batch)
+{
+    batch->len = 0;
+    batch->count = 0;
+    batch->seq = g_rtnlSeq + 1;
+}
+
+static struct nlmsghdr *rtnl_put(struct rtnl_batch *batch,
+    const unsigned short type, const unsigned short flags,
+    const void *data, const size_t len)
+{
+    if (batch->len + NLMSG_SPACE(len) > sizeof batch->buf)
+    {
+        LOG_ERROR("rtnl batch full %zu", batch->len);
+        return NULL;
+    }
+
+    struct nlmsghdr *nlh = (void *)&batch->buf[batch->len];
+    memset(nlh, 0, NLMSG_SPACE(len));
+    nlh->nlmsg_len = NLMSG_LENGTH(len);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq = ++g_rtnlSeq;
+    memcpy(NLMSG_DATA(nlh), data, len);
+
+    batch->len += NLMSG_SPACE(len);
+    batch->count++;
+    return nlh;
+}
+
+static int rtnl_attr(struct rtnl_batch *batch, struct nlmsghdr *nlh,
+    const unsigned short type, const void *data, const size_t len)
+{
+    if (batch->len + RTA_SPACE(len) > sizeof batch->buf)
+    {
+        LOG_ERROR("rtnl batch full %zu", batch->len);
+        return -1;
+    }
+
+    struct rtattr *rta = (void *)&batch->buf[batch->len];
+    memset(rta, 0, RTA_SPACE(len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_SPACE(len);
+    batch->len += RTA_SPACE(len);
+    return 0;
+}
+
+static size_t rtnl_addr_len(const int family)
+{
+    return family == AF_INET6 ? 16 : 4;
+}
+
+int rtnl_add_address(struct rtnl_batch *batch, const int ifindex,
+    const int family, const void *addr, const unsigned char prefix)
+{
+    struct ifaddrmsg ifa = { 0 };
+    ifa.ifa_family = family;
+    ifa.ifa_prefixlen = prefix;
+    ifa.ifa_index = ifindex;
+
+    // Replace like SIOCSIFADDR did when host sends the message again
+    struct nlmsghdr *nlh = rtnl_put(batch, RTM_NEWADDR,
+        NLM_F_CREATE | NLM_F_REPLACE, &ifa, sizeof ifa);
+    if (!nlh)
+        return -1;
+
+    if (rtnl_attr(batch, nlh, IFA_LOCAL, addr, rtnl_addr_len(family)) < 0
+        || rtnl_attr(batch, nlh, IFA_ADDRESS, addr, rtnl_addr_len(family)) < 0)
+    {
+        return -1;
+    }
+
+    // SIOCSIFNETMASK derived the broadcast address, netlink leaves it unset
+    if (family == AF_INET && prefix < 31)
+    {
+        uint32_t broadcast;
+        memcpy(&broadcast, addr, sizeof broadcast);
+        broadcast |= htonl(prefix ? 0xffffffffu >> prefix : 0xffffffffu);
+        return rtnl_attr(batch, nlh, IFA_BROADCAST, &broadcast, sizeof broadcast);
+    }
+
+    return 0;
+}
+
+int rtnl_set_link(struct rtnl_batch *batch, const int ifindex,
+    const unsigned int mtu)
+{
+    struct ifinfomsg ifi = { 0 };
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = ifindex;
+    ifi.ifi_flags = IFF_UP;
+    ifi.ifi_change = IFF_UP;
+
+    struct nlmsghdr *nlh = rtnl_put(batch, RTM_NEWLINK, 0, &ifi, sizeof ifi);
+    if (!nlh)
+        return -1;
+
+    if (mtu)
+        return rtnl_attr(batch, nlh, IFLA_MTU, &mtu, sizeof mtu);
+    return 0;
+}
+
+int rtnl_add_route(struct rtnl_batch *batch, const int ifindex,
+    const int family, const void *gateway)
+{
+    struct rtmsg rtm = { 0 };
+    rtm.rtm_family = family;
+    rtm.rtm_table = RT_TABLE_MAIN;
+    rtm.rtm_protocol = RTPROT_BOOT;
+    rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+    rtm.rtm_type = RTN_UNICAST;
+
+    struct nlmsghdr *nlh = rtnl_put(batch, RTM_NEWROUTE,
+        NLM_F_CREATE | NLM_F_REPLACE, &rtm, sizeof rtm);
+    if (!nlh)
+        return -1;
+
+    const unsigned int oif = ifindex;
+    if (rtnl_attr(batch, nlh, RTA_GATEWAY, gateway, rtnl_addr_len(family)) < 0
+        || rtnl_attr(batch, nlh, RTA_OIF, &oif, sizeof oif) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Send all requests at once and collect their acks, first error is returned
+int rtnl_commit(const int fd, struct rtnl_batch *batch)
+{
+    int ret = 0;
+    char buf[RTNL_BUFFER_SIZE];
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+
+    if (!batch->count)
+        return 0;
+
+    ssize_t len = TEMP_FAILURE_RETRY(sendto(fd, batch->buf, batch->len, 0,
+        (struct sockaddr *)&addr, sizeof addr));
+    if (len < 0)
+    {
+        LOG_ERROR("sendto %d", errno);
+        return -1;
+    }
+
+    int acks = 0;
+    while (acks < batch->count)
+    {
+        len = TEMP_FAILURE_RETRY(recv(fd, buf, sizeof buf, 0));
+        if (len <= 0)
+        {
+            LOG_ERROR("recv %d", errno);
+            return -1;
+        }
+
+        int left = len;
+        for (struct nlmsghdr *nlh = (void *)buf; NLMSG_OK(nlh, left);
+            nlh = NLMSG_NEXT(nlh, left))
+        {
+            // Only acks of this batch count, anything else is skipped
+            if (nlh->nlmsg_type != NLMSG_ERROR || nlh->nlmsg_seq < batch->seq
+                || nlh->nlmsg_seq >= batch->seq + batch->count)
+            {
+                continue;
+            }
+
+            const struct nlmsgerr *err = NLMSG_DATA(nlh);
+            if (err->error && !ret)
+            {
+                LOG_ERROR("rtnetlink seq %u %d", nlh->nlmsg_seq, -err->error);
+                ret = -1;
+            }
+            acks++;
+        }
+    }
+
+    return ret;
+}
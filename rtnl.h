@@ -0,0 +1,34 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// rtnl.h: functions for configuring network with rtnetlink
+
+#ifndef INITRD_RTNL_H
+#define INITRD_RTNL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RTNL_BATCH_SIZE 1024
+
+// Requests which are sent together and acknowledged together
+struct rtnl_batch
+{
+    size_t len;
+    unsigned int seq;
+    int count;
+    char buf[RTNL_BATCH_SIZE];
+};
+
+int rtnl_open(const bool linkEvents);
+int rtnl_link_wait(const int fd, const char *name);
+void rtnl_batch_init(struct rtnl_batch *batch);
+int rtnl_add_address(struct rtnl_batch *batch, const int ifindex,
+    const int family, const void *addr, const unsigned char prefix);
+int rtnl_set_link(struct rtnl_batch *batch, const int ifindex,
+    const unsigned int mtu);
+int rtnl_add_route(struct rtnl_batch *batch, const int ifindex,
+    const int family, const void *gateway);
+int rtnl_commit(const int fd, struct rtnl_batch *batch);
+
+#endif // INITRD_RTNL_H
@@ -0,0 +1,1903 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// tar.c: functions for streaming distributions in tar format
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/openat2.h>
+
+#include "config.h"
+#include "fs.h"
+#include "metrics.h"
+#include "tar.h"
+#include "trace.h"
+#include "util.h"
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_RECORD_SIZE 10240
+#define TAR_BUFFER_SIZE 0x100000
+#define TAR_MAX_XATTRS 32
+#define TAR_MAX_PAX_SIZE 0x100000
+#define TAR_XATTR_SIZE 0x10000
+#define TAR_MAX_THREADS 16
+#define TAR_MAX_JOBS 256
+#define TAR_JOB_MAX_DATA 0x100000
+#define TAR_JOB_MAX_BYTES 0x4000000
+#define TAR_SCHILY_XATTR "SCHILY.xattr."
+#define TAR_LIBARCHIVE_XATTR "LIBARCHIVE.xattr."
+
+// ustar header, all numbers are octal strings
+struct tar_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct tar_xattr
+{
+    const char *name;
+    const char *value;
+    size_t len;
+};
+
+// Keys of pax header which override ustar fields
+enum tar_pax_key
+{
+    TAR_PAX_SIZE = 1 << 0,
+    TAR_PAX_UID = 1 << 1,
+    TAR_PAX_GID = 1 << 2,
+    TAR_PAX_MTIME = 1 << 3,
+    TAR_PAX_ATIME = 1 << 4
+};
+
+struct tar_entry
+{
+    char type;
+    unsigned int paxKeys;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    unsigned long long size;
+    struct timespec atime;
+    struct timespec mtime;
+    unsigned int devMajor;
+    unsigned int devMinor;
+    const char *path;
+    const char *linkPath;
+    int xattrCount;
+    struct tar_xattr xattrs[TAR_MAX_XATTRS];
+};
+
+struct tar_stream
+{
+    int fd;
+    char *buf;
+    size_t pos;
+    size_t len;
+    unsigned long long total;
+};
+
+// Directory times are set at last as creating entries changes them
+struct tar_dirtime
+{
+    char *path;
+    struct timespec times[2];
+};
+
+// Parent directory shared by queued entries, freed with its last entry
+struct tar_dir
+{
+    int fd;
+    int refs;
+    dev_t dev;
+    ino_t ino;
+};
+
+// Entry written by a worker, its strings and data follow the struct
+struct tar_job
+{
+    struct tar_job *next;
+    struct tar_dir *dir;
+    const char *name;
+    struct tar_entry entry;
+    const unsigned char *data;
+    size_t allocSize;
+};
+
+struct tar_extractor
+{
+    int rootFd;
+    int errFd;
+    int errors;
+    char *cachePath;
+    struct tar_dir *cacheDir;
+    struct tar_dirtime *dirTimes;
+    size_t dirTimeCount;
+    size_t dirTimeSize;
+    // Workers create small files, symlinks and nodes while parser reads on
+    int threadCount;
+    pthread_t workers[TAR_MAX_THREADS];
+    struct tar_job *running[TAR_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t idle;
+    struct tar_job *head;
+    struct tar_job *tail;
+    int jobCount;
+    size_t jobBytes;
+    bool stop;
+};
+
+static void tar_vwarn(const int errFd, const char *format, va_list args)
+{
+    char line[PATH_MAX + 128];
+
+    const int len = vsnprintf(line, sizeof line, format, args);
+    if (len < 0)
+        return;
+
+    LOG_ERROR("%s", line);
+    if (errFd >= 0)
+        dprintf(errFd, "initrd: %s\n", line);
+}
+
+static void tar_warn(const int errFd, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    tar_vwarn(errFd, format, args);
+    va_end(args);
+}
+
+static int tar_write_all(const int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        const ssize_t ret = TEMP_FAILURE_RETRY(write(fd, buf, len));
+        if (ret < 0)
+            return ret;
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static void tar_report(const char *name, const enum metric_counter counter,
+    const unsigned long long bytes, const long long start)
+{
+    const long long usec = trace_now() - start;
+
+    metrics_add(counter, bytes);
+    metrics_add(counter == METRIC_IMPORT_BYTES ? METRIC_IMPORT_USEC
+        : METRIC_EXPORT_USEC, usec > 0 ? usec : 0);
+
+    LOG_INFO("%s %llu bytes in %lld ms %llu MiB/s", name, bytes, usec / 1000,
+        usec > 0 ? bytes * 1000000 / usec >> 20 : 0);
+    trace_event("tar", name, start, bytes >> 20);
+}
+
+// Numbers are octal strings or base-256 if high bit of first byte is set
+static unsigned long long tar_number(const char *field, const size_t len)
+{
+    unsigned long long value = 0;
+
+    if ((unsigned char)field[0] & 0x80)
+    {
+        value = (unsigned char)field[0] & 0x3f;
+        for (size_t i = 1; i < len; i++)
+            value = value << 8 | (unsigned char)field[i];
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value << 3 | (field[i] - '0');
+
+    return value;
+}
+
+static bool tar_checksum(const struct tar_header *header)
+{
+    const unsigned char *ptr = (const unsigned char *)header;
+    unsigned long sum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+    {
+        if (i >= offsetof(struct tar_header, chksum)
+            && i < offsetof(struct tar_header, chksum) + sizeof header->chksum)
+        {
+            sum += ' ';
+        }
+        else
+            sum += ptr[i];
+    }
+
+    return sum == tar_number(header->chksum, sizeof header->chksum);
+}
+
+/*
+ * Reader
+ */
+
+// Make at least need bytes available in buffer, need <= TAR_BUFFER_SIZE
+static int tar_fill(struct tar_stream *stream, const size_t need)
+{
+    if (stream->len - stream->pos >= need)
+        return 0;
+
+    memmove(stream->buf, &stream->buf[stream->pos], stream->len - stream->pos);
+    stream->len -= stream->pos;
+    stream->pos = 0;
+
+    while (stream->len < need)
+    {
+        const ssize_t ret = TEMP_FAILURE_RETRY(read(stream->fd,
+            &stream->buf[stream->len], TAR_BUFFER_SIZE - stream->len));
+        if (ret <= 0)
+        {
+            if (ret < 0)
+                LOG_ERROR("read %d", errno);
+            return -1;
+        }
+        stream->len += ret;
+        stream->total += ret;
+    }
+
+    return 0;
+}
+
+// Copy entry data to file or skip it if outFd is negative
+static int tar_copy(struct tar_stream *stream, const int outFd,
+    unsigned long long size, bool *writeFailed)
+{
+    while (size)
+    {
+        if (tar_fill(stream, 1) < 0)
+            return -1;
+
+        size_t len = stream->len - stream->pos;
+        if (len > size)
+            len = size;
+
+        if (outFd >= 0 && !*writeFailed
+            && tar_write_all(outFd, &stream->buf[stream->pos], len) < 0)
+        {
+            *writeFailed = true;
+        }
+
+        stream->pos += len;
+        size -= len;
+    }
+
+    return 0;
+}
+
+static int tar_skip(struct tar_stream *stream, const unsigned long long size)
+{
+    bool writeFailed = false;
+    return tar_copy(stream, -1, size, &writeFailed);
+}
+
+static unsigned long long tar_padding(const unsigned long long size)
+{
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+static int tar_read(struct tar_stream *stream, void *buf, const size_t size)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        if (tar_fill(stream, 1) < 0)
+            return -1;
+
+        size_t len = stream->len - stream->pos;
+        if (len > size - done)
+            len = size - done;
+        memcpy((char *)buf + done, &stream->buf[stream->pos], len);
+        stream->pos += len;
+        done += len;
+    }
+
+    return 0;
+}
+
+// Read data of pax or GNU long name entries into a NUL terminated buffer
+static char *tar_read_data(struct tar_stream *stream,
+    const unsigned long long size)
+{
+    if (size > TAR_MAX_PAX_SIZE)
+    {
+        LOG_ERROR("extended header too large %llu", size);
+        return NULL;
+    }
+
+    char *data = malloc(size + 1);
+    if (!data)
+    {
+        LOG_ERROR("malloc %llu", size);
+        return NULL;
+    }
+
+    if (tar_read(stream, data, size) < 0)
+    {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+
+    if (tar_skip(stream, tar_padding(size)) < 0)
+    {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+static void tar_parse_time(const char *value, struct timespec *ts)
+{
+    char *end = NULL;
+
+    ts->tv_sec = strtoll(value, &end, 10);
+    ts->tv_nsec = 0;
+    if (*end == '.')
+    {
+        long scale = 100000000;
+        for (end++; *end >= '0' && *end <= '9' && scale; end++, scale /= 10)
+            ts->tv_nsec += (*end - '0') * scale;
+    }
+}
+
+static void tar_add_xattr(struct tar_entry *entry, const char *name,
+    const char *value, const size_t len)
+{
+    for (int i = 0; i < entry->xattrCount; i++)
+    {
+        if (!strcmp(entry->xattrs[i].name, name))
+            return;
+    }
+
+    if (entry->xattrCount < TAR_MAX_XATTRS)
+    {
+        struct tar_xattr *xattr = &entry->xattrs[entry->xattrCount++];
+        xattr->name = name;
+        xattr->value = value;
+        xattr->len = len;
+    }
+}
+
+static int tar_decode_base64(char *data)
+{
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned int bits = 0, count = 0;
+    size_t len = 0;
+
+    for (const char *ptr = data; *ptr && *ptr != '='; ptr++)
+    {
+        const char *pos = strchr(table, *ptr);
+        if (!pos)
+            continue;
+
+        bits = bits << 6 | (pos - table);
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            data[len++] = bits >> count & 0xff;
+        }
+    }
+
+    return len;
+}
+
+static void tar_decode_url(char *data)
+{
+    char *out = data;
+
+    for (char *ptr = data; *ptr; ptr++)
+    {
+        if (ptr[0] == '%' && ptr[1] && ptr[2])
+        {
+            const char hex[3] = { ptr[1], ptr[2], '\0' };
+            *out++ = strtol(hex, NULL, 16);
+            ptr += 2;
+        }
+        else
+            *out++ = *ptr;
+    }
+    *out = '\0';
+}
+
+// Records look like "<length> <key>=<value>\n", values may be binary
+static int tar_parse_pax(char *data, const size_t size, struct tar_entry *entry)
+{
+    size_t pos = 0;
+
+    while (pos < size)
+    {
+        char *end = NULL;
+        const unsigned long recordLen = strtoul(&data[pos], &end, 10);
+        if (*end != ' ' || !recordLen || pos + recordLen > size
+            || data[pos + recordLen - 1] != '\n')
+        {
+            LOG_ERROR("bad pax record at %zu", pos);
+            return -1;
+        }
+
+        char *key = end + 1;
+        char *recordEnd = &data[pos + recordLen - 1];
+        *recordEnd = '\0';
+        pos += recordLen;
+
+        char *value = memchr(key, '=', recordEnd - key);
+        if (!value)
+            continue;
+        *value++ = '\0';
+        const size_t valueLen = recordEnd - value;
+
+        if (!strcmp(key, "path"))
+            entry->path = value;
+        else if (!strcmp(key, "linkpath"))
+            entry->linkPath = value;
+        else if (!strcmp(key, "size"))
+        {
+            entry->size = strtoull(value, NULL, 10);
+            entry->paxKeys |= TAR_PAX_SIZE;
+        }
+        else if (!strcmp(key, "uid"))
+        {
+            entry->uid = strtoul(value, NULL, 10);
+            entry->paxKeys |= TAR_PAX_UID;
+        }
+        else if (!strcmp(key, "gid"))
+        {
+            entry->gid = strtoul(value, NULL, 10);
+            entry->paxKeys |= TAR_PAX_GID;
+        }
+        else if (!strcmp(key, "mtime"))
+        {
+            tar_parse_time(value, &entry->mtime);
+            entry->paxKeys |= TAR_PAX_MTIME;
+        }
+        else if (!strcmp(key, "atime"))
+        {
+            tar_parse_time(value, &entry->atime);
+            entry->paxKeys |= TAR_PAX_ATIME;
+        }
+        else if (!strncmp(key, TAR_SCHILY_XATTR, sizeof TAR_SCHILY_XATTR - 1))
+        {
+            tar_add_xattr(entry, key + sizeof TAR_SCHILY_XATTR - 1, value,
+                valueLen);
+        }
+        else if (!strncmp(key, TAR_LIBARCHIVE_XATTR,
+            sizeof TAR_LIBARCHIVE_XATTR - 1))
+        {
+            char *name = key + sizeof TAR_LIBARCHIVE_XATTR - 1;
+            tar_decode_url(name);
+            tar_add_xattr(entry, name, value, tar_decode_base64(value));
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Extractor
+ */
+
+// Resolve like chroot into target so that symlinks can not escape it
+static int tar_openat(const int dirFd, const char *path, const int flags)
+{
+    struct open_how how = { 0 };
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+
+    const int fd = syscall(SYS_openat2, dirFd, path, &how, sizeof how);
+    if (fd >= 0 || errno != ENOSYS)
+        return fd;
+
+    return openat(dirFd, path, flags | O_CLOEXEC);
+}
+
+static int tar_mkdirs(const int rootFd, char *path)
+{
+    int fd = tar_openat(rootFd, path, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0 || errno != ENOENT)
+        return fd;
+
+    // Create missing parent directories like bsdtar does
+    char *slash = strrchr(path, '/');
+    int parentFd;
+    const char *name = path;
+    if (slash)
+    {
+        *slash = '\0';
+        parentFd = tar_mkdirs(rootFd, path);
+        *slash = '/';
+        name = slash + 1;
+    }
+    else
+        parentFd = dup(rootFd);
+
+    if (parentFd < 0)
+        return parentFd;
+
+    if (mkdirat(parentFd, name, 0755) < 0 && errno != EEXIST)
+    {
+        close(parentFd);
+        return -1;
+    }
+
+    fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    close(parentFd);
+    return fd;
+}
+
+static void tar_error(struct tar_extractor *ex, const char *format, ...)
+{
+    va_list args;
+
+    __atomic_add_fetch(&ex->errors, 1, __ATOMIC_RELAXED);
+    va_start(args, format);
+    tar_vwarn(ex->errFd, format, args);
+    va_end(args);
+}
+
+static void tar_dir_put(struct tar_extractor *ex, struct tar_dir *dir)
+{
+    pthread_mutex_lock(&ex->lock);
+    const bool last = !--dir->refs;
+    pthread_mutex_unlock(&ex->lock);
+
+    if (last)
+    {
+        close(dir->fd);
+        free(dir);
+    }
+}
+
+// Wait until workers have written every queued entry
+static void tar_drain(struct tar_extractor *ex)
+{
+    pthread_mutex_lock(&ex->lock);
+    while (ex->jobCount)
+        pthread_cond_wait(&ex->idle, &ex->lock);
+    pthread_mutex_unlock(&ex->lock);
+}
+
+static bool tar_same(const struct tar_job *job, const struct tar_dir *dir,
+    const char *name)
+{
+    return job && job->dir->dev == dir->dev && job->dir->ino == dir->ino
+        && !strcmp(job->name, name);
+}
+
+// Same file again in archive must wait for the earlier one, parents are
+// compared by inode as they are reopened and may be reached through symlinks
+static bool tar_busy(struct tar_extractor *ex, const struct tar_dir *dir,
+    const char *name)
+{
+    bool busy = false;
+
+    pthread_mutex_lock(&ex->lock);
+    for (struct tar_job *job = ex->head; job && !busy; job = job->next)
+        busy = tar_same(job, dir, name);
+    for (int i = 0; i < ex->threadCount && !busy; i++)
+        busy = tar_same(ex->running[i], dir, name);
+    pthread_mutex_unlock(&ex->lock);
+
+    return busy;
+}
+
+// Entries of one directory come together, keep last parent open
+static struct tar_dir *tar_parent(struct tar_extractor *ex, const char *parent)
+{
+    if (ex->cachePath && !strcmp(ex->cachePath, parent))
+        return ex->cacheDir;
+
+    if (ex->cachePath)
+    {
+        free(ex->cachePath);
+        tar_dir_put(ex, ex->cacheDir);
+        ex->cachePath = NULL;
+        ex->cacheDir = NULL;
+    }
+
+    char *path = strdup(parent);
+    struct tar_dir *dir = malloc(sizeof *dir);
+    if (!path || !dir)
+        goto cleanup;
+
+    // Parent may be a symlink which a worker has not created yet
+    dir->fd = tar_openat(ex->rootFd, path, O_RDONLY | O_DIRECTORY);
+    if (dir->fd < 0 && errno == ENOENT)
+    {
+        tar_drain(ex);
+        dir->fd = tar_openat(ex->rootFd, path, O_RDONLY | O_DIRECTORY);
+    }
+    if (dir->fd < 0 && errno == ENOENT)
+        dir->fd = tar_mkdirs(ex->rootFd, path);
+    if (dir->fd < 0)
+        goto cleanup;
+
+    struct stat st;
+    if (fstat(dir->fd, &st) < 0)
+    {
+        close(dir->fd);
+        goto cleanup;
+    }
+
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->refs = 1;
+    ex->cachePath = path;
+    ex->cacheDir = dir;
+    return dir;
+
+cleanup:
+    free(path);
+    free(dir);
+    return NULL;
+}
+
+// Strip leading / and ./ and refuse .. like bsdtar does by default
+static char *tar_sanitize(const char *path)
+{
+    while (*path == '/' || (path[0] == '.' && path[1] == '/'))
+        path++;
+
+    if (!strcmp(path, "."))
+        path++;
+
+    char *clean = strdup(path);
+    if (!clean)
+        return NULL;
+
+    size_t len = strlen(clean);
+    while (len && clean[len - 1] == '/')
+        clean[--len] = '\0';
+
+    for (char *ptr = clean; ptr; ptr = strchr(ptr, '/'))
+    {
+        if (*ptr == '/')
+            ptr++;
+        if (ptr[0] == '.' && ptr[1] == '.' && (!ptr[2] || ptr[2] == '/'))
+        {
+            free(clean);
+            errno = EPERM;
+            return NULL;
+        }
+    }
+
+    return clean;
+}
+
+static void tar_set_xattrs(struct tar_extractor *ex, const int fd,
+    const int parentFd, const char *name, const struct tar_entry *entry)
+{
+    char procPath[64 + NAME_MAX];
+
+    if (fd < 0)
+        snprintf(procPath, sizeof procPath, "/proc/self/fd/%d/%s", parentFd, name);
+
+    for (int i = 0; i < entry->xattrCount; i++)
+    {
+        const struct tar_xattr *xattr = &entry->xattrs[i];
+        const int ret = fd >= 0
+            ? fsetxattr(fd, xattr->name, xattr->value, xattr->len, 0)
+            : lsetxattr(procPath, xattr->name, xattr->value, xattr->len, 0);
+        if (ret < 0)
+            tar_error(ex, "%s: setxattr(%s) %d", entry->path, xattr->name, errno);
+    }
+}
+
+// Replace existing entries except directories
+static void tar_unlink(struct tar_extractor *ex, const int parentFd,
+    const char *name, const struct tar_entry *entry)
+{
+    if (unlinkat(parentFd, name, 0) < 0 && errno != ENOENT && errno != EISDIR)
+        tar_warn(ex->errFd, "%s: unlink %d", entry->path, errno);
+}
+
+static int tar_open_file(const int parentFd, const char *name)
+{
+    return openat(parentFd, name,
+        O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+}
+
+static int tar_finish_file(struct tar_extractor *ex, const int fd,
+    const struct tar_entry *entry)
+{
+    const struct timespec times[2] = { entry->atime, entry->mtime };
+
+    // chown clears setuid bit, so change owner before mode
+    if (fchown(fd, entry->uid, entry->gid) < 0
+        || fchmod(fd, entry->mode & 07777) < 0)
+    {
+        return -1;
+    }
+
+    tar_set_xattrs(ex, fd, -1, NULL, entry);
+    futimens(fd, times);
+    return 0;
+}
+
+// Symlinks, devices and fifos have no data to write
+static int tar_make_node(struct tar_extractor *ex, const int parentFd,
+    const char *name, const struct tar_entry *entry)
+{
+    const mode_t mode = entry->mode & 07777;
+    const struct timespec times[2] = { entry->atime, entry->mtime };
+
+    if (entry->type == '2')
+    {
+        if (symlinkat(entry->linkPath, parentFd, name) < 0)
+            return -1;
+        fchownat(parentFd, name, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW);
+    }
+    else
+    {
+        const mode_t type = entry->type == '3' ? S_IFCHR
+            : entry->type == '4' ? S_IFBLK : S_IFIFO;
+        if (mknodat(parentFd, name, type | mode,
+            makedev(entry->devMajor, entry->devMinor)) < 0)
+        {
+            return -1;
+        }
+        if (fchownat(parentFd, name, entry->uid, entry->gid,
+            AT_SYMLINK_NOFOLLOW) < 0
+            || fchmodat(parentFd, name, mode, 0) < 0)
+        {
+            return -1;
+        }
+    }
+
+    tar_set_xattrs(ex, -1, parentFd, name, entry);
+    utimensat(parentFd, name, times, AT_SYMLINK_NOFOLLOW);
+    return 0;
+}
+
+static void tar_write_job(struct tar_extractor *ex, struct tar_job *job)
+{
+    int ret;
+    const struct tar_entry *entry = &job->entry;
+
+    tar_unlink(ex, job->dir->fd, job->name, entry);
+
+    if (entry->type == '2' || entry->type == '3' || entry->type == '4'
+        || entry->type == '6')
+    {
+        ret = tar_make_node(ex, job->dir->fd, job->name, entry);
+    }
+    else
+    {
+        const int fd = tar_open_file(job->dir->fd, job->name);
+        ret = fd;
+        if (fd >= 0)
+        {
+            if (tar_write_all(fd, (const char *)job->data, entry->size) < 0)
+                tar_error(ex, "%s: write %d", entry->path, errno);
+            ret = tar_finish_file(ex, fd, entry);
+            close(fd);
+        }
+    }
+
+    if (ret < 0)
+        tar_error(ex, "%s: %d", entry->path, errno);
+}
+
+static void *tar_worker(void *arg)
+{
+    struct tar_extractor *ex = arg;
+
+    pthread_mutex_lock(&ex->lock);
+    while (true)
+    {
+        while (!ex->stop && !ex->head)
+            pthread_cond_wait(&ex->ready, &ex->lock);
+        if (!ex->head)
+            break;
+
+        struct tar_job *job = ex->head;
+        ex->head = job->next;
+        if (!ex->head)
+            ex->tail = NULL;
+
+        int slot = 0;
+        while (ex->running[slot])
+            slot++;
+        ex->running[slot] = job;
+        pthread_mutex_unlock(&ex->lock);
+
+        tar_write_job(ex, job);
+        tar_dir_put(ex, job->dir);
+
+        pthread_mutex_lock(&ex->lock);
+        ex->running[slot] = NULL;
+        ex->jobCount--;
+        ex->jobBytes -= job->allocSize;
+        pthread_cond_broadcast(&ex->idle);
+        free(job);
+    }
+    pthread_mutex_unlock(&ex->lock);
+
+    return NULL;
+}
+
+// Copy entry with its data so parser can go on, returns 1 if not queued
+static int tar_queue(struct tar_extractor *ex, struct tar_stream *stream,
+    const struct tar_entry *entry, struct tar_dir *dir, const char *name)
+{
+    const size_t pathLen = strlen(entry->path) + 1;
+    const size_t nameLen = strlen(name) + 1;
+    const size_t linkLen = entry->type == '2' ? strlen(entry->linkPath) + 1 : 0;
+    const size_t dataLen = entry->type == '0' || entry->type == '\0'
+        || entry->type == '7' ? entry->size : 0;
+
+    size_t allocSize = sizeof (struct tar_job) + pathLen + nameLen + linkLen
+        + dataLen;
+    for (int i = 0; i < entry->xattrCount; i++)
+        allocSize += strlen(entry->xattrs[i].name) + 1 + entry->xattrs[i].len;
+
+    // Bound memory of entries waiting for workers
+    pthread_mutex_lock(&ex->lock);
+    while (ex->jobCount >= TAR_MAX_JOBS
+        || (ex->jobCount && ex->jobBytes + allocSize > TAR_JOB_MAX_BYTES))
+    {
+        pthread_cond_wait(&ex->idle, &ex->lock);
+    }
+    pthread_mutex_unlock(&ex->lock);
+
+    struct tar_job *job = malloc(allocSize);
+    if (!job)
+        return 1;
+
+    char *ptr = (char *)(job + 1);
+    job->next = NULL;
+    job->dir = dir;
+    job->allocSize = allocSize;
+    job->entry = *entry;
+    job->entry.path = memcpy(ptr, entry->path, pathLen);
+    ptr += pathLen;
+    job->name = memcpy(ptr, name, nameLen);
+    ptr += nameLen;
+    if (linkLen)
+    {
+        job->entry.linkPath = memcpy(ptr, entry->linkPath, linkLen);
+        ptr += linkLen;
+    }
+    for (int i = 0; i < entry->xattrCount; i++)
+    {
+        const size_t len = strlen(entry->xattrs[i].name) + 1;
+        job->entry.xattrs[i].name = memcpy(ptr, entry->xattrs[i].name, len);
+        ptr += len;
+        job->entry.xattrs[i].value = memcpy(ptr, entry->xattrs[i].value,
+            entry->xattrs[i].len);
+        ptr += entry->xattrs[i].len;
+    }
+    job->data = (unsigned char *)ptr;
+
+    if (tar_read(stream, ptr, dataLen) < 0)
+    {
+        free(job);
+        return -1;
+    }
+
+    pthread_mutex_lock(&ex->lock);
+    dir->refs++;
+    if (ex->tail)
+        ex->tail->next = job;
+    else
+        ex->head = job;
+    ex->tail = job;
+    ex->jobCount++;
+    ex->jobBytes += allocSize;
+    pthread_cond_signal(&ex->ready);
+    pthread_mutex_unlock(&ex->lock);
+    return 0;
+}
+
+static void tar_start_workers(struct tar_extractor *ex)
+{
+    long threads = config_long("extract.threads", sysconf(_SC_NPROCESSORS_ONLN));
+
+    if (threads > TAR_MAX_THREADS)
+        threads = TAR_MAX_THREADS;
+
+    pthread_mutex_init(&ex->lock, NULL);
+    pthread_cond_init(&ex->ready, NULL);
+    pthread_cond_init(&ex->idle, NULL);
+
+    // One CPU gains nothing from handing entries over
+    for (int i = 0; threads > 1 && i < threads; i++)
+    {
+        const int ret = pthread_create(&ex->workers[i], NULL, tar_worker, ex);
+        if (ret)
+        {
+            LOG_ERROR("pthread_create %d", ret);
+            break;
+        }
+        ex->threadCount++;
+    }
+}
+
+static void tar_stop_workers(struct tar_extractor *ex)
+{
+    pthread_mutex_lock(&ex->lock);
+    ex->stop = true;
+    pthread_cond_broadcast(&ex->ready);
+    pthread_mutex_unlock(&ex->lock);
+
+    for (int i = 0; i < ex->threadCount; i++)
+        pthread_join(ex->workers[i], NULL);
+
+    pthread_cond_destroy(&ex->idle);
+    pthread_cond_destroy(&ex->ready);
+    pthread_mutex_destroy(&ex->lock);
+}
+
+static void tar_defer_time(struct tar_extractor *ex, const char *path,
+    const struct tar_entry *entry)
+{
+    if (ex->dirTimeCount == ex->dirTimeSize)
+    {
+        const size_t size = ex->dirTimeSize ? ex->dirTimeSize * 2 : 256;
+        struct tar_dirtime *dirTimes = realloc(ex->dirTimes,
+            size * sizeof *dirTimes);
+        if (!dirTimes)
+            return;
+        ex->dirTimes = dirTimes;
+        ex->dirTimeSize = size;
+    }
+
+    struct tar_dirtime *dirTime = &ex->dirTimes[ex->dirTimeCount];
+    dirTime->path = strdup(path);
+    if (!dirTime->path)
+        return;
+    dirTime->times[0] = entry->atime;
+    dirTime->times[1] = entry->mtime;
+    ex->dirTimeCount++;
+}
+
+static void tar_apply_times(struct tar_extractor *ex)
+{
+    // Deepest directories last in archive, set their times first
+    while (ex->dirTimeCount)
+    {
+        struct tar_dirtime *dirTime = &ex->dirTimes[--ex->dirTimeCount];
+        const int fd = *dirTime->path
+            ? tar_openat(ex->rootFd, dirTime->path, O_RDONLY | O_DIRECTORY)
+            : dup(ex->rootFd);
+        if (fd >= 0)
+        {
+            futimens(fd, dirTime->times);
+            close(fd);
+        }
+        free(dirTime->path);
+    }
+
+    free(ex->dirTimes);
+    ex->dirTimes = NULL;
+    ex->dirTimeSize = 0;
+}
+
+static int tar_extract_entry(struct tar_extractor *ex,
+    struct tar_stream *stream, struct tar_entry *entry)
+{
+    int ret = 0;
+    int fd = -1;
+    bool writeFailed = false;
+    unsigned long long dataSize = entry->size;
+    const mode_t mode = entry->mode & 07777;
+
+    char *path = tar_sanitize(entry->path);
+    if (!path)
+    {
+        tar_error(ex, "%s: path contains '..'", entry->path);
+        goto skip;
+    }
+
+    // The top directory itself
+    if (!*path)
+    {
+        if (entry->type == '5')
+        {
+            fchown(ex->rootFd, entry->uid, entry->gid);
+            fchmod(ex->rootFd, mode);
+            tar_set_xattrs(ex, ex->rootFd, -1, NULL, entry);
+            tar_defer_time(ex, path, entry);
+        }
+        goto skip;
+    }
+
+    char *slash = strrchr(path, '/');
+    const char *name = path;
+    struct tar_dir *dir;
+    if (slash)
+    {
+        *slash = '\0';
+        dir = tar_parent(ex, path);
+        *slash = '/';
+        name = slash + 1;
+    }
+    else
+        dir = tar_parent(ex, ".");
+
+    if (!dir)
+    {
+        tar_error(ex, "%s: parent directory %d", entry->path, errno);
+        goto skip;
+    }
+
+    if (ex->threadCount && tar_busy(ex, dir, name))
+        tar_drain(ex);
+
+    // Parser creates directories so that parents exist before their entries
+    const bool node = entry->type == '2' || entry->type == '3'
+        || entry->type == '4' || entry->type == '6';
+    const bool file = entry->type == '0' || entry->type == '\0'
+        || entry->type == '7';
+    if (ex->threadCount && (node || (file && entry->size <= TAR_JOB_MAX_DATA)))
+    {
+        ret = tar_queue(ex, stream, entry, dir, name);
+        if (ret <= 0)
+        {
+            if (file)
+                dataSize = 0;
+            goto cleanup;
+        }
+        ret = 0;
+    }
+
+    if (entry->type != '5')
+        tar_unlink(ex, dir->fd, name, entry);
+
+    switch (entry->type)
+    {
+        case '0':
+        case '\0':
+        case '7':
+            fd = tar_open_file(dir->fd, name);
+            if (fd < 0)
+                break;
+
+            ret = tar_copy(stream, fd, entry->size, &writeFailed);
+            dataSize = 0;
+            if (ret < 0)
+                goto cleanup;
+            if (writeFailed)
+                tar_error(ex, "%s: write %d", entry->path, errno);
+
+            if (tar_finish_file(ex, fd, entry) < 0)
+                break;
+            goto cleanup;
+        case '1':
+        {
+            // Target may still be written by a worker
+            tar_drain(ex);
+
+            char *target = tar_sanitize(entry->linkPath);
+            if (!target)
+            {
+                errno = EPERM;
+                break;
+            }
+
+            char *targetSlash = strrchr(target, '/');
+            int targetFd;
+            const char *targetName = target;
+            if (targetSlash)
+            {
+                *targetSlash = '\0';
+                targetFd = tar_openat(ex->rootFd, target, O_PATH | O_DIRECTORY);
+                targetName = targetSlash + 1;
+            }
+            else
+                targetFd = dup(ex->rootFd);
+
+            ret = targetFd < 0 ? -1
+                : linkat(targetFd, targetName, dir->fd, name, 0);
+            if (targetFd >= 0)
+                close(targetFd);
+            free(target);
+            if (ret < 0)
+            {
+                ret = 0;
+                break;
+            }
+            goto cleanup;
+        }
+        case '2':
+        case '3':
+        case '4':
+        case '6':
+            if (tar_make_node(ex, dir->fd, name, entry) < 0)
+                break;
+            goto cleanup;
+        case '5':
+            if (mkdirat(dir->fd, name, 0700) < 0 && errno != EEXIST)
+                break;
+            fd = openat(dir->fd, name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0)
+                break;
+            if (fchown(fd, entry->uid, entry->gid) < 0 || fchmod(fd, mode) < 0)
+                break;
+            tar_set_xattrs(ex, fd, -1, NULL, entry);
+            tar_defer_time(ex, path, entry);
+            goto cleanup;
+        default:
+            tar_error(ex, "%s: unsupported entry type '%c'", entry->path,
+                entry->type);
+            goto skip;
+    }
+
+    tar_error(ex, "%s: %d", entry->path, errno);
+
+skip:
+    ret = tar_skip(stream, dataSize);
+    dataSize = 0;
+
+cleanup:
+    if (ret >= 0)
+        ret = tar_skip(stream, dataSize + tar_padding(entry->size));
+    if (fd >= 0)
+        close(fd);
+    free(path);
+    return ret;
+}
+
+int tar_extract(const int inFd, const char *dir, const int errFd)
+{
+    int ret = -1;
+    char *pax = NULL, *longName = NULL, *longLink = NULL;
+    const long long start = trace_now();
+
+    struct tar_stream stream = { 0 };
+    stream.fd = inFd;
+    stream.buf = malloc(TAR_BUFFER_SIZE);
+    if (!stream.buf)
+    {
+        LOG_ERROR("malloc %d", TAR_BUFFER_SIZE);
+        return -1;
+    }
+
+    struct tar_extractor ex = { 0 };
+    ex.errFd = errFd;
+    ex.rootFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ex.rootFd < 0)
+    {
+        LOG_ERROR("open(%s) %d", dir, errno);
+        free(stream.buf);
+        return -1;
+    }
+    tar_start_workers(&ex);
+
+    umask(0);
+    struct tar_entry entry = { 0 };
+    while (true)
+    {
+        if (tar_fill(&stream, TAR_BLOCK_SIZE) < 0)
+        {
+            tar_warn(errFd, "unexpected end of archive");
+            break;
+        }
+
+        struct tar_header *header = (void *)&stream.buf[stream.pos];
+        stream.pos += TAR_BLOCK_SIZE;
+
+        // Archive ends with zero blocks
+        if (!header->name[0] && !tar_number(header->chksum, sizeof header->chksum))
+        {
+            ret = 0;
+            break;
+        }
+
+        if (!tar_checksum(header))
+        {
+            tar_warn(errFd, "damaged tar header");
+            break;
+        }
+
+        const unsigned long long size = tar_number(header->size,
+            sizeof header->size);
+
+        // Extended headers describe the next entry
+        if (header->typeflag == 'x' || header->typeflag == 'L'
+            || header->typeflag == 'K')
+        {
+            char *data = tar_read_data(&stream, size);
+            if (!data)
+                break;
+
+            if (header->typeflag == 'x')
+            {
+                free(pax);
+                pax = data;
+                if (tar_parse_pax(pax, size, &entry) < 0)
+                    break;
+            }
+            else if (header->typeflag == 'L')
+            {
+                free(longName);
+                longName = data;
+            }
+            else
+            {
+                free(longLink);
+                longLink = data;
+            }
+            continue;
+        }
+
+        if (header->typeflag == 'g')
+        {
+            if (tar_skip(&stream, size + tar_padding(size)) < 0)
+                break;
+            continue;
+        }
+
+        // Values from extended headers are kept over ustar fields
+        char name[sizeof header->prefix + sizeof header->name + 2];
+        char linkName[sizeof header->linkname + 1];
+        if (!entry.path)
+        {
+            if (longName)
+                entry.path = longName;
+            else
+            {
+                if (header->prefix[0] && !memcmp(header->magic, "ustar", 5))
+                {
+                    snprintf(name, sizeof name, "%.*s/%.*s",
+                        (int)sizeof header->prefix, header->prefix,
+                        (int)sizeof header->name, header->name);
+                }
+                else
+                {
+                    snprintf(name, sizeof name, "%.*s",
+                        (int)sizeof header->name, header->name);
+                }
+                entry.path = name;
+            }
+        }
+
+        if (!entry.linkPath)
+        {
+            if (longLink)
+                entry.linkPath = longLink;
+            else
+            {
+                snprintf(linkName, sizeof linkName, "%.*s",
+                    (int)sizeof header->linkname, header->linkname);
+                entry.linkPath = linkName;
+            }
+        }
+
+        entry.type = header->typeflag;
+        entry.mode = tar_number(header->mode, sizeof header->mode);
+        if (!(entry.paxKeys & TAR_PAX_SIZE))
+            entry.size = size;
+        if (!(entry.paxKeys & TAR_PAX_UID))
+            entry.uid = tar_number(header->uid, sizeof header->uid);
+        if (!(entry.paxKeys & TAR_PAX_GID))
+            entry.gid = tar_number(header->gid, sizeof header->gid);
+        if (!(entry.paxKeys & TAR_PAX_MTIME))
+        {
+            entry.mtime.tv_sec = tar_number(header->mtime, sizeof header->mtime);
+            entry.mtime.tv_nsec = 0;
+        }
+        if (!(entry.paxKeys & TAR_PAX_ATIME))
+            entry.atime = entry.mtime;
+        entry.devMajor = tar_number(header->devmajor, sizeof header->devmajor);
+        entry.devMinor = tar_number(header->devminor, sizeof header->devminor);
+
+        // Directories may be stored as regular files with trailing slash
+        const size_t pathLen = strlen(entry.path);
+        if ((entry.type == '0' || entry.type == '\0') && pathLen
+            && entry.path[pathLen - 1] == '/')
+        {
+            entry.type = '5';
+        }
+
+        if (tar_extract_entry(&ex, &stream, &entry) < 0)
+            break;
+
+        free(pax);
+        free(longName);
+        free(longLink);
+        pax = longName = longLink = NULL;
+        memset(&entry, 0, sizeof entry);
+    }
+
+    // Workers change directory times too, so they are set after them
+    tar_stop_workers(&ex);
+    tar_apply_times(&ex);
+    tar_report("tar_extract", METRIC_IMPORT_BYTES, stream.total, start);
+
+    free(pax);
+    free(longName);
+    free(longLink);
+    free(ex.cachePath);
+    if (ex.cacheDir)
+    {
+        close(ex.cacheDir->fd);
+        free(ex.cacheDir);
+    }
+    close(ex.rootFd);
+    free(stream.buf);
+
+    if (!ret && ex.errors)
+    {
+        tar_warn(errFd, "error exit delayed from previous %d errors", ex.errors);
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Writer
+ */
+
+struct tar_hardlink
+{
+    dev_t dev;
+    ino_t ino;
+    char *path;
+};
+
+struct tar_writer
+{
+    int fd;
+    int errFd;
+    int errors;
+    dev_t rootDev;
+    char *buf;
+    size_t len;
+    unsigned long long total;
+    struct tar_hardlink *links;
+    size_t linkCount;
+    size_t linkSize;
+    char path[PATH_MAX];
+    char xattrNames[TAR_XATTR_SIZE];
+    char xattrValue[TAR_XATTR_SIZE];
+};
+
+static int tar_flush(struct tar_writer *wr)
+{
+    const int ret = tar_write_all(wr->fd, wr->buf, wr->len);
+    if (ret < 0)
+        LOG_ERROR("write %d", errno);
+
+    wr->total += wr->len;
+    wr->len = 0;
+    return ret;
+}
+
+static int tar_put(struct tar_writer *wr, const void *data, size_t len)
+{
+    const char *ptr = data;
+
+    while (len)
+    {
+        if (wr->len == TAR_BUFFER_SIZE && tar_flush(wr) < 0)
+            return -1;
+
+        size_t count = TAR_BUFFER_SIZE - wr->len;
+        if (count > len)
+            count = len;
+        if (ptr)
+        {
+            memcpy(&wr->buf[wr->len], ptr, count);
+            ptr += count;
+        }
+        else
+            memset(&wr->buf[wr->len], 0, count);
+        wr->len += count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+// Returns false if value does not fit in octal field
+static bool tar_octal(char *field, const size_t len,
+    const unsigned long long value)
+{
+    if (len < 12 && value >> (3 * (len - 1)))
+    {
+        snprintf(field, len, "%0*o", (int)len - 1, 0);
+        return false;
+    }
+
+    if (len >= 12 && value >> 33)
+    {
+        snprintf(field, len, "%0*o", (int)len - 1, 0);
+        return false;
+    }
+
+    snprintf(field, len, "%0*llo", (int)len - 1, value);
+    return true;
+}
+
+// Append "<length> <key>=<value>\n" where length counts itself
+static int tar_pax_record(char **pax, size_t *paxLen, const char *key,
+    const char *value, const size_t valueLen)
+{
+    const size_t baseLen = strlen(key) + valueLen + 3;
+    size_t recordLen = baseLen + 1;
+    for (size_t digits = 1; ; digits++)
+    {
+        recordLen = baseLen + digits;
+        char tmp[32];
+        if ((size_t)snprintf(tmp, sizeof tmp, "%zu", recordLen) == digits)
+            break;
+    }
+
+    char *data = realloc(*pax, *paxLen + recordLen + 1);
+    if (!data)
+        return -1;
+
+    int len = sprintf(&data[*paxLen], "%zu %s=", recordLen, key);
+    memcpy(&data[*paxLen + len], value, valueLen);
+    data[*paxLen + recordLen - 1] = '\n';
+    *pax = data;
+    *paxLen += recordLen;
+    return 0;
+}
+
+static int tar_put_header(struct tar_writer *wr, struct tar_header *header)
+{
+    unsigned long sum = 0;
+
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+    memset(header->chksum, ' ', sizeof header->chksum);
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += ((unsigned char *)header)[i];
+    snprintf(header->chksum, sizeof header->chksum, "%06lo", sum);
+
+    return tar_put(wr, header, TAR_BLOCK_SIZE);
+}
+
+// Fill name and prefix fields, false if the path needs pax header
+static bool tar_set_name(struct tar_header *header, const char *path)
+{
+    const size_t len = strlen(path);
+
+    if (len <= sizeof header->name)
+    {
+        memcpy(header->name, path, len);
+        return true;
+    }
+
+    const char *slash = path + len - sizeof header->name - 1;
+    while (*slash && *slash != '/')
+        slash++;
+    if (*slash == '/' && slash - path <= sizeof header->prefix && slash[1])
+    {
+        memcpy(header->prefix, path, slash - path);
+        memcpy(header->name, slash + 1, len - (slash - path) - 1);
+        return true;
+    }
+
+    memcpy(header->name, path, sizeof header->name);
+    return false;
+}
+
+static int tar_read_xattrs(struct tar_writer *wr, const int fd,
+    const char *procPath, char **pax, size_t *paxLen)
+{
+    const ssize_t namesLen = fd >= 0
+        ? flistxattr(fd, wr->xattrNames, sizeof wr->xattrNames)
+        : llistxattr(procPath, wr->xattrNames, sizeof wr->xattrNames);
+    if (namesLen <= 0)
+        return 0;
+
+    for (char *name = wr->xattrNames; name < wr->xattrNames + namesLen;
+        name += strlen(name) + 1)
+    {
+        const ssize_t valueLen = fd >= 0
+            ? fgetxattr(fd, name, wr->xattrValue, sizeof wr->xattrValue)
+            : lgetxattr(procPath, name, wr->xattrValue, sizeof wr->xattrValue);
+        if (valueLen < 0)
+            continue;
+
+        char key[sizeof TAR_SCHILY_XATTR + XATTR_NAME_MAX];
+        snprintf(key, sizeof key, TAR_SCHILY_XATTR "%.*s", XATTR_NAME_MAX, name);
+        if (tar_pax_record(pax, paxLen, key, wr->xattrValue, valueLen) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static const char *tar_find_link(struct tar_writer *wr, const struct stat *st)
+{
+    for (size_t i = 0; i < wr->linkCount; i++)
+    {
+        if (wr->links[i].dev == st->st_dev && wr->links[i].ino == st->st_ino)
+            return wr->links[i].path;
+    }
+
+    if (wr->linkCount == wr->linkSize)
+    {
+        const size_t size = wr->linkSize ? wr->linkSize * 2 : 256;
+        struct tar_hardlink *links = realloc(wr->links, size * sizeof *links);
+        if (!links)
+            return NULL;
+        wr->links = links;
+        wr->linkSize = size;
+    }
+
+    char *path = strdup(wr->path);
+    if (path)
+    {
+        wr->links[wr->linkCount].dev = st->st_dev;
+        wr->links[wr->linkCount].ino = st->st_ino;
+        wr->links[wr->linkCount].path = path;
+        wr->linkCount++;
+    }
+
+    return NULL;
+}
+
+static int tar_put_data(struct tar_writer *wr, const int fd,
+    const unsigned long long size)
+{
+    unsigned long long done = 0;
+
+    // Small files go through buffer, large ones are sent without copy
+    if (size <= TAR_BUFFER_SIZE - wr->len)
+    {
+        while (done < size)
+        {
+            const ssize_t ret = TEMP_FAILURE_RETRY(read(fd, &wr->buf[wr->len],
+                size - done));
+            if (ret <= 0)
+                break;
+            wr->len += ret;
+            done += ret;
+        }
+    }
+    else
+    {
+        if (tar_flush(wr) < 0)
+            return -1;
+
+        while (done < size)
+        {
+            const ssize_t ret = sendfile(wr->fd, fd, NULL, size - done);
+            if (ret <= 0)
+            {
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                break;
+            }
+            done += ret;
+            wr->total += ret;
+        }
+    }
+
+    // File shrank while reading, keep the archive consistent
+    if (done < size)
+    {
+        tar_warn(wr->errFd, "%s: file changed as we read it", wr->path);
+        wr->errors++;
+    }
+
+    return tar_put(wr, NULL, size - done + tar_padding(size));
+}
+
+static int tar_put_entry(struct tar_writer *wr, const int dirFd,
+    const char *name, const struct stat *st, const int fd)
+{
+    int ret;
+    char *pax = NULL;
+    size_t paxLen = 0;
+    char linkTarget[PATH_MAX];
+    struct tar_header header;
+    memset(&header, 0, sizeof header);
+
+    const size_t pathLen = strlen(wr->path);
+    if (S_ISDIR(st->st_mode) && pathLen + 1 < sizeof wr->path)
+        strcpy(&wr->path[pathLen], "/");
+
+    if (!tar_set_name(&header, wr->path))
+        tar_pax_record(&pax, &paxLen, "path", wr->path, strlen(wr->path));
+
+    unsigned long long size = 0;
+    const char *link = NULL;
+    if (S_ISREG(st->st_mode))
+    {
+        if (st->st_nlink > 1)
+            link = tar_find_link(wr, st);
+        if (link)
+            header.typeflag = '1';
+        else
+        {
+            header.typeflag = '0';
+            size = st->st_size;
+        }
+    }
+    else if (S_ISDIR(st->st_mode))
+        header.typeflag = '5';
+    else if (S_ISLNK(st->st_mode))
+    {
+        const ssize_t len = readlinkat(dirFd, name, linkTarget,
+            sizeof linkTarget - 1);
+        if (len < 0)
+        {
+            tar_warn(wr->errFd, "%s: readlink %d", wr->path, errno);
+            wr->errors++;
+            wr->path[pathLen] = '\0';
+            return 0;
+        }
+        linkTarget[len] = '\0';
+        link = linkTarget;
+        header.typeflag = '2';
+    }
+    else if (S_ISCHR(st->st_mode))
+        header.typeflag = '3';
+    else if (S_ISBLK(st->st_mode))
+        header.typeflag = '4';
+    else if (S_ISFIFO(st->st_mode))
+        header.typeflag = '6';
+    else
+    {
+        tar_warn(wr->errFd, "%s: socket ignored", wr->path);
+        wr->path[pathLen] = '\0';
+        return 0;
+    }
+
+    if (link)
+    {
+        const size_t linkLen = strlen(link);
+        if (linkLen > sizeof header.linkname)
+            tar_pax_record(&pax, &paxLen, "linkpath", link, linkLen);
+        memcpy(header.linkname, link,
+            linkLen < sizeof header.linkname ? linkLen : sizeof header.linkname);
+    }
+
+    char number[32];
+    tar_octal(header.mode, sizeof header.mode, st->st_mode & 07777);
+    if (!tar_octal(header.uid, sizeof header.uid, st->st_uid))
+    {
+        snprintf(number, sizeof number, "%u", st->st_uid);
+        tar_pax_record(&pax, &paxLen, "uid", number, strlen(number));
+    }
+    if (!tar_octal(header.gid, sizeof header.gid, st->st_gid))
+    {
+        snprintf(number, sizeof number, "%u", st->st_gid);
+        tar_pax_record(&pax, &paxLen, "gid", number, strlen(number));
+    }
+    if (!tar_octal(header.size, sizeof header.size, size))
+    {
+        snprintf(number, sizeof number, "%llu", size);
+        tar_pax_record(&pax, &paxLen, "size", number, strlen(number));
+    }
+    if (st->st_mtim.tv_sec < 0
+        || !tar_octal(header.mtime, sizeof header.mtime, st->st_mtim.tv_sec))
+    {
+        snprintf(number, sizeof number, "%lld", (long long)st->st_mtim.tv_sec);
+        tar_pax_record(&pax, &paxLen, "mtime", number, strlen(number));
+    }
+    if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))
+    {
+        tar_octal(header.devmajor, sizeof header.devmajor, major(st->st_rdev));
+        tar_octal(header.devminor, sizeof header.devminor, minor(st->st_rdev));
+    }
+
+    if (header.typeflag != '1')
+    {
+        char procPath[64 + NAME_MAX];
+        snprintf(procPath, sizeof procPath, "/proc/self/fd/%d/%s", dirFd, name);
+        if (tar_read_xattrs(wr, fd, procPath, &pax, &paxLen) < 0)
+            LOG_ERROR("%s: xattrs", wr->path);
+    }
+
+    ret = 0;
+    if (pax)
+    {
+        struct tar_header paxHeader;
+        memset(&paxHeader, 0, sizeof paxHeader);
+        snprintf(paxHeader.name, sizeof paxHeader.name, "./PaxHeaders/%.80s", name);
+        paxHeader.typeflag = 'x';
+        tar_octal(paxHeader.mode, sizeof paxHeader.mode, 0644);
+        tar_octal(paxHeader.uid, sizeof paxHeader.uid, 0);
+        tar_octal(paxHeader.gid, sizeof paxHeader.gid, 0);
+        tar_octal(paxHeader.size, sizeof paxHeader.size, paxLen);
+        memcpy(paxHeader.mtime, header.mtime, sizeof header.mtime);
+
+        ret = tar_put_header(wr, &paxHeader);
+        if (ret >= 0)
+            ret = tar_put(wr, pax, paxLen);
+        if (ret >= 0)
+            ret = tar_put(wr, NULL, tar_padding(paxLen));
+        free(pax);
+    }
+
+    if (ret >= 0)
+        ret = tar_put_header(wr, &header);
+    if (ret >= 0 && size)
+        ret = tar_put_data(wr, fd, size);
+
+    wr->path[pathLen] = '\0';
+    return ret;
+}
+
+static int tar_walk(struct tar_writer *wr, const int dirFd)
+{
+    int ret = 0;
+
+    const int fd = dup(dirFd);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir)
+    {
+        tar_warn(wr->errFd, "%s: opendir %d", wr->path, errno);
+        wr->errors++;
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+
+    const size_t pathLen = strlen(wr->path);
+    struct dirent *dent;
+    while (ret >= 0 && (dent = readdir(dir)))
+    {
+        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+            continue;
+
+        if (pathLen + strlen(dent->d_name) + 3 > sizeof wr->path)
+        {
+            tar_warn(wr->errFd, "%s/%s: path too long", wr->path, dent->d_name);
+            wr->errors++;
+            continue;
+        }
+        sprintf(&wr->path[pathLen], "/%s", dent->d_name);
+
+        struct stat st;
+        if (fstatat(dirFd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+            tar_warn(wr->errFd, "%s: stat %d", wr->path, errno);
+            wr->errors++;
+            wr->path[pathLen] = '\0';
+            continue;
+        }
+
+        int entryFd = -1;
+        if (S_ISDIR(st.st_mode))
+            entryFd = openat(dirFd, dent->d_name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        else if (S_ISREG(st.st_mode))
+            entryFd = openat(dirFd, dent->d_name,
+                O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+        if (entryFd < 0 && errno == EPERM && S_ISREG(st.st_mode))
+            entryFd = openat(dirFd, dent->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+        if (entryFd < 0 && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+        {
+            tar_warn(wr->errFd, "%s: open %d", wr->path, errno);
+            wr->errors++;
+            wr->path[pathLen] = '\0';
+            continue;
+        }
+
+        ret = tar_put_entry(wr, dirFd, dent->d_name, &st, entryFd);
+
+        // Do not cross mount points like --one-file-system
+        if (ret >= 0 && S_ISDIR(st.st_mode) && st.st_dev == wr->rootDev)
+            ret = tar_walk(wr, entryFd);
+
+        if (entryFd >= 0)
+            close(entryFd);
+        wr->path[pathLen] = '\0';
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+int tar_create(const int outFd, const char *dir, const int errFd)
+{
+    int ret;
+    const long long start = trace_now();
+
+    struct tar_writer *wr = calloc(1, sizeof *wr);
+    if (!wr)
+    {
+        LOG_ERROR("calloc %zu", sizeof *wr);
+        return -1;
+    }
+
+    wr->fd = outFd;
+    wr->errFd = errFd;
+    wr->buf = malloc(TAR_BUFFER_SIZE);
+    const int rootFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (!wr->buf || rootFd < 0 || fstat(rootFd, &st) < 0)
+    {
+        LOG_ERROR("open(%s) %d", dir, errno);
+        if (rootFd >= 0)
+            close(rootFd);
+        free(wr->buf);
+        free(wr);
+        return -1;
+    }
+
+    // Same layout as bsdtar -C dir -c .
+    wr->rootDev = st.st_dev;
+    strcpy(wr->path, ".");
+    ret = tar_put_entry(wr, rootFd, ".", &st, rootFd);
+    if (ret >= 0)
+        ret = tar_walk(wr, rootFd);
+
+    // End of archive, padded to a whole record
+    if (ret >= 0)
+    {
+        const unsigned long long written = wr->total + wr->len
+            + 2 * TAR_BLOCK_SIZE;
+        ret = tar_put(wr, NULL, 2 * TAR_BLOCK_SIZE
+            + (TAR_RECORD_SIZE - written % TAR_RECORD_SIZE) % TAR_RECORD_SIZE);
+    }
+    if (ret >= 0)
+        ret = tar_flush(wr);
+
+    tar_report("tar_create", METRIC_EXPORT_BYTES, wr->total, start);
+
+    if (ret >= 0 && wr->errors)
+    {
+        tar_warn(errFd, "error exit delayed from previous %d errors", wr->errors);
+        ret = -1;
+    }
+
+    for (size_t i = 0; i < wr->linkCount; i++)
+        free(wr->links[i].path);
+    free(wr->links);
+    close(rootFd);
+    free(wr->buf);
+    free(wr);
+    return ret;
+}
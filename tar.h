@@ -0,0 +1,12 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// tar.h: functions for streaming distributions in tar format
+
+#ifndef INITRD_TAR_H
+#define INITRD_TAR_H
+
+int tar_extract(const int inFd, const char *dir, const int errFd);
+int tar_create(const int outFd, const char *dir, const int errFd);
+
+#endif // INITRD_TAR_H
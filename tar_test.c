@@ -0,0 +1,314 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// tar_test.c: round trip of pax values and worker ordering of tar_extract
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "tar.h"
+
+#define TEST_UID 3000000
+#define TEST_GID 3000001
+#define TEST_MTIME_SEC 1700000000
+#define TEST_MTIME_NSEC 123456789
+#define TEST_ATIME_SEC 1600000000
+#define TEST_ATIME_NSEC 987654321
+#define TEST_DATA "hello\n"
+#define TEST_FILES 1000
+#define TEST_THREADS "8"
+
+struct test_create
+{
+    int fd;
+    const char *dir;
+    int ret;
+};
+
+static int g_failed = 0;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            g_failed = 1; \
+        } \
+    } while (0)
+
+static void test_header(char *block, const char *name, const char type,
+    const unsigned long size, const unsigned long uid, const unsigned long mtime,
+    const char *link)
+{
+    unsigned long sum = 0;
+
+    memset(block, 0, 512);
+    snprintf(block, 100, "%s", name);
+    snprintf(block + 100, 8, "%07o", type == '5' ? 0755 : 0644);
+    snprintf(block + 108, 8, "%07lo", uid);
+    snprintf(block + 116, 8, "%07lo", uid);
+    snprintf(block + 124, 12, "%011lo", size);
+    snprintf(block + 136, 12, "%011lo", mtime);
+    block[156] = type;
+    if (link)
+        snprintf(block + 157, 100, "%s", link);
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+
+    memset(block + 148, ' ', 8);
+    for (int i = 0; i < 512; i++)
+        sum += (unsigned char)block[i];
+    snprintf(block + 148, 8, "%06lo", sum);
+}
+
+// Header and data of one entry padded to blocks
+static size_t test_entry(char *buf, const char *name, const char type,
+    const char *link, const char *data)
+{
+    const size_t size = data ? strlen(data) : 0;
+    const size_t padded = (size + 511) & ~511UL;
+
+    test_header(buf, name, type, size, 0, TEST_MTIME_SEC, link);
+    memset(buf + 512, 0, padded);
+    if (size)
+        memcpy(buf + 512, data, size);
+    return 512 + padded;
+}
+
+static size_t test_record(char *buf, const char *key, const char *value)
+{
+    // Length counts its own digits, two digit lengths are enough here
+    const size_t len = strlen(key) + strlen(value) + 3 + 2;
+    return sprintf(buf, "%zu %s=%s\n", len, key, value);
+}
+
+// Archive like GNU tar --format=posix makes, ustar fields do not fit or lose
+static size_t test_archive(char *buf)
+{
+    char pax[512], value[32];
+    size_t paxLen = 0, len = 0;
+
+    snprintf(value, sizeof value, "%d", TEST_UID);
+    paxLen += test_record(&pax[paxLen], "uid", value);
+    snprintf(value, sizeof value, "%d", TEST_GID);
+    paxLen += test_record(&pax[paxLen], "gid", value);
+    snprintf(value, sizeof value, "%d.%09d", TEST_MTIME_SEC, TEST_MTIME_NSEC);
+    paxLen += test_record(&pax[paxLen], "mtime", value);
+    snprintf(value, sizeof value, "%d.%09d", TEST_ATIME_SEC, TEST_ATIME_NSEC);
+    paxLen += test_record(&pax[paxLen], "atime", value);
+
+    test_header(&buf[len], "PaxHeaders/file", 'x', paxLen, 0, 0, NULL);
+    len += 512;
+    memset(&buf[len], 0, 512);
+    memcpy(&buf[len], pax, paxLen);
+    len += 512;
+
+    len += test_entry(&buf[len], "file", '0', NULL, TEST_DATA);
+    memset(&buf[len], 0, 1024);
+    return len + 1024;
+}
+
+// Same paths come back under other parents in between, as in a/x b/y a/x,
+// and are reached again through a hardlink and a symlinked parent
+static size_t test_workers_archive(char *buf)
+{
+    char name[32], data[32];
+    size_t len = 0;
+
+    len += test_entry(&buf[len], "a/", '5', NULL, NULL);
+    len += test_entry(&buf[len], "b/", '5', NULL, NULL);
+    len += test_entry(&buf[len], "l", '2', "a", NULL);
+
+    for (int i = 0; i < TEST_FILES; i++)
+    {
+        snprintf(name, sizeof name, "a/f%d", i);
+        snprintf(data, sizeof data, "old %d\n", i);
+        len += test_entry(&buf[len], name, '0', NULL, data);
+
+        snprintf(name, sizeof name, "b/g%d", i);
+        len += test_entry(&buf[len], name, '0', NULL, data);
+
+        snprintf(name, sizeof name, "a/f%d", i);
+        snprintf(data, sizeof data, "new %d\n", i);
+        len += test_entry(&buf[len], name, '0', NULL, data);
+    }
+
+    len += test_entry(&buf[len], "a/h", '1', "a/f0", NULL);
+    len += test_entry(&buf[len], "a/s", '0', NULL, "parent\n");
+    len += test_entry(&buf[len], "l/s", '0', NULL, "symlink\n");
+
+    memset(&buf[len], 0, 1024);
+    return len + 1024;
+}
+
+// Archive goes through a file as it may not fit in a pipe
+static int test_extract(const char *data, const size_t len, const char *dir)
+{
+    char path[] = "/tmp/tar_test_archiveXXXXXX";
+
+    const int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+
+    if (write(fd, data, len) != len || lseek(fd, 0, SEEK_SET) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    const int ret = tar_extract(fd, dir, STDERR_FILENO);
+    close(fd);
+    return ret;
+}
+
+static void *test_create_thread(void *arg)
+{
+    struct test_create *create = arg;
+
+    create->ret = tar_create(create->fd, create->dir, STDERR_FILENO);
+    close(create->fd);
+    return NULL;
+}
+
+// Archive of srcDir made by tar_create is extracted to dstDir
+static int test_round_trip(const char *srcDir, const char *dstDir)
+{
+    int fds[2];
+    pthread_t thread;
+
+    if (pipe(fds) < 0)
+        return -1;
+
+    struct test_create create = { fds[1], srcDir, -1 };
+    if (pthread_create(&thread, NULL, test_create_thread, &create))
+        return -1;
+
+    const int ret = tar_extract(fds[0], dstDir, STDERR_FILENO);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    return ret < 0 || create.ret < 0 ? -1 : 0;
+}
+
+static bool test_content(const char *dir, const char *name, const char *data)
+{
+    char path[128], buf[64];
+
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    const ssize_t len = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (len < 0)
+        return false;
+
+    buf[len] = '\0';
+    return !strcmp(buf, data);
+}
+
+static void test_pax(const char *first, const char *second)
+{
+    static char archive[4096];
+    char path[96];
+    struct stat st;
+
+    const size_t len = test_archive(archive);
+    CHECK(test_extract(archive, len, first) == 0);
+
+    snprintf(path, sizeof path, "%s/file", first);
+    CHECK(lstat(path, &st) == 0);
+    CHECK(st.st_uid == TEST_UID);
+    CHECK(st.st_gid == TEST_GID);
+    CHECK(st.st_mtim.tv_sec == TEST_MTIME_SEC);
+    CHECK(st.st_mtim.tv_nsec == TEST_MTIME_NSEC);
+    CHECK(st.st_atim.tv_sec == TEST_ATIME_SEC);
+    CHECK(st.st_atim.tv_nsec == TEST_ATIME_NSEC);
+    CHECK(st.st_size == strlen(TEST_DATA));
+
+    // Large ids only fit in pax records written by tar_create
+    CHECK(test_round_trip(first, second) == 0);
+    snprintf(path, sizeof path, "%s/file", second);
+    CHECK(lstat(path, &st) == 0);
+    CHECK(st.st_uid == TEST_UID);
+    CHECK(st.st_gid == TEST_GID);
+    CHECK(st.st_mtim.tv_sec == TEST_MTIME_SEC);
+    CHECK(st.st_size == strlen(TEST_DATA));
+}
+
+static void test_workers(const char *dir)
+{
+    char name[32], data[32], path[96], linkPath[96];
+    struct stat st, linkSt;
+
+    // Archive has 3 blocks for each of 3 entries per file and a few more
+    const size_t size = (TEST_FILES * 3 + 16) * 1024;
+    char *archive = malloc(size);
+    if (!archive)
+    {
+        g_failed = 1;
+        return;
+    }
+
+    config_set("extract.threads", TEST_THREADS);
+    const size_t len = test_workers_archive(archive);
+    CHECK(test_extract(archive, len, dir) == 0);
+    free(archive);
+
+    int stale = 0;
+    for (int i = 0; i < TEST_FILES; i++)
+    {
+        snprintf(name, sizeof name, "a/f%d", i);
+        snprintf(data, sizeof data, "new %d\n", i);
+        stale += !test_content(dir, name, data);
+    }
+    CHECK(stale == 0);
+
+    snprintf(path, sizeof path, "%s/a/f0", dir);
+    snprintf(linkPath, sizeof linkPath, "%s/a/h", dir);
+    CHECK(stat(path, &st) == 0 && stat(linkPath, &linkSt) == 0
+        && st.st_ino == linkSt.st_ino);
+    CHECK(test_content(dir, "a/h", "new 0\n"));
+    CHECK(test_content(dir, "a/s", "symlink\n"));
+}
+
+int main(void)
+{
+    char root[] = "/tmp/tar_testXXXXXX";
+    char first[64], second[64], third[64];
+
+    if (geteuid())
+    {
+        printf("tar_test: skipped, needs root for uid %d\n", TEST_UID);
+        return 0;
+    }
+
+    if (!mkdtemp(root))
+        return 1;
+    snprintf(first, sizeof first, "%s/first", root);
+    snprintf(second, sizeof second, "%s/second", root);
+    snprintf(third, sizeof third, "%s/third", root);
+    mkdir(first, 0755);
+    mkdir(second, 0755);
+    mkdir(third, 0755);
+
+    test_pax(first, second);
+    test_workers(third);
+
+    char command[128];
+    snprintf(command, sizeof command, "rm -rf %s", root);
+    if (system(command))
+        g_failed = 1;
+
+    printf("tar_test: %s\n", g_failed ? "FAILED" : "passed");
+    return g_failed;
+}
@@ -0,0 +1,157 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// trace.c: functions for recording boot timeline in Chrome trace format
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "fs.h"
+#include "trace.h"
+#include "util.h"
+
+#define TRACE_MAX_PENDING 64
+#define TRACE_LINE_SIZE 256
+
+enum trace_output
+{
+    TRACE_PENDING = 0,
+    TRACE_OFF = 1,
+    TRACE_SHARE = 2,
+    TRACE_KMSG = 3
+};
+
+// Events recorded before boot config is read
+struct trace_entry
+{
+    const char *cat;
+    const char *name;
+    long long start;
+    long long dur;
+    long value;
+    int pid;
+    int tid;
+};
+
+static pthread_mutex_t g_traceLock = PTHREAD_MUTEX_INITIALIZER;
+static enum trace_output g_traceOutput = TRACE_PENDING;
+static int g_traceFd = -1;
+static struct trace_entry g_pending[TRACE_MAX_PENDING];
+static int g_pendingCount = 0;
+
+long long trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// getpid() is 1 in every distro PID namespace, /proc shows the real one
+static int trace_pid(void)
+{
+    char buf[16];
+
+    const ssize_t ret = readlink("/proc/self", buf, sizeof buf - 1);
+    if (ret <= 0)
+        return getpid();
+
+    buf[ret] = '\0';
+    return atoi(buf);
+}
+
+static void trace_write(const struct trace_entry *entry)
+{
+    char line[TRACE_LINE_SIZE];
+
+    // Trailing comma and missing ] are allowed by Chrome trace format
+    const int len = snprintf(line, sizeof line,
+        "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,"
+        "\"dur\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{\"value\":%ld}},\n",
+        g_traceOutput == TRACE_KMSG ? "<6>initrd-trace: " : "",
+        entry->name, entry->cat, entry->start, entry->dur,
+        entry->pid, entry->tid, entry->value);
+    if (len <= 0 || len >= sizeof line)
+        return;
+
+    // One write per event keeps lines whole from several processes
+    if (write(g_traceFd, line, len) < 0)
+        LOG_ERROR("write %d", errno);
+}
+
+void trace_event(const char *cat, const char *name, const long long start,
+    const long value)
+{
+    if (g_traceOutput == TRACE_OFF)
+        return;
+
+    struct trace_entry entry;
+    entry.cat = cat;
+    entry.name = name;
+    entry.start = start;
+    entry.dur = trace_now() - start;
+    entry.value = value;
+    entry.pid = trace_pid();
+    entry.tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&g_traceLock);
+    if (g_traceOutput == TRACE_PENDING)
+    {
+        if (g_pendingCount < TRACE_MAX_PENDING)
+            g_pending[g_pendingCount++] = entry;
+    }
+    else if (g_traceOutput != TRACE_OFF)
+        trace_write(&entry);
+    pthread_mutex_unlock(&g_traceLock);
+}
+
+int trace_open(void)
+{
+    int ret = 0;
+    const char *output = config_get("trace", "off");
+
+    pthread_mutex_lock(&g_traceLock);
+    if (!strcmp(output, "share") || !strcmp(output, "1"))
+    {
+        g_traceFd = open(TRACE_FILE,
+            O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (g_traceFd < 0)
+        {
+            LOG_ERROR("open(%s) %d", TRACE_FILE, errno);
+            ret = g_traceFd;
+            g_traceOutput = TRACE_OFF;
+        }
+        else
+        {
+            if (write(g_traceFd, "[\n", 2) < 0)
+                LOG_ERROR("write(%s) %d", TRACE_FILE, errno);
+            g_traceOutput = TRACE_SHARE;
+        }
+    }
+    else if (!strcmp(output, "kmsg"))
+    {
+        g_traceFd = g_kmsgFd;
+        g_traceOutput = TRACE_KMSG;
+    }
+    else
+        g_traceOutput = TRACE_OFF;
+
+    if (g_traceOutput != TRACE_OFF)
+    {
+        for (int i = 0; i < g_pendingCount; i++)
+            trace_write(&g_pending[i]);
+    }
+    g_pendingCount = 0;
+    pthread_mutex_unlock(&g_traceLock);
+
+    return ret;
+}
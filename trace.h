@@ -0,0 +1,16 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// trace.h: functions for recording boot timeline in Chrome trace format
+
+#ifndef INITRD_TRACE_H
+#define INITRD_TRACE_H
+
+#define TRACE_FILE "/share/initrd-trace.json"
+
+long long trace_now(void);
+void trace_event(const char *cat, const char *name, const long long start,
+    const long value);
+int trace_open(void);
+
+#endif // INITRD_TRACE_H
@@ -0,0 +1,280 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// trim.c: functions for trimming distro disks when the VM is idle
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "child.h"
+#include "config.h"
+#include "event.h"
+#include "trace.h"
+#include "trim.h"
+#include "util.h"
+
+#define TRIM_PSI_FILE "/proc/pressure/io"
+
+struct trim_entry
+{
+    struct trim_entry *next;
+    dev_t dev;
+    int fd;
+    int refs;
+    bool failed;
+    unsigned long long cursor;
+    unsigned long long trimmed;
+};
+
+static struct trim_entry *g_trims = NULL;
+static int g_trimTimer = -1;
+static int g_trimPipe = -1;
+
+// Tasks waited for I/O less than initrd.trim.idle percent in last 10 seconds
+static bool trim_idle(void)
+{
+    double avg10;
+
+    FILE *file = fopen(TRIM_PSI_FILE, "re");
+    if (!file)
+    {
+        LOG_ERROR("fopen(%s) %d", TRIM_PSI_FILE, errno);
+        return false;
+    }
+
+    const int count = fscanf(file, "some avg10=%lf", &avg10);
+    fclose(file);
+
+    return count == 1 && avg10 < config_long("trim.idle", 1);
+}
+
+// Where a worker left a file system, sent back to PID 1 over a pipe
+struct trim_result
+{
+    dev_t dev;
+    bool failed;
+    unsigned long long cursor;
+    unsigned long long trimmed;
+};
+
+// One chunk of each file system, free space is trimmed from start
+static void trim_worker(const int resultFd)
+{
+    const unsigned long long chunk = config_long("trim.chunk", 256) << 20;
+
+    for (struct trim_entry *entry = g_trims; entry; entry = entry->next)
+    {
+        if (entry->failed)
+            continue;
+
+        if (!trim_idle())
+            break;
+
+        struct trim_result result = { entry->dev, false, entry->cursor,
+            entry->trimmed };
+        const long long start = trace_now();
+        struct fstrim_range range = { .start = entry->cursor, .len = chunk };
+        const int ret = ioctl(entry->fd, FITRIM, &range);
+        trace_event("disk", "fitrim", start, ret);
+
+        // Start past the last block group ends the pass
+        if (ret < 0 && errno == EINVAL && entry->cursor)
+        {
+            LOG_INFO("trim of %u:%u freed %llu bytes", major(entry->dev),
+                minor(entry->dev), entry->trimmed);
+            result.cursor = result.trimmed = 0;
+        }
+        else if (ret < 0)
+        {
+            // Disk without discard support, stop trying until it is remounted
+            LOG_ERROR("FITRIM(%u:%u) %d", major(entry->dev),
+                minor(entry->dev), errno);
+            result.failed = true;
+        }
+        else
+        {
+            result.trimmed += range.len;
+            result.cursor += chunk;
+        }
+
+        if (TEMP_FAILURE_RETRY(write(resultFd, &result, sizeof result)) < 0)
+            LOG_ERROR("write %d", errno);
+    }
+}
+
+// The distro may have exited while its disk was trimmed
+static void trim_apply(const struct trim_result *result)
+{
+    for (struct trim_entry *entry = g_trims; entry; entry = entry->next)
+    {
+        if (entry->dev == result->dev)
+        {
+            entry->failed = result->failed;
+            entry->cursor = result->cursor;
+            entry->trimmed = result->trimmed;
+            break;
+        }
+    }
+}
+
+static int on_trim_result(const int fd, const unsigned int events, void *ctx)
+{
+    struct trim_result result;
+    ssize_t ret;
+
+    while ((ret = TEMP_FAILURE_RETRY(read(fd, &result, sizeof result)))
+        == sizeof result)
+    {
+        trim_apply(&result);
+    }
+
+    // Write end may live on in children forked meanwhile, reaping ends the pass
+    if (!ret)
+        event_del(fd);
+    return 0;
+}
+
+static void on_trim_done(const int status, void *ctx)
+{
+    if (g_trimPipe < 0)
+        return;
+
+    on_trim_result(g_trimPipe, 0, NULL);
+    event_del(g_trimPipe);
+    close(g_trimPipe);
+    g_trimPipe = -1;
+}
+
+// FITRIM blocks until the disk discards, so it runs in a reaped child
+static int on_trim(const int fd, const unsigned int events, void *ctx)
+{
+    int fds[2];
+
+    if (g_trimPipe >= 0)
+        return 0;
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        LOG_ERROR("pipe2 %d", errno);
+        return 0;
+    }
+
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        LOG_ERROR("fork %d", errno);
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    if (!pid)
+    {
+        child_init();
+        close(fds[0]);
+        trim_worker(fds[1]);
+        exit(0);
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    g_trimPipe = fds[0];
+    if (child_track_internal(pid, on_trim_done, NULL) < 0
+        || event_add(fds[0], EPOLLIN, on_trim_result, NULL) < 0)
+    {
+        on_trim_done(0, NULL);
+    }
+
+    return 0;
+}
+
+// Track an ext4 mount of a distro until all distros using it exit
+int trim_add(const int mountFd)
+{
+    struct stat st;
+    struct statfs stfs;
+
+    const long interval = config_long("trim.interval", 30);
+    if (interval <= 0)
+        return 0;
+
+    if (fstat(mountFd, &st) < 0 || fstatfs(mountFd, &stfs) < 0)
+    {
+        LOG_ERROR("fstat %d", errno);
+        return -1;
+    }
+
+    if (stfs.f_type != EXT4_SUPER_MAGIC)
+        return 0;
+
+    for (struct trim_entry *entry = g_trims; entry; entry = entry->next)
+    {
+        if (entry->dev == st.st_dev)
+        {
+            entry->refs++;
+            return 0;
+        }
+    }
+
+    struct trim_entry *entry = calloc(1, sizeof *entry);
+    if (!entry)
+    {
+        LOG_ERROR("calloc %d", errno);
+        return -1;
+    }
+
+    entry->fd = fcntl(mountFd, F_DUPFD_CLOEXEC, 0);
+    if (entry->fd < 0)
+    {
+        LOG_ERROR("fcntl %d", errno);
+        free(entry);
+        return -1;
+    }
+
+    entry->dev = st.st_dev;
+    entry->refs = 1;
+    entry->next = g_trims;
+    g_trims = entry;
+
+    if (g_trimTimer < 0)
+        g_trimTimer = event_timer(interval * 1000L, true, on_trim, NULL);
+    return 0;
+}
+
+void trim_remove(const dev_t dev)
+{
+    for (struct trim_entry **entry = &g_trims; *entry;
+        entry = &(*entry)->next)
+    {
+        if ((*entry)->dev != dev)
+            continue;
+
+        struct trim_entry *found = *entry;
+        if (--found->refs)
+            return;
+
+        // Host detaches the disk after exit, keep no reference to it
+        *entry = found->next;
+        close(found->fd);
+        free(found);
+        break;
+    }
+
+    if (!g_trims && g_trimTimer >= 0)
+    {
+        event_del(g_trimTimer);
+        close(g_trimTimer);
+        g_trimTimer = -1;
+    }
+}
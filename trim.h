@@ -0,0 +1,14 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// trim.h: functions for trimming distro disks when the VM is idle
+
+#ifndef INITRD_TRIM_H
+#define INITRD_TRIM_H
+
+#include <sys/types.h>
+
+int trim_add(const int mountFd);
+void trim_remove(const dev_t dev);
+
+#endif // INITRD_TRIM_H
@@ -0,0 +1,223 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// uevent.c: functions for listening kernel uevents of block devices
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+
+#include "fs.h"
+#include "uevent.h"
+#include "util.h"
+
+#define UEVENT_BUFFER_SIZE 0x2000
+#define UEVENT_MAX_DEVICES 64
+#define UEVENT_NAME_SIZE 32
+
+// SCSI address e.g. 0:0:0:1 to block device name e.g. sdb
+struct uevent_device
+{
+    char scsiAddr[UEVENT_NAME_SIZE];
+    char devName[UEVENT_NAME_SIZE];
+};
+
+static struct uevent_device g_devices[UEVENT_MAX_DEVICES];
+static int g_deviceNext = 0;
+static bool g_eventLost = false;
+
+// Get the SCSI address from paths like /sys/bus/scsi/devices/0:0:0:1/block
+static bool uevent_scsi_addr(const char *path, const size_t len,
+    char *addr)
+{
+    const char *end = path + len;
+    while (end > path && end[-1] == '/')
+        end--;
+
+    if (end - path >= 6 && !strncmp(end - 6, "/block", 6))
+        end -= 6;
+
+    const char *start = end;
+    while (start > path && start[-1] != '/')
+        start--;
+
+    if (start == end || end - start >= UEVENT_NAME_SIZE)
+        return false;
+
+    memcpy(addr, start, end - start);
+    addr[end - start] = '\0';
+    return true;
+}
+
+int uevent_open(void)
+{
+    int ret;
+
+    const int fd = socket(AF_NETLINK,
+        SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+    {
+        LOG_ERROR("socket %d", errno);
+        return fd;
+    }
+
+    // Do not lose events when several disks are attached at once
+    const int size = 0x100000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size);
+
+    struct sockaddr_nl addr = { 0 };
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof addr);
+    if (ret < 0)
+    {
+        LOG_ERROR("bind %d", errno);
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+static void uevent_parse(const char *buf, const size_t len)
+{
+    bool add = false, remove = false, disk = false;
+    const char *devPath = NULL, *devName = NULL;
+
+    for (const char *ptr = buf; ptr < buf + len; ptr += strlen(ptr) + 1)
+    {
+        if (!strcmp(ptr, "ACTION=add"))
+            add = true;
+        else if (!strcmp(ptr, "ACTION=remove"))
+            remove = true;
+        else if (!strcmp(ptr, "DEVTYPE=disk"))
+            disk = true;
+        else if (!strncmp(ptr, "DEVPATH=", 8))
+            devPath = ptr + 8;
+        else if (!strncmp(ptr, "DEVNAME=", 8))
+            devName = ptr + 8;
+    }
+
+    if (!(add || remove) || !disk || !devPath || !devName
+        || strlen(devName) >= UEVENT_NAME_SIZE)
+    {
+        return;
+    }
+
+    // DEVPATH looks like /devices/.../0:0:0:1/block/sdb
+    const char *block = strstr(devPath, "/block/");
+    char scsiAddr[UEVENT_NAME_SIZE];
+    if (!block || !uevent_scsi_addr(devPath, block - devPath, scsiAddr))
+        return;
+
+    for (int i = 0; i < UEVENT_MAX_DEVICES; i++)
+    {
+        if (!strcmp(g_devices[i].scsiAddr, scsiAddr))
+            memset(&g_devices[i], 0, sizeof g_devices[i]);
+    }
+
+    if (add)
+    {
+        struct uevent_device *dev = &g_devices[g_deviceNext];
+        g_deviceNext = (g_deviceNext + 1) % UEVENT_MAX_DEVICES;
+        strcpy(dev->scsiAddr, scsiAddr);
+        strcpy(dev->devName, devName);
+    }
+}
+
+int uevent_recv(const int fd)
+{
+    int count = 0;
+    char buf[UEVENT_BUFFER_SIZE];
+
+    while (true)
+    {
+        struct sockaddr_nl addr;
+        struct iovec iov = { .iov_base = buf, .iov_len = sizeof buf - 1 };
+        struct msghdr msg = { 0 };
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof addr;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        const ssize_t ret = TEMP_FAILURE_RETRY(recvmsg(fd, &msg, 0));
+        if (ret < 0)
+        {
+            if (errno == EAGAIN)
+                break;
+            // ENOBUFS means some events are lost, callers check sysfs again
+            if (errno == ENOBUFS)
+            {
+                g_eventLost = true;
+                continue;
+            }
+            LOG_ERROR("recvmsg %d", errno);
+            return -1;
+        }
+
+        // Only trust messages from kernel
+        if (addr.nl_pid)
+            continue;
+
+        buf[ret] = '\0';
+        uevent_parse(buf, ret);
+        count++;
+    }
+
+    return count;
+}
+
+const char *uevent_lookup(const char *scsiPath)
+{
+    char scsiAddr[UEVENT_NAME_SIZE];
+    if (!uevent_scsi_addr(scsiPath, strlen(scsiPath), scsiAddr))
+        return NULL;
+
+    for (int i = 0; i < UEVENT_MAX_DEVICES; i++)
+    {
+        if (!strcmp(g_devices[i].scsiAddr, scsiAddr))
+            return g_devices[i].devName;
+    }
+
+    return NULL;
+}
+
+int uevent_wait(const int fd, const char *scsiPath, const long timeout)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const long deadline = now.tv_sec * 1000 + now.tv_nsec / 1000000 + timeout;
+
+    while (!uevent_lookup(scsiPath))
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const long remain = deadline - (now.tv_sec * 1000 + now.tv_nsec / 1000000);
+        if (remain <= 0)
+            return -1;
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        const int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, remain));
+        if (ret < 0)
+        {
+            LOG_ERROR("poll %d", errno);
+            return ret;
+        }
+
+        if (ret && uevent_recv(fd) < 0)
+            return -1;
+
+        if (g_eventLost)
+        {
+            g_eventLost = false;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+// This file is part of initrg project.
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+// uevent.h: functions for listening kernel uevents of block devices
+
+#ifndef INITRD_UEVENT_H
+#define INITRD_UEVENT_H
+
+int uevent_open(void);
+int uevent_recv(const int fd);
+const char *uevent_lookup(const char *scsiPath);
+int uevent_wait(const int fd, const char *scsiPath, const long timeout);
+
+#endif // INITRD_UEVENT_H
@@ -15,6 +15,9 @@
 #include <unistd.h>
 
 #include "fs.h"
+#include "metrics.h"
+#include "trace.h"
+#include "uevent.h"
 #include "util.h"
 
 int util_devdelete(const char *scsiPath)
@@ -46,6 +49,11 @@ int util_devpath(const char *scsiPath, char **blkDev)
     struct timespec start, end;
     DIR *dir = NULL;
     struct dirent *dent = NULL;
+    const char *devName = NULL;
+    const long long traceStart = trace_now();
+
+    // Listen before looking at sysfs so that no add event is missed
+    const int ueventFd = uevent_open();
 
     clock_gettime(CLOCK_MONOTONIC, &start);
     while(true)
@@ -61,30 +69,54 @@ int util_devpath(const char *scsiPath, char **blkDev)
             while (dent && dent->d_name[0] == '.');
         }
 
+        if (dent)
+        {
+            devName = dent->d_name;
+            break;
+        }
+
         clock_gettime(CLOCK_MONOTONIC, &end);
-        if (dent || end.tv_nsec - start.tv_nsec
-            + 1000000000 * (end.tv_sec - start.tv_sec) > 15000000000)
+        const long elapsed = end.tv_nsec - start.tv_nsec
+            + 1000000000 * (end.tv_sec - start.tv_sec);
+        if (elapsed > 15000000000)
+            break;
+
+        if (ueventFd < 0)
+        {
+            usleep(10000);
+            continue;
+        }
+
+        // Sleep until kernel announces the disk, rescan if events are lost
+        ret = uevent_wait(ueventFd, scsiPath, (15000000000 - elapsed) / 1000000);
+        if (ret < 0)
+            break;
+        if (!ret)
         {
+            devName = uevent_lookup(scsiPath);
             break;
         }
-        usleep(10000);
     }
 
-    if (dir)
+    ret = -1;
+    if (devName)
     {
-        if (dent)
-        {
-            *blkDev = NULL;
-            ret = asprintf(blkDev, "/dev/%s", dent->d_name);
-        }
-        else
-            LOG_ERROR("readdir %d", errno);
+        *blkDev = NULL;
+        ret = asprintf(blkDev, "/dev/%s", devName);
+    }
+    else if (dir)
+    {
+        LOG_ERROR("readdir(%s) timeout", scsiPath);
     }
     else
-        LOG_ERROR("opendir %d", errno);
+        LOG_ERROR("opendir(%s) %d", scsiPath, errno);
 
     if (dir)
         closedir(dir);
+    if (ueventFd >= 0)
+        close(ueventFd);
+    trace_event("disk", "util_devpath", traceStart, ret);
+    metrics_observe(METRIC_DEVPATH, traceStart);
     return ret;
 }
 
@@ -128,16 +160,13 @@ int util_mkdir(const char *path, const mode_t mode)
     return 0;
 }
 
-int util_mkdtemp(const char *root, char **dest)
+int util_mkdtemp(struct arena *arena, const char *root, char **dest)
 {
-    int ret;
+    int ret = 0;
 
-    ret = asprintf(dest, "%s/wslXXXXXX", root);
-    if (ret < 0)
-    {
-        LOG_ERROR("asprintf(%s)", root);
-        return ret;
-    }
+    *dest = arena_printf(arena, "%s/wslXXXXXX", root);
+    if (!*dest)
+        return -1;
 
     if (!mkdtemp(*dest))
     {